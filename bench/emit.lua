@@ -0,0 +1,83 @@
+--
+-- Signal dispatch benchmark for corelib
+--
+-- Runs corelib outside of the bot, with the few C functions it needs at
+-- load time stubbed out, and times luna.emit_signal() with 100 handlers
+-- split across two signals: 20000 emits of 'raw', 1,000,000 handler calls.
+--
+--   lua bench/emit.lua [corelib.lua]
+--
+-- To compare with another dispatcher, e.g. the corelib.lua from before
+-- luna.emit_signal() kept its handlers in per-signal priority arrays,
+-- save that version somewhere and pass its path:
+--
+--   lua bench/emit.lua /tmp/corelib_old.lua
+--
+local corelib = arg[1] or 'corelib.lua'
+
+local HANDLERS = 100
+local EMITS = 20000
+
+luna = { watched = {}, numerics = {} }
+
+function luna.log(level, msg) end
+function luna.sendline(line, network) end
+function luna.watch_numeric(n, enable) luna.numerics[n] = enable end
+function luna.watch_signal(sig, enable)
+    luna.watched[sig] = enable or nil
+    return true
+end
+
+luna.networks = { get_networks = function() return { 'net' } end }
+luna.scripts = { get_self = function() return 'bench.lua' end }
+
+-- Method tables of the channel handles, filled in by C in the bot
+luna.channel = {}
+luna.channel_user = {}
+
+-- corelib reads the user list when it loads, there is none to read here
+local lines = io.lines
+
+io.lines = function(file, ...)
+    if file == 'users.txt' then
+        return function() end
+    end
+
+    return lines(file, ...)
+end
+
+dofile(corelib)
+
+io.lines = lines
+
+local calls = 0
+
+local function handler(a, b, c, d)
+    calls = calls + 1
+end
+
+-- Every other handler on a signal that isn't emitted, with mixed
+-- priorities so the order actually has to be kept
+for i = 1, HANDLERS do
+    local id = 'h' .. i
+
+    luna.add_raw_signal_handler((i % 2 == 0) and 'raw' or 'ping', id, handler)
+    luna.set_signal_handler_priority(id, (i * 7) % 13)
+end
+
+local params = {}
+
+collectgarbage('collect')
+
+local mem = collectgarbage('count')
+local start = os.clock()
+
+for i = 1, EMITS do
+    luna.emit_signal('raw', 'net', 'pfx', 'CMD', params, 'msg')
+end
+
+local elapsed = os.clock() - start
+local growth = collectgarbage('count') - mem
+
+print(string.format('%s: %.3fs, %d handler calls, %.1f KB heap growth',
+                    corelib, elapsed, calls, growth))
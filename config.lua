@@ -4,3 +4,25 @@ realname = 'Luna the Bot'
 
 server = 'irc.esper.net'
 port = 6667
+
+-- Upper bound in bytes on what each script's Lua state may allocate, it is
+-- left unlimited when not set. Scripts can be given their own limit later
+-- with luna.scripts.set_memory_limit().
+--
+-- script_memory_limit = 8 * 1024 * 1024
+
+-- Time every signal handler and timer of every script, which shows where
+-- the time goes with luna.self.get_profile(). Scripts can also switch it
+-- with luna.self.set_profiling(). With profile_interval set the numbers are
+-- logged every that many seconds while profiling is on.
+--
+-- profiling = true
+-- profile_interval = 300
+
+-- To connect to more than one network, list them instead. Fields left out
+-- fall back to the globals above.
+--
+-- networks = {
+--     { name = 'esper', server = 'irc.esper.net', port = 6667 },
+--     { name = 'freenode', server = 'chat.freenode.net', nick = 'Luna`' },
+-- }
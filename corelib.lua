@@ -3,23 +3,33 @@
 --
 luna.__callbacks = {}
 
+-- Handlers by signal, each an array ordered by priority
+luna.__signals = {}
+
+-- Network the signal currently being handled came from (nil for process
+-- wide signals like idle)
+luna.current_network = nil
+
 --
 -- Command aliases
 --
-function luna.join_channel(where, pass)
+-- All of these take an optional network name as their last parameter and
+-- default to the network of the current signal otherwise
+function luna.join_channel(where, pass, network)
     if not pass then
-        return luna.sendline(string.format('JOIN %s', where))
+        return luna.sendline(string.format('JOIN %s', where), network)
     else
-        return luna.sendline(string.format('JOIN %s :%s', where, pass))
+        return luna.sendline(string.format('JOIN %s :%s', where, pass),
+            network)
     end
 end
 
-function luna.quit(why)
-    return luna.sendline('QUIT :' .. why)
+function luna.quit(why, network)
+    return luna.sendline('QUIT :' .. why, network)
 end
 
-function luna.change_nick(new)
-    return luna.sendline('NICK ' .. new)
+function luna.change_nick(new, network)
+    return luna.sendline('NICK ' .. new, network)
 end
 
 
@@ -50,19 +60,82 @@ end
 -- Types
 --
 
+-- Type for a configured network
+luna.network_meta = {}
+luna.network = {
+    new = function(n)
+        assert(n ~= nil)
+
+        for i, name in ipairs(luna.networks.get_networks()) do
+            if name == n then
+                return setmetatable({ name = n }, luna.network_meta)
+            end
+        end
+
+        error(string.format('no such network %q', n), 2)
+    end,
+
+    get_name = function(self)
+        return self.name
+    end,
+
+    get_info = function(self)
+        return luna.networks.get_network_info(self.name)
+    end,
+
+    sendline = function(self, line, priority)
+        return luna.sendline(line, self.name, priority)
+    end,
+
+    join_channel = function(self, where, pass)
+        return luna.join_channel(where, pass, self.name)
+    end,
+
+    quit = function(self, why)
+        return luna.quit(why, self.name)
+    end,
+
+    change_nick = function(self, new)
+        return luna.change_nick(new, self.name)
+    end,
+
+    get_channels = function(self)
+        local chanlist = {}
+
+        for i, name in ipairs(luna.channels.get_channels(self.name)) do
+            table.insert(chanlist, luna.channel.new(name, self))
+        end
+
+        return chanlist
+    end
+}
+
+luna.network_meta = {
+    __index = luna.network,
+    __tostring = function(self) return self.name end,
+    __eq = function(a, b) return a.name == b.name end
+}
+
+-- Name of the network an object lives on, nil leaves the choice to the API
+function luna.__network_name(obj)
+    return obj.network and obj.network.name
+end
+
 -- Somewhat abstract supertype for anything you can message, not to be
 -- instantiated
 luna.addressable = {
-    privmsg = function(self, what)
+    -- priority is 'interactive' (default) or 'bulk' for long outputs that
+    -- may wait behind replies
+    privmsg = function(self, what, priority)
         return luna.sendline(string.format('PRIVMSG %s :%s',
             self:get_addr(),
-            what))
+            what), luna.__network_name(self), priority)
     end,
 
-    notice = function(self, what)
+    notice = function(self, what, priority)
         return luna.sendline(string.format('NOTICE %s :%s',
             self:get_addr(),
-            what))
+            what), luna.__network_name(self), priority)
     end,
 
     action = function(self, what)
@@ -89,8 +162,11 @@ luna.addressable = {
 -- Type for unknown users (not in a known channel)
 luna.user_meta = {}
 luna.user = setmetatable({
-    new = function(a)
-        return setmetatable({ addr = a }, luna.user_meta)
+    new = function(a, net)
+        return setmetatable({
+            addr = a,
+            network = net or luna.current_network
+        }, luna.user_meta)
     end,
 
     get_nick = function(self)
@@ -130,118 +206,51 @@ luna.user_meta = {
     end,
 
     __eq = function(a, b)
-        return a.addr == b.addr
+        return a.addr == b.addr and a.network == b.network
     end
 }
 
--- Type for a (known, joined) channel
-luna.channel_meta = {}
-luna.channel = setmetatable({
-    new = function(c)
-        assert(c ~= nil)
-
-        for i, name in ipairs(luna.channels.get_channels()) do
-            if name == c then
-                return setmetatable({ name = c }, luna.channel_meta)
-            end
-        end
-
-        error(string.format('no such channel %q', c), 2)
-    end,
-
-    get_name = function(self)
-        return self.name
-    end,
-
-    get_user_mode = function(self, addr)
-        return luna.channels.get_channel_user_info(self.name, addr).modes
-    end,
-
-    -- implement interface for addressable
-    get_addr = function(self)
-        return self:get_name()
-    end,
-
-    get_users = function(self)
-        local userlist = {}
-
-        for i, addr in ipairs(luna.channels.get_channel_users(self.name)) do
-            table.insert(userlist, luna.channel_user:new(self, addr))
-        end
-
-        return userlist
-    end,
-
-    get_modes = function(self)
-        return luna.channels.get_channel_info(self.name).modes
-    end,
-
-    get_topic = function(self)
-        local meta = luna.channels.get_channel_info(self.name)
-
-        return {
-            topic = meta.topic,
-            set_by = meta.topic_set_by,
-            set_at = meta.topic_set_at
-        }
-    end,
-
-    get_created = function(self)
-        return luna.channels.get_channel_info(self.name).created
-    end
-}, {
+-- Type for a (known, joined) channel. The objects are handles the C side
+-- resolves by name on every access, luna.channel holds their methods.
+setmetatable(luna.channel, {
     __index = luna.addressable
 })
 
-luna.channel_meta = {
-    __index = luna.channel,
-    __tostring = function(self) return self.name end,
-    __eq = function(a, b) return a.name == b.name end
-}
-
--- Type for a known user, joined in a known channel
-luna.channel_user_meta = {}
-luna.channel_user = setmetatable({
-    new = function(c, u)
-        assert(c ~= nil)
-
-        ua = nil
+function luna.channel.new(c, net)
+    assert(c ~= nil)
 
-        -- Look it up
-        for i, a in ipairs(luna.channels.get_channel_users(c.name)) do
-            if u == a or a:sub(0, a:find('!') - 1):lower() == u:lower() then
-                ua = a
-                break
-            end
-        end
+    net = net or luna.current_network
 
-        if not ua then
-            error(string.format('no such user %q in channel %q', u, c.name), 2)
-        end
+    local channel = luna.channels.get_channel(c, net and net.name)
 
-        return setmetatable({ channel = c, addr = ua }, luna.channel_user_meta)
-    end,
+    if not channel then
+        error(string.format('no such channel %q', c), 2)
+    end
 
-    get_channel_modes = function(self)
-        return self.channel:get_user_mode(self.addr)
-    end,
+    return channel
+end
 
-    respond = function(self, what)
-        return self.channel:privmsg(self:get_nick() .. ': ' .. what)
-    end
-}, {
+-- Type for a known user, joined in a known channel. Handles as well, the
+-- prefix they report is always the current one.
+setmetatable(luna.channel_user, {
     __index = luna.user
 })
 
-luna.channel_user_meta = {
-    __index = luna.channel_user,
+function luna.channel_user.new(c, u)
+    assert(c ~= nil)
 
-    __tostring = function(self)
-        return self.addr
-    end,
+    local user = luna.channels.get_channel_user(c, u)
 
-    __eq = luna.user_meta.__eq
-}
+    if not user then
+        error(string.format('no such user %q in channel %q', u, c.name), 2)
+    end
+
+    return user
+end
+
+function luna.channel_user.respond(self, what)
+    return self:get_channel():privmsg(self:get_nick() .. ': ' .. what)
+end
 
 
 --
@@ -355,145 +364,132 @@ function luna.add_signal_handler(sig, id, fn)
         idle = fn,
         connect = fn,
         disconnect = fn,
+        ping = fn,
         raw = fn,
 
-        private_message = function(who, where, what)
-            who = luna.user.new(who)
-
-            fn(who, what)
+        private_message = function(ev)
+            fn(luna.user.new(ev.prefix), ev.message, luna.current_network)
         end,
 
-        public_message = function(who, where, what)
-            where = luna.channel.new(where)
-            who = luna.channel_user.new(where, who)
+        public_message = function(ev)
+            local where = luna.channel.new(ev.target)
+            local who = luna.channel_user.new(where, ev.prefix)
 
-            fn(who, where, what)
+            fn(who, where, ev.message, luna.current_network)
         end,
 
-        private_ctcp = function(who, where, what, args)
-            who = luna.user.new(who)
-
-            fn(who, what, args)
+        private_ctcp = function(ev)
+            fn(luna.user.new(ev.prefix), ev.ctcp, ev.args,
+                luna.current_network)
         end,
 
-        private_ctcp_response = function(who, where, what, args)
-            who = luna.user.new(who)
-
-            fn(who, what, args)
+        private_ctcp_response = function(ev)
+            fn(luna.user.new(ev.prefix), ev.ctcp, ev.args,
+                luna.current_network)
         end,
 
-        public_ctcp = function(who, where, what, args)
-            where = luna.channel.new(where)
-            who = luna.channel_user.new(where, who)
+        public_ctcp = function(ev)
+            local where = luna.channel.new(ev.target)
+            local who = luna.channel_user.new(where, ev.prefix)
 
-            fn(who, where, what, args)
+            fn(who, where, ev.ctcp, ev.args, luna.current_network)
         end,
 
-        public_ctcp_response = function(who, where, what, args)
-            where = luna.channel.new(where)
-            who = luna.channel_user.new(where, who)
+        public_ctcp_response = function(ev)
+            local where = luna.channel.new(ev.target)
+            local who = luna.channel_user.new(where, ev.prefix)
 
-            fn(who, where, what, args)
+            fn(who, where, ev.ctcp, ev.args, luna.current_network)
         end,
 
-        private_action = function(who, where, what)
-            who = luna.user.new(who)
-
-            fn(who, what)
+        private_action = function(ev)
+            fn(luna.user.new(ev.prefix), ev.message, luna.current_network)
         end,
 
-        public_action = function(who, where, what)
-            where = luna.channel.new(where)
-            who = luna.channel_user.new(where, who)
+        public_action = function(ev)
+            local where = luna.channel.new(ev.target)
+            local who = luna.channel_user.new(where, ev.prefix)
 
-            fn(who, where, what)
+            fn(who, where, ev.message, luna.current_network)
         end,
 
-        private_command = function(who, where, what, args)
-            who = luna.user.new(who)
-
-            fn(who, what, args)
+        private_command = function(ev)
+            fn(luna.user.new(ev.prefix), ev.command, ev.args,
+                luna.current_network)
         end,
 
-        public_command = function(who, where, what, args)
-            where = luna.channel.new(where)
-            who = luna.channel_user.new(where, who)
+        public_command = function(ev)
+            local where = luna.channel.new(ev.target)
+            local who = luna.channel_user.new(where, ev.prefix)
 
-            fn(who, where, what, args)
+            fn(who, where, ev.command, ev.args, luna.current_network)
         end,
 
-        ping = fn,
-
-        channel_join = function(who, where)
-            where = luna.channel.new(where)
-            who = luna.channel_user.new(where, who)
+        channel_join = function(ev)
+            local where = luna.channel.new(ev.channel)
+            local who = luna.channel_user.new(where, ev.prefix)
 
-            fn(who, where)
+            fn(who, where, luna.current_network)
         end,
 
-        channel_join_sync = function(where)
-            where = luna.channel.new(where)
-
-            fn(where)
+        channel_join_sync = function(ev)
+            fn(luna.channel.new(ev.channel), luna.current_network)
         end,
 
-        channel_part = function(who, where, why)
-            where = luna.channel.new(where)
-            who = luna.channel_user.new(where, who)
+        channel_part = function(ev)
+            local where = luna.channel.new(ev.channel)
+            local who = luna.channel_user.new(where, ev.prefix)
 
-            fn(who, where, why)
+            fn(who, where, ev.message, luna.current_network)
         end,
 
-        user_quit = function(who, why)
-            who = luna.user.new(who)
-
-            fn(who, why)
+        user_quit = function(ev)
+            fn(luna.user.new(ev.prefix), ev.message, luna.current_network)
         end,
 
-        public_notice = function(who, where, what)
-            where = luna.channel.new(where)
-            who = luna.channel_user.new(where, who)
+        public_notice = function(ev)
+            local where = luna.channel.new(ev.target)
+            local who = luna.channel_user.new(where, ev.prefix)
 
-            fn(who, where, what)
+            fn(who, where, ev.message, luna.current_network)
         end,
 
-        private_notice = function(who, where, what)
-            who = luna.user.new(who)
-
-            fn(who, what)
+        private_notice = function(ev)
+            fn(luna.user.new(ev.prefix), ev.message, luna.current_network)
         end,
 
-        nick_change = function(who_old, who_new)
+        nick_change = function(ev)
+            local who_old = ev.prefix
             local addr = who_old:sub(who_old:find('!'), #who_old)
 
-            who_new = luna.user.new(who_new .. addr)
-
-            fn(who_old, who_new)
+            fn(who_old, luna.user.new(ev.nick .. addr), luna.current_network)
         end,
 
-        invite = fn,
+        invite = function(ev)
+            fn(luna.user.new(ev.prefix), ev.channel, luna.current_network)
+        end,
 
-        topic_change = function(who, where, what)
-            where = luna.channel.new(where)
-            who = luna.channel_user.new(where, who)
+        topic_change = function(ev)
+            local where = luna.channel.new(ev.channel)
+            local who = luna.channel_user.new(where, ev.prefix)
 
-            fn(who, where, what)
+            fn(who, where, ev.message, luna.current_network)
         end,
 
-        user_kicked = function(who, where, whom, why)
-            where = luna.channel.new(where)
-            who = luna.channel_user.new(where, who)
-            whom = luna.channel_user.new(where, whom)
+        user_kicked = function(ev)
+            local where = luna.channel.new(ev.channel)
+            local who = luna.channel_user.new(where, ev.prefix)
+            local whom = luna.channel_user.new(where, ev.kicked)
 
-            fn(who, where, whom, why)
+            fn(who, where, whom, ev.message, luna.current_network)
         end,
 
-        script_unload = function(filename)
-            fn(luna.scripts.get_script_info(filename))
+        script_unload = function(ev)
+            fn(luna.scripts.get_script_info(ev.script))
         end,
 
-        script_load = function(filename)
-            fn(luna.scripts.get_script_info(filename))
+        script_load = function(ev)
+            fn(luna.scripts.get_script_info(ev.script))
         end,
     }
 
@@ -504,10 +500,48 @@ function luna.add_signal_handler(sig, id, fn)
     end
 end
 
+-- Number of handlers per signal. C only calls into the script for signals
+-- that have at least one.
+luna.__signal_watchers = {}
+
+-- Milliseconds between two idle signals
+luna.__idle_interval = 250
+
+-- Start or stop C delivering a signal. Idle isn't raised from C, it runs
+-- off a script timer that only exists while something handles it.
+function luna.__watch_signal(sig, enable)
+    if sig ~= 'idle' then
+        return luna.watch_signal(sig, enable)
+    end
+
+    if enable then
+        luna.__idle_timer = luna.timers.every(luna.__idle_interval / 1000,
+            function()
+                luna.emit_signal('idle', nil)
+            end)
+    elseif luna.__idle_timer then
+        luna.timers.cancel(luna.__idle_timer)
+        luna.__idle_timer = nil
+    end
+end
+
 -- Add "unmanaged" signal handler. Handler functions receive the
--- parameters untouched.
+-- parameters untouched. For signals raised from C that is a single event
+-- object with the message fields prefix, command, params, message and
+-- numeric, plus target, channel, ctcp, args, nick, kicked or script where
+-- the signal has them. Fields are only read from C when accessed, and the
+-- object stops working once the signal has been handled, so copy out
+-- whatever is needed later.
 function luna.add_raw_signal_handler(sig, id, fn)
+    local watchers = luna.__signal_watchers
+
+    -- Replacing a handler must release its signal first
+    if luna.__callbacks[id] then
+        luna.delete_signal_handler(id)
+    end
+
     local newhandler = {
+        id = id,
         signal = sig,
         callback = fn,
         enabled = true,
@@ -515,6 +549,48 @@ function luna.add_raw_signal_handler(sig, id, fn)
     }
 
     luna.__callbacks[id] = newhandler
+    luna.__update_signal_handlers(sig, nil, newhandler)
+
+    watchers[sig] = (watchers[sig] or 0) + 1
+
+    if watchers[sig] == 1 then
+        luna.__watch_signal(sig, true)
+    end
+end
+
+-- Add a handler for a numeric reply. Handlers receive the prefix, the
+-- parameters as a table, the trailing message and the network. The numeric
+-- is only forwarded from C while at least one handler wants it.
+luna.__numeric_watchers = {}
+
+function luna.add_numeric_handler(numeric, id, fn)
+    -- Replacing a handler must release its numeric first
+    if luna.__callbacks[id] then
+        luna.delete_signal_handler(id)
+    end
+
+    luna.add_raw_signal_handler('numeric', id, function(ev)
+        if ev.numeric == numeric then
+            fn(ev.prefix, ev.params, ev.message, luna.current_network)
+        end
+    end)
+
+    luna.__callbacks[id].numeric = numeric
+    luna.__count_numeric(numeric, 1)
+end
+
+-- Count a user of a numeric, forwarding it from C while there are any
+function luna.__count_numeric(numeric, delta)
+    local watchers = luna.__numeric_watchers
+    local n = (watchers[numeric] or 0) + delta
+
+    if n > 0 then
+        watchers[numeric] = n
+        luna.watch_numeric(numeric, true)
+    else
+        watchers[numeric] = nil
+        luna.watch_numeric(numeric, false)
+    end
 end
 
 -- Helper function. Get handler or error out.
@@ -538,35 +614,152 @@ end
 
 luna.error_handler = luna.default_error_handler
 
--- Emit a signal, passing an arbitrary amount of parameters to it. Called via C.
-function luna.emit_signal(signal, ...)
-    local handlers = {}
+-- Rebuild the handler array of a signal without drop and with add put
+-- after every handler of lower or equal priority. The array is replaced
+-- rather than changed so an emit in progress keeps the one it started with.
+function luna.__update_signal_handlers(sig, drop, add)
+    local old = luna.__signals[sig] or {}
+    local new = {}
 
-    for id, handler in pairs(luna.__callbacks) do
-        table.insert(handlers, handler)
+    for i = 1, #old do
+        local h = old[i]
+
+        if add and add.priority < h.priority then
+            new[#new + 1] = add
+            add = nil
+        end
+
+        if h ~= drop then
+            new[#new + 1] = h
+        end
     end
 
-    table.sort(handlers, function(a, b)
-        return a.priority < b.priority
-    end)
+    if add then
+        new[#new + 1] = add
+    end
+
+    luna.__signals[sig] = (#new > 0) and new or nil
+end
+
+-- Network objects handed to handlers, one per configured network
+luna.__network_objects = {}
+
+function luna.__get_network(name)
+    local net = luna.__network_objects[name]
+
+    if not net then
+        net = luna.network.new(name)
+        luna.__network_objects[name] = net
+    end
 
-    local args = { ... }
+    return net
+end
+
+-- Arguments of the emits in progress, one frame per nesting level. Frames
+-- and their call functions are kept, so emitting allocates nothing once a
+-- level has been used.
+luna.__emit_frames = {}
+luna.__emit_depth = 0
+
+-- Set from C when luna.self.set_profiling() or the config switches it.
+-- Every handler call is timed then, see luna.self.get_profile()
+luna.__profiling = false
+
+function luna.__get_emit_frame(depth)
+    local frame = luna.__emit_frames[depth]
+
+    if not frame then
+        frame = { n = 0 }
+
+        frame.call = function()
+            return frame.handler.callback(unpack(frame, 1, frame.n))
+        end
+
+        luna.__emit_frames[depth] = frame
+    end
+
+    return frame
+end
+
+-- Emit a signal, passing an arbitrary amount of parameters to it. Called via C
+-- with the name of the originating network, or nil.
+function luna.emit_signal(signal, network, ...)
+    local handlers = luna.__signals[signal]
+
+    if not handlers then
+        return
+    end
+
+    local outer = luna.current_network
+    local depth = luna.__emit_depth + 1
+    local frame = luna.__get_emit_frame(depth)
     local n = select('#', ...)
 
-    for i, handler in ipairs(handlers) do
-        if handler.signal == signal and handler.enabled then
-            xpcall(function()
-                handler.callback(unpack(args))
-            end, luna.error_handler)
+    for i = 1, n do
+        frame[i] = (select(i, ...))
+    end
+
+    frame.n = n
+
+    if network then
+        luna.current_network = luna.__get_network(network)
+    else
+        luna.current_network = nil
+    end
+
+    luna.__emit_depth = depth
+
+    local profiling = luna.__profiling
+
+    for i = 1, #handlers do
+        local handler = handlers[i]
+
+        if handler.enabled then
+            frame.handler = handler
+
+            if profiling then
+                local start = luna.__profile_begin()
+
+                xpcall(frame.call, luna.error_handler)
+                luna.__profile_end(handler, signal, start)
+            else
+                xpcall(frame.call, luna.error_handler)
+            end
         end
     end
+
+    -- Don't keep the arguments alive until the next emit
+    for i = 1, n do
+        frame[i] = nil
+    end
+
+    frame.handler = nil
+
+    luna.__emit_depth = depth - 1
+    luna.current_network = outer
 end
 
 -- Delete a signal handler
 function luna.delete_signal_handler(id)
     if luna.__callbacks[id] then
-        -- disable because the list is cached during iteration
+        local numeric = luna.__callbacks[id].numeric
+        local sig = luna.__callbacks[id].signal
+        local signals = luna.__signal_watchers
+
+        signals[sig] = signals[sig] - 1
+
+        if signals[sig] == 0 then
+            signals[sig] = nil
+            luna.__watch_signal(sig, false)
+        end
+
+        if numeric then
+            luna.__count_numeric(numeric, -1)
+        end
+
+        -- disable because an emit in progress still holds the old array
         luna.__callbacks[id].enabled = false
+        luna.__update_signal_handlers(sig, luna.__callbacks[id], nil)
         luna.__callbacks[id] = nil
     else
         error(string.format('no signal handler with id "%s"', id), 2)
@@ -577,6 +770,9 @@ end
 function luna.set_signal_handler_priority(id, priority)
     luna.__get_signal_handler(id, function(h)
         h.priority = priority or 0
+
+        -- Takes it out and puts it back in its new place
+        luna.__update_signal_handlers(h.signal, h, h)
     end)
 end
 
@@ -587,6 +783,241 @@ function luna.disable_signal_handler(id, state)
     end)
 end
 
+--
+-- Asynchronous handlers
+--
+-- luna.async(fn) wraps fn into a function that runs it as a coroutine each
+-- time it's called, so it can be used as a signal handler. Inside of it
+-- luna.sleep(), luna.await_numeric() and luna.await_line() suspend the
+-- coroutine and return to the event loop, which resumes it once what it
+-- waits for arrives. Event objects passed to the handler are only valid
+-- until the first wait.
+luna.__awaits = {
+    numeric = {}, -- waiters by numeric
+    numerics = 0, -- numeric waiters in total
+    line = {} -- line waiters in the order they started waiting
+}
+
+function luna.async(fn)
+    return function(...)
+        luna.__resume(coroutine.create(fn), luna.current_network, ...)
+    end
+end
+
+-- Suspend the calling coroutine for ms milliseconds
+function luna.sleep(ms)
+    local co = luna.__get_coroutine('luna.sleep')
+    local network = luna.current_network
+
+    luna.timers.after(ms / 1000, function()
+        luna.__resume(co, network)
+    end)
+
+    return coroutine.yield()
+end
+
+-- Wait for one of the numerics (a number or an array of them) from the
+-- current network. Returns the numeric, prefix, parameters and trailing
+-- message, or nil if timeout milliseconds passed first.
+function luna.await_numeric(numerics, timeout)
+    local awaits = luna.__awaits
+    local waiter = luna.__new_waiter('luna.await_numeric', timeout)
+
+    if type(numerics) ~= 'table' then
+        numerics = { numerics }
+    end
+
+    waiter.numerics = numerics
+
+    for _, numeric in ipairs(numerics) do
+        local list = awaits.numeric[numeric] or {}
+
+        list[#list + 1] = waiter
+        awaits.numeric[numeric] = list
+
+        luna.__count_numeric(numeric, 1)
+    end
+
+    awaits.numerics = awaits.numerics + 1
+
+    if awaits.numerics == 1 then
+        luna.add_raw_signal_handler('numeric', '__await_numeric',
+                                    luna.__on_await_numeric)
+    end
+
+    return coroutine.yield()
+end
+
+-- Wait for a line from the current network that matches the Lua pattern.
+-- Returns the line followed by the pattern's captures, or nil if timeout
+-- milliseconds passed first.
+function luna.await_line(pattern, timeout)
+    local awaits = luna.__awaits
+    local waiter = luna.__new_waiter('luna.await_line', timeout)
+
+    waiter.pattern = pattern
+    awaits.line[#awaits.line + 1] = waiter
+
+    if #awaits.line == 1 then
+        luna.add_raw_signal_handler('raw', '__await_line',
+                                    luna.__on_await_line)
+    end
+
+    return coroutine.yield()
+end
+
+-- Resume a coroutine on behalf of a network, reporting its errors the way
+-- handler errors are
+function luna.__resume(co, network, ...)
+    local outer = luna.current_network
+
+    luna.current_network = network
+
+    local ok, e = coroutine.resume(co, ...)
+
+    luna.current_network = outer
+
+    if not ok then
+        luna.error_handler(debug.traceback(co, e))
+    end
+end
+
+function luna.__get_coroutine(caller)
+    local co, main = coroutine.running()
+
+    if not co or main then
+        error(caller .. '() called outside of luna.async()', 3)
+    end
+
+    return co
+end
+
+function luna.__new_waiter(caller, timeout)
+    local waiter = {
+        co = luna.__get_coroutine(caller),
+        network = luna.current_network
+    }
+
+    if timeout then
+        waiter.timer = luna.timers.after(timeout / 1000, function()
+            waiter.timer = nil
+            luna.__wake(waiter)
+        end)
+    end
+
+    return waiter
+end
+
+-- Stop waiting and resume the coroutine with what it waited for
+function luna.__wake(waiter, ...)
+    local awaits = luna.__awaits
+
+    if waiter.timer then
+        luna.timers.cancel(waiter.timer)
+    end
+
+    if waiter.numerics then
+        for _, numeric in ipairs(waiter.numerics) do
+            luna.__remove_waiter(awaits.numeric, numeric, waiter)
+            luna.__count_numeric(numeric, -1)
+        end
+
+        awaits.numerics = awaits.numerics - 1
+
+        if awaits.numerics == 0 then
+            luna.delete_signal_handler('__await_numeric')
+        end
+    else
+        luna.__remove_waiter(awaits, 'line', waiter)
+
+        if not awaits.line then
+            awaits.line = {}
+            luna.delete_signal_handler('__await_line')
+        end
+    end
+
+    luna.__resume(waiter.co, waiter.network, ...)
+end
+
+function luna.__remove_waiter(lists, key, waiter)
+    local list = lists[key]
+
+    for i = 1, #list do
+        if list[i] == waiter then
+            table.remove(list, i)
+            break
+        end
+    end
+
+    if #list == 0 then
+        lists[key] = nil
+    end
+end
+
+function luna.__on_await_numeric(ev)
+    local numeric = ev.numeric
+    local due = {}
+
+    -- Collected first, a woken coroutine may start waiting again
+    for _, waiter in ipairs(luna.__awaits.numeric[numeric] or {}) do
+        if waiter.network == luna.current_network then
+            due[#due + 1] = waiter
+        end
+    end
+
+    if #due == 0 then
+        return
+    end
+
+    local prefix, params, message = ev.prefix, ev.params, ev.message
+
+    for _, waiter in ipairs(due) do
+        luna.__wake(waiter, numeric, prefix, params, message)
+    end
+end
+
+function luna.__on_await_line(ev)
+    local line = nil
+    local due = {}
+
+    for _, waiter in ipairs(luna.__awaits.line) do
+        if waiter.network == luna.current_network then
+            line = line or luna.__format_line(ev)
+
+            local match = { line:match(waiter.pattern) }
+
+            if match[1] then
+                due[#due + 1] = { waiter = waiter, match = match }
+            end
+        end
+    end
+
+    for _, entry in ipairs(due) do
+        luna.__wake(entry.waiter, line, unpack(entry.match))
+    end
+end
+
+-- The line an event was parsed from
+function luna.__format_line(ev)
+    local parts = {}
+
+    if ev.prefix then
+        parts[#parts + 1] = ':' .. ev.prefix
+    end
+
+    parts[#parts + 1] = ev.command
+
+    for _, param in ipairs(ev.params) do
+        parts[#parts + 1] = param
+    end
+
+    if ev.message then
+        parts[#parts + 1] = ':' .. ev.message
+    end
+
+    return table.concat(parts, ' ')
+end
+
 --
 -- Utils
 --
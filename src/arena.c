@@ -0,0 +1,211 @@
+/*
+ * This file is part of Luna
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+/*
+ * Bump-pointer arenas for short-lived allocations.
+ *
+ * Everything allocated while handling one event comes from here and is
+ * released in one go by arena_reset() once the event has been dispatched,
+ * so the hot path never goes through the general allocator. If an event
+ * needs more than one chunk the extra chunks are merged into a single
+ * bigger one on reset, so the arena settles at the size the traffic needs.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "arena.h"
+#include "mm.h"
+
+
+/* Keep everything handed out aligned like malloc() would */
+#define ARENA_ALIGN 16
+#define ARENA_ROUND(n) (((n) + (ARENA_ALIGN - 1)) & ~((size_t)ARENA_ALIGN - 1))
+#define ARENA_DATA(c) ((char *)(c) + ARENA_ROUND(sizeof(arena_chunk)))
+
+
+static arena_chunk *arena_chunk_new(size_t size)
+{
+    arena_chunk *chunk;
+
+    if ((chunk = mm_malloc(ARENA_ROUND(sizeof(*chunk)) + size)) == NULL)
+        return NULL;
+
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = 0;
+
+    return chunk;
+}
+
+static size_t arena_used(arena *a)
+{
+    arena_chunk *cur;
+    size_t used = 0;
+
+    for (cur = a->head; cur != NULL; cur = cur->next)
+        used += cur->used;
+
+    return used;
+}
+
+
+int arena_init(arena **a, size_t chunksize)
+{
+    arena *tmp;
+
+    if ((tmp = mm_malloc(sizeof(*tmp))) == NULL)
+        return 1;
+
+    tmp->chunksize = chunksize ? ARENA_ROUND(chunksize) : ARENA_CHUNKSIZE;
+
+    if ((tmp->head = arena_chunk_new(tmp->chunksize)) == NULL)
+    {
+        mm_free(tmp);
+        return 1;
+    }
+
+    *a = tmp;
+
+    return 0;
+}
+
+void arena_destroy(arena *a)
+{
+    arena_chunk *cur;
+
+    if (a == NULL)
+        return;
+
+    cur = a->head;
+
+    while (cur != NULL)
+    {
+        arena_chunk *next = cur->next;
+
+        mm_free(cur);
+        cur = next;
+    }
+
+    mm_free(a);
+
+    return;
+}
+
+void *arena_alloc(arena *a, size_t n)
+{
+    arena_chunk *chunk = a->head;
+    void *ptr;
+
+    n = ARENA_ROUND(n ? n : 1);
+
+    if ((chunk == NULL) || (chunk->size - chunk->used < n))
+    {
+        /* Start a new chunk in front, the old ones stay valid until the
+         * next reset */
+        size_t size = (n > a->chunksize) ? n : a->chunksize;
+
+        if ((chunk = arena_chunk_new(size)) == NULL)
+            return NULL;
+
+        chunk->next = a->head;
+        a->head = chunk;
+    }
+
+    ptr = ARENA_DATA(chunk) + chunk->used;
+    chunk->used += n;
+
+    return ptr;
+}
+
+char *arena_strndup(arena *a, const char *s, size_t len)
+{
+    char *n = arena_alloc(a, len + 1);
+
+    if (n)
+    {
+        memcpy(n, s, len);
+        n[len] = 0;
+    }
+
+    return n;
+}
+
+char *arena_vsprintf(arena *a, const char *fmt, va_list args)
+{
+    va_list copy;
+    char *n;
+    int len;
+
+    va_copy(copy, args);
+    len = vsnprintf(NULL, 0, fmt, copy);
+    va_end(copy);
+
+    if ((len < 0) || ((n = arena_alloc(a, len + 1)) == NULL))
+        return NULL;
+
+    vsnprintf(n, len + 1, fmt, args);
+
+    return n;
+}
+
+char *arena_sprintf(arena *a, const char *fmt, ...)
+{
+    va_list args;
+    char *n;
+
+    va_start(args, fmt);
+    n = arena_vsprintf(a, fmt, args);
+    va_end(args);
+
+    return n;
+}
+
+void arena_reset(arena *a)
+{
+    size_t used = arena_used(a);
+
+    if (used > a->peak)
+        a->peak = used;
+
+    /* Outgrew a single chunk, replace them all by one that would have
+     * been big enough */
+    if ((a->head != NULL) && (a->head->next != NULL))
+    {
+        arena_chunk *cur = a->head;
+
+        a->spills++;
+
+        while (cur != NULL)
+        {
+            arena_chunk *next = cur->next;
+
+            mm_free(cur);
+            cur = next;
+        }
+
+        a->chunksize = ARENA_ROUND(used);
+        a->head = arena_chunk_new(a->chunksize);
+    }
+
+    if (a->head != NULL)
+        a->head->used = 0;
+
+    return;
+}
@@ -0,0 +1,59 @@
+/*
+ * This file is part of Luna
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdarg.h>
+
+/* Default size of an arena chunk, one IRC line and everything derived from
+ * it should fit comfortably */
+#define ARENA_CHUNKSIZE 4096
+
+typedef struct arena_chunk
+{
+    struct arena_chunk *next;
+    size_t size;
+    size_t used;
+
+    /* Followed by the chunk's memory, from ARENA_ROUND(sizeof(arena_chunk))
+     * bytes in */
+} arena_chunk;
+
+typedef struct arena
+{
+    arena_chunk *head;
+    size_t chunksize;
+
+    size_t peak;    /* Most bytes handed out between two resets */
+    size_t spills;  /* Resets that found more than one chunk in use */
+} arena;
+
+
+int arena_init(arena **, size_t);
+void arena_destroy(arena *);
+
+void *arena_alloc(arena *, size_t);
+char *arena_strndup(arena *, const char *, size_t);
+char *arena_sprintf(arena *, const char *, ...);
+char *arena_vsprintf(arena *, const char *, va_list);
+
+void arena_reset(arena *);
+
+#endif
@@ -19,6 +19,7 @@
 #include <time.h>
 #include <signal.h>
 #include <string.h>
+#include <errno.h>
 
 #include <arpa/inet.h>
 
@@ -26,121 +27,342 @@
 #include "bot.h"
 #include "logger.h"
 #include "net.h"
+#include "event.h"
+#include "resolver.h"
+#include "netio.h"
+#include "arena.h"
 #include "handlers.h"
 
 #include "lua_api/lua_manager.h"
+#include "lua_api/lua_profile.h"
 #include "lua_api/lua_util.h"
 
 
 int *killswitch_ptr = NULL;
 
 void exit_gracefully(int);
-void luna_send_login(luna_state *);
+void luna_send_login(luna_network *);
+void luna_connect(luna_network *);
+void luna_connect_failed(luna_network *);
+void luna_on_connected(luna_network *, int);
+void luna_schedule_reconnect(luna_network *, int);
+void luna_lost_connection(luna_network *);
+void luna_drop_connection(luna_network *);
+int luna_networks_alive(luna_state *);
+
+void luna_on_io(event_loop *, int, int, void *);
+void luna_on_line(luna_network *, const char *, irc_message *);
+void luna_on_liveness(event_loop *, event_timer *, void *);
+void luna_on_reconnect(event_loop *, event_timer *, void *);
 
 
 int luna_mainloop(luna_state *state)
 {
-    fd_set reads;
-    int tries = RECONN_MAX;
+    list_node *cur;
 
     killswitch_ptr = &(state->killswitch);
     state->started = time(NULL);
 
     signal(SIGINT, exit_gracefully);
 
+    /* Write errors are handled where they happen */
+    signal(SIGPIPE, SIG_IGN);
+
+    if (event_init(&(state->loop)) != 0)
+    {
+        logger_log(state->logger, LOGLEV_ERROR, "Failed to create event loop");
+
+        return 1;
+    }
+
+    if (resolver_init(&(state->resolver), state->loop) != 0)
+    {
+        logger_log(state->logger, LOGLEV_ERROR, "Failed to start resolver");
+
+        event_destroy(state->loop);
+        return 1;
+    }
+
+    if (netio_init(&(state->io), state->loop, &luna_on_line,
+                   &luna_lost_connection) != 0)
+    {
+        logger_log(state->logger, LOGLEV_ERROR, "Failed to start I/O thread");
+
+        resolver_destroy(state->resolver);
+        event_destroy(state->loop);
+        return 1;
+    }
+
+    if (arena_init(&(state->scratch), ARENA_CHUNKSIZE) != 0)
+    {
+        logger_log(state->logger, LOGLEV_ERROR, "Failed to create arena");
+
+        netio_destroy(state->io);
+        resolver_destroy(state->resolver);
+        event_destroy(state->loop);
+        return 1;
+    }
+
     /* Try to load base script */
-    if (script_load(state, "bootstrap.lua") != 0)
+    if (script_load(state, "bootstrap.lua", 0) != 0)
     {
         logger_log(state->logger, LOGLEV_ERROR, "Failed to load bootstrapper");
 
+        arena_destroy(state->scratch);
+        netio_destroy(state->io);
+        resolver_destroy(state->resolver);
+        event_destroy(state->loop);
         return 1;
     }
 
-    while (!(state->killswitch))
-    {
-        /* Did we max out all connection attempts? */
-        if (!tries)
-            break;
+    if (profile_start(state) != 0)
+        logger_log(state->logger, LOGLEV_WARNING,
+                   "Unable to schedule profile dumps");
 
-        if (net_connect(state) < 0)
+    /* Bring up every configured network, they all share the one loop */
+    for (cur = state->networks->root; cur != NULL; cur = cur->next)
+        luna_connect((luna_network *)(cur->data));
+
+    /* Sleep until there is something to read or a timer is due, for as long
+     * as any network is either connected or waiting to reconnect */
+    while (!(state->killswitch) && luna_networks_alive(state))
+    {
+        if (event_dispatch(state->loop) < 0)
         {
-            logger_log(state->logger, LOGLEV_ERROR, "Failed to connect #%d",
-                       (RECONN_MAX - tries) + 1);
+            logger_log(state->logger, LOGLEV_ERROR,
+                       "Event loop failure: %s", strerror(errno));
 
-            tries--;
-            continue;
+            break;
         }
+    }
+
+    for (cur = state->networks->root; cur != NULL; cur = cur->next)
+    {
+        luna_network *net = (luna_network *)(cur->data);
 
-        list_init(&(state->channels));
+        event_timer_cancel(state->loop, net->reconnect);
+        net->reconnect = NULL;
 
-        tries = RECONN_MAX;
-        state->connected = time(NULL);
-        time_t last_sign_of_life = time(NULL);
+        net_connect_abort(net);
+        luna_drop_connection(net);
+    }
 
-        logger_log(state->logger, LOGLEV_INFO, "Connected! Sending login.");
+    /* Script timers and threads need the loop, it's going away */
+    script_shutdown(state);
+    profile_stop(state);
 
-        luna_send_login(state);
+    arena_destroy(state->scratch);
+    state->scratch = NULL;
 
-        /* Enter connection loop */
-        while (!(state->killswitch))
-        {
-            struct timeval timeout;
-            int ready;
+    netio_destroy(state->io);
+    state->io = NULL;
 
-            /* Wait a quarter of a second before emitting the "idle" signals */
-            timeout.tv_sec  = 0;
-            timeout.tv_usec = 250000;
+    resolver_destroy(state->resolver);
+    state->resolver = NULL;
 
-            FD_ZERO(&reads);
-            FD_SET(state->fd, &reads);
+    event_destroy(state->loop);
+    state->loop = NULL;
 
-            ready = select(state->fd + 1, &reads, NULL, NULL, &timeout);
+    return 0;
+}
 
-            if ((ready > 0) && (FD_ISSET(state->fd, &reads)))
-            {
-                /* We got data! */
-                irc_message ev;
-                char current_line[LINELEN];
+void luna_connect(luna_network *net)
+{
+    logger_log(net->state->logger, LOGLEV_INFO, "[%s] Connecting to %s:%d",
+               net->name, net->serverinfo.host, net->serverinfo.port);
 
-                memset(current_line, 0, sizeof(current_line));
+    /* Resolving and connecting happen in the background, we hear back in
+     * luna_on_connected() */
+    if (net_connect(net, &luna_on_connected) < 0)
+        luna_connect_failed(net);
 
-                if (net_recvln(state, current_line, sizeof(current_line)) < 0)
-                    break;
+    return;
+}
 
-                logger_log(state->logger, LOGLEV_DEBUG,  "<< %s", current_line);
-                last_sign_of_life = time(NULL);
-                irc_parse_message(current_line, &ev);
+void luna_connect_failed(luna_network *net)
+{
+    luna_state *state = net->state;
 
-                /* Handle events */
-                handle_event(state, &ev);
+    logger_log(state->logger, LOGLEV_ERROR, "[%s] Failed to connect #%d",
+               net->name, (RECONN_MAX - net->tries) + 1);
 
-                /* Cleanup */
-                irc_free_message(&ev);
-            }
-            else
-            {
-                /* Handle idle event */
+    /* Did we max out all connection attempts? */
+    if (--(net->tries) > 0)
+        luna_schedule_reconnect(net, RECONN_DELAY);
+    else
+        logger_log(state->logger, LOGLEV_ERROR, "[%s] Giving up", net->name);
 
-                /* Check if we're alive if the last event was TIMEOUT seconds
-                 * ago, and reconnect if there was an error */
-                if ((time(NULL) - last_sign_of_life) > TIMEOUT)
-                    if (net_sendfln(state, "PING :%s",
-                                    state->serverinfo.host) <= 0)
-                        break;
+    return;
+}
 
-                signal_dispatch(state, "idle", NULL);
-            }
-        }
+void luna_on_connected(luna_network *net, int ok)
+{
+    luna_state *state = net->state;
+
+    if (!ok)
+    {
+        luna_connect_failed(net);
+
+        return;
+    }
+
+    net->last_sign_of_life = time(NULL);
+
+    /* The I/O thread reads, we only ever wait to write */
+    if ((event_add(state->loop, net->fd, EVENT_EDGE, &luna_on_io, net) != 0) ||
+        (netio_attach(state->io, net) != 0))
+    {
+        logger_log(state->logger, LOGLEV_ERROR,
+                   "[%s] Unable to watch connection: %s",
+                   net->name, strerror(errno));
+
+        event_remove(state->loop, net->fd);
+        net_disconnect(net);
+        net->fd = -1;
+
+        luna_connect_failed(net);
+
+        return;
+    }
+
+    net->tries = RECONN_MAX;
+    net->connected = time(NULL);
+
+    net->liveness = event_timer_add(state->loop, TIMEOUT * 1000,
+                                    TIMEOUT * 1000, &luna_on_liveness, net);
+
+    logger_log(state->logger, LOGLEV_INFO, "[%s] Connected! Sending login.",
+               net->name);
+
+    luna_send_login(net);
+
+    return;
+}
+
+void luna_schedule_reconnect(luna_network *net, int delay)
+{
+    if (net->state->killswitch || (net->reconnect != NULL))
+        return;
+
+    net->reconnect = event_timer_add(net->state->loop, delay * 1000, 0,
+                                     &luna_on_reconnect, net);
+
+    return;
+}
+
+void luna_lost_connection(luna_network *net)
+{
+    luna_drop_connection(net);
+    luna_schedule_reconnect(net, 0);
+
+    return;
+}
+
+void luna_drop_connection(luna_network *net)
+{
+    luna_state *state = net->state;
 
-        signal_dispatch(state, "disconnect", NULL);
+    if (net->fd < 0)
+        return;
 
-        list_destroy(state->channels, &channel_free);
-        net_disconnect(state);
+    event_timer_cancel(state->loop, net->liveness);
+    net->liveness = NULL;
+
+    event_remove(state->loop, net->fd);
+    netio_detach(state->io, net);
+
+    signal_dispatch(state, net, LUNA_SIG_DISCONNECT, NULL);
+
+    /* Channel state doesn't survive a reconnect */
+    channel_clear(net);
+
+    net_disconnect(net);
+    net->fd = -1;
+
+    return;
+}
+
+int luna_networks_alive(luna_state *state)
+{
+    list_node *cur;
+
+    for (cur = state->networks->root; cur != NULL; cur = cur->next)
+    {
+        luna_network *net = (luna_network *)(cur->data);
+
+        if ((net->fd >= 0) || (net->connector != NULL) ||
+            (net->reconnect != NULL))
+            return 1;
     }
 
     return 0;
 }
 
+void luna_on_io(event_loop *loop, int fd, int events, void *data)
+{
+    luna_network *net = (luna_network *)data;
+
+    /* Hangups are noticed by the I/O thread, it hands us the lines that
+     * came before first */
+    if ((events & EVENT_WRITE) && (net_flush(net) < 0))
+        luna_lost_connection(net);
+
+    return;
+}
+
+void luna_on_line(luna_network *net, const char *line, irc_message *ev)
+{
+    logger_log(net->state->logger, LOGLEV_DEBUG,  "[%s] << %s",
+               net->name, line);
+
+    /* Parsed by the I/O thread already, NULL if it didn't parse */
+    if (ev != NULL)
+        handle_event(net, ev);
+
+    /* Whatever the handlers needed for this line is garbage now */
+    arena_reset(net->state->scratch);
+
+    return;
+}
+
+void luna_on_liveness(event_loop *loop, event_timer *timer, void *data)
+{
+    luna_network *net = (luna_network *)data;
+    time_t silent = time(NULL) - __atomic_load_n(&(net->last_sign_of_life),
+                                                 __ATOMIC_RELAXED);
+
+    /* Check if we're alive if the last event was TIMEOUT seconds ago, and
+     * reconnect if that didn't get an answer either */
+    if (silent >= 2 * TIMEOUT)
+    {
+        logger_log(net->state->logger, LOGLEV_WARNING,
+                   "[%s] No sign of life for %ld seconds, reconnecting",
+                   net->name, (long)silent);
+
+        luna_lost_connection(net);
+    }
+    else if (silent >= TIMEOUT)
+    {
+        if (net_sendfln(net, NET_PRIO_URGENT, "PING :%s",
+                        net->serverinfo.host) < 0)
+            luna_lost_connection(net);
+    }
+
+    return;
+}
+
+void luna_on_reconnect(event_loop *loop, event_timer *timer, void *data)
+{
+    luna_network *net = (luna_network *)data;
+
+    /* One-shot, the loop disposes of it */
+    net->reconnect = NULL;
+
+    luna_connect(net);
+
+    return;
+}
+
 void exit_gracefully(int sig)
 {
     *killswitch_ptr = 1;
@@ -148,12 +370,12 @@ void exit_gracefully(int sig)
     return;
 }
 
-void luna_send_login(luna_state *state)
+void luna_send_login(luna_network *net)
 {
-    net_sendfln(state, "NICK %s", state->userinfo.nick);
-    net_sendfln(state, "USER %s * 0 :%s",
-                state->userinfo.user,
-                state->userinfo.real);
+    net_sendfln(net, NET_PRIO_URGENT, "NICK %s", net->userinfo.nick);
+    net_sendfln(net, NET_PRIO_URGENT, "USER %s * 0 :%s",
+                net->userinfo.user,
+                net->userinfo.real);
 
     return;
 }
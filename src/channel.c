@@ -22,34 +22,27 @@
 #include "channel.h"
 #include "state.h"
 #include "util.h"
+#include "strmap.h"
+#include "ilist.h"
+#include "vector.h"
 #include "mm.h"
 
 
-/*
- * Linked list search comparators
- */
-int channel_cmp(const void *data, const void *list_data)
-{
-    const char *name = (const char *)data;
-    irc_channel *channel = (irc_channel *)list_data;
+void member_free(irc_member *);
+void member_detach(irc_member *);
+irc_member *member_find(irc_channel *, const char *, size_t);
+irc_user *user_get_or_add(luna_network *, const char *);
+int user_set_prefix(luna_network *, irc_user *, char *);
+void user_release(luna_network *, irc_user *);
 
-    return strcasecmp(name, channel->name);
-}
-
-int user_cmp(const void *data, const void *list_data)
-{
-    const char *name = (const char *)data;
-    irc_user *user = (irc_user *)list_data;
-
-    return irc_user_cmp(name, user->prefix);
-}
 
 /*
- * Linked list deletion deallocators
+ * Deallocators
  */
 void channel_free(void *data)
 {
     irc_channel *channel = (irc_channel *)data;
+    ilist_node *cur = channel->members.head;
     int max = 64;
     int i;
 
@@ -60,44 +53,212 @@ void channel_free(void *data)
             if (channel->flags[i].type == FLAG_STRING)
                 mm_free(channel->flags[i].string);
             else if (channel->flags[i].type == FLAG_LIST)
-                list_destroy(channel->flags[i].list, &mm_free);
+                vector_destroy(channel->flags[i].list, &mm_free);
         }
     }
 
-    list_destroy(channel->users, &user_free);
+    /* The index goes with the channel, no need to unhook members from it */
+    while (cur != NULL)
+    {
+        ilist_node *next = cur->next;
+
+        member_free(ilist_entry(cur, irc_member, in_channel));
+        cur = next;
+    }
+
+    strmap_destroy(channel->index);
     mm_free(channel);
 
     return;
 }
 
-void user_free(void *data)
+void member_free(irc_member *member)
+{
+    irc_user *user = member->user;
+    luna_network *net = member->channel->net;
+
+    ilist_remove(&(user->channels), &(member->in_user));
+    mm_free(member);
+
+    /* Users only exist while they share a channel with us */
+    if (user->channels.length == 0)
+        user_release(net, user);
+
+    return;
+}
+
+void member_detach(irc_member *member)
+{
+    irc_channel *chan = member->channel;
+
+    strmap_remove(chan->index, member->user->prefix, member->user->nicklen);
+    ilist_remove(&(chan->members), &(member->in_channel));
+
+    member_free(member);
+
+    return;
+}
+
+irc_member *member_find(irc_channel *chan, const char *nick, size_t len)
+{
+    return strmap_get(chan->index, nick, len);
+}
+
+/*
+ * User registry
+ */
+irc_user *user_get(luna_network *net, const char *nick)
+{
+    return strmap_get(net->users, nick, irc_nick_len(nick));
+}
+
+irc_user *user_get_or_add(luna_network *net, const char *prefix)
+{
+    irc_user *user = user_get(net, prefix);
+
+    if (user != NULL)
+    {
+        /* Learn the full address if all we knew so far was the nick */
+        if (!strchr(user->prefix, '!') && strchr(prefix, '!'))
+        {
+            char *full = xstrdup(prefix);
+
+            if (full != NULL)
+                user_set_prefix(net, user, full);
+        }
+
+        return user;
+    }
+
+    if ((user = mm_malloc(sizeof(*user))) == NULL)
+        return NULL;
+
+    if ((user->prefix = xstrdup(prefix)) == NULL)
+    {
+        mm_free(user);
+        return NULL;
+    }
+
+    user->nicklen = irc_nick_len(user->prefix);
+    ilist_init(&(user->channels));
+
+    if (strmap_put(net->users, user->prefix, user->nicklen, user) != 0)
+    {
+        mm_free(user->prefix);
+        mm_free(user);
+        return NULL;
+    }
+
+    return user;
+}
+
+int user_set_prefix(luna_network *net, irc_user *user, char *prefix)
+{
+    ilist_node *cur;
+
+    /* The registry and every channel index are keyed by the nick inside
+     * the old prefix, so they all have to let go of it first */
+    strmap_remove(net->users, user->prefix, user->nicklen);
+
+    for (cur = user->channels.head; cur != NULL; cur = cur->next)
+    {
+        irc_member *member = ilist_entry(cur, irc_member, in_user);
+
+        strmap_remove(member->channel->index, user->prefix, user->nicklen);
+    }
+
+    mm_free(user->prefix);
+    user->prefix = prefix;
+    user->nicklen = irc_nick_len(prefix);
+
+    strmap_put(net->users, user->prefix, user->nicklen, user);
+
+    for (cur = user->channels.head; cur != NULL; cur = cur->next)
+    {
+        irc_member *member = ilist_entry(cur, irc_member, in_user);
+
+        strmap_put(member->channel->index, user->prefix, user->nicklen,
+                   member);
+    }
+
+    return 0;
+}
+
+void user_release(luna_network *net, irc_user *user)
 {
-    irc_user *user = (irc_user *)data;
+    strmap_remove(net->users, user->prefix, user->nicklen);
 
     mm_free(user->prefix);
     mm_free(user);
+
+    return;
+}
+
+int user_rename(luna_network *net, const char *oldprefix, const char *newnick)
+{
+    irc_user *user = user_get(net, oldprefix);
+    const char *host;
+    char *newpref;
+
+    if (user == NULL)
+        return 1;
+
+    /* Keep the user@host part */
+    host = user->prefix + user->nicklen;
+
+    if ((newpref = mm_malloc(strlen(newnick) + strlen(host) + 1)) == NULL)
+        return 1;
+
+    strcpy(newpref, newnick);
+    strcat(newpref, host);
+
+    return user_set_prefix(net, user, newpref);
+}
+
+int user_quit(luna_network *net, const char *prefix)
+{
+    irc_user *user = user_get(net, prefix);
+    size_t left;
+
+    if (user == NULL)
+        return 1;
+
+    /* Leave every channel the user was in, leaving the last one frees the
+     * user itself */
+    for (left = user->channels.length; left > 0; --left)
+        member_detach(ilist_entry(user->channels.head, irc_member, in_user));
+
+    return 0;
 }
 
 /*
  * Channel management functions
  */
-int channel_add(luna_state *state, const char *channel_name)
+int channel_add(luna_network *net, const char *channel_name)
 {
-    irc_channel *tmp = (irc_channel *)list_find(state->channels,
-                       (void *)channel_name, &channel_cmp);
+    irc_channel *tmp = channel_get(net, channel_name);
 
     if (!tmp && (tmp = mm_malloc(sizeof(*tmp))))
     {
         strncpy(tmp->name, channel_name, sizeof(tmp->name) - 1);
+        tmp->net = net;
+
+        /* Try creating the userlist index, too */
+        ilist_init(&(tmp->members));
 
-        /* Try creating userlist, too */
-        if (list_init(&(tmp->users)) != 0)
+        if (strmap_init(&(tmp->index), net->casemapping) != 0)
         {
             mm_free(tmp);
             return 1;
         }
 
-        list_push_back(state->channels, tmp);
+        if (strmap_put(net->chanindex, tmp->name, strlen(tmp->name), tmp))
+        {
+            channel_free(tmp);
+            return 1;
+        }
+
+        ilist_push_back(&(net->channels), &(tmp->link));
 
         return 0;
     }
@@ -105,14 +266,17 @@ int channel_add(luna_state *state, const char *channel_name)
     return 1;
 }
 
-int channel_remove(luna_state *state, const char *name)
+int channel_remove(luna_network *net, const char *name)
 {
-    /* Not really a reason to use actual types here */
-    void *channel = NULL;
-    if ((channel = list_find(state->channels, name, &channel_cmp)) != NULL)
+    irc_channel *channel = NULL;
+
+    if ((channel = channel_get(net, name)) != NULL)
     {
         /* Channel was found */
-        list_delete(state->channels, channel, &channel_free);
+        strmap_remove(net->chanindex, channel->name, strlen(channel->name));
+        ilist_remove(&(net->channels), &(channel->link));
+
+        channel_free(channel);
 
         return 0;
     }
@@ -120,14 +284,48 @@ int channel_remove(luna_state *state, const char *name)
     return 1;
 }
 
-irc_channel *channel_get(luna_state *state, const char *name)
+irc_channel *channel_get(luna_network *net, const char *name)
 {
-    return list_find(state->channels, name, &channel_cmp);
+    return strmap_get(net->chanindex, name, strlen(name));
 }
 
-int channel_set_topic(luna_state *state, const char *channel, const char *topic)
+void channel_clear(luna_network *net)
 {
-    irc_channel *chan = list_find(state->channels, channel, &channel_cmp);
+    ilist_node *cur = net->channels.head;
+
+    while (cur != NULL)
+    {
+        ilist_node *next = cur->next;
+
+        channel_free(ilist_entry(cur, irc_channel, link));
+        cur = next;
+    }
+
+    ilist_init(&(net->channels));
+    strmap_clear(net->chanindex);
+
+    return;
+}
+
+int channel_set_casemap(luna_network *net, irc_casemapping casemap)
+{
+    ilist_node *cur;
+
+    net->casemapping = casemap;
+
+    strmap_set_casemap(net->users, casemap);
+    strmap_set_casemap(net->chanindex, casemap);
+
+    for (cur = net->channels.head; cur != NULL; cur = cur->next)
+        strmap_set_casemap(ilist_entry(cur, irc_channel, link)->index,
+                           casemap);
+
+    return 0;
+}
+
+int channel_set_topic(luna_network *net, const char *channel, const char *topic)
+{
+    irc_channel *chan = channel_get(net, channel);
 
     if (chan)
     {
@@ -140,9 +338,9 @@ int channel_set_topic(luna_state *state, const char *channel, const char *topic)
     return 1;
 }
 
-int channel_set_creation_time(luna_state *state, const char *channel, time_t t)
+int channel_set_creation_time(luna_network *net, const char *channel, time_t t)
 {
-    irc_channel *chan = list_find(state->channels, channel, &channel_cmp);
+    irc_channel *chan = channel_get(net, channel);
 
     if (chan)
     {
@@ -154,10 +352,10 @@ int channel_set_creation_time(luna_state *state, const char *channel, time_t t)
     return 1;
 }
 
-int channel_set_topic_meta(luna_state *state, const char *channel,
+int channel_set_topic_meta(luna_network *net, const char *channel,
                            const char *setter, time_t time)
 {
-    irc_channel *chan = list_find(state->channels, channel, &channel_cmp);
+    irc_channel *chan = channel_get(net, channel);
 
     if (chan)
     {
@@ -175,88 +373,70 @@ int channel_set_topic_meta(luna_state *state, const char *channel,
 /*
  * Channel user management functions
  */
-int channel_add_user(luna_state *state, const char *chan_name, const char *pre)
+int channel_add_user(luna_network *net, const char *chan_name, const char *pre)
 {
     irc_channel *chan = NULL;
+    irc_user *user = NULL;
+    irc_member *member = NULL;
 
-    if ((chan = list_find(state->channels, chan_name, &channel_cmp)) != NULL)
-    {
-        irc_user *tmp = (irc_user *)mm_malloc(sizeof(*tmp));
+    if ((chan = channel_get(net, chan_name)) == NULL)
+        return 1;
 
-        if (tmp)
-        {
-            tmp->prefix = xstrdup(pre);
-            list_push_back(chan->users, tmp);
+    if ((user = user_get_or_add(net, pre)) == NULL)
+        return 1;
 
-            return 0;
-        }
-    }
+    /* JOIN and WHO both announce users, only count them once */
+    if (member_find(chan, user->prefix, user->nicklen) != NULL)
+        return 0;
 
-    return 1;
-}
+    if ((member = mm_malloc(sizeof(*member))) == NULL)
+        goto fail;
 
-int channel_remove_user(luna_state *state, const char *chan_name,
-                        const char *nick)
-{
-    irc_channel *chan = NULL;
+    member->user = user;
+    member->channel = chan;
 
-    if ((chan = list_find(state->channels, chan_name, &channel_cmp)) != NULL)
+    if (strmap_put(chan->index, user->prefix, user->nicklen, member) != 0)
     {
-        void *user = NULL;
+        mm_free(member);
+        goto fail;
+    }
 
-        if ((user = list_find(chan->users, nick, &user_cmp)) != NULL)
-        {
-            /* User found */
-            list_delete(chan->users, user, &user_free);
+    ilist_push_front(&(user->channels), &(member->in_user));
+    ilist_push_back(&(chan->members), &(member->in_channel));
 
-            return 0;
-        }
-    }
+    return 0;
+
+fail:
+    if (user->channels.length == 0)
+        user_release(net, user);
 
     return 1;
 }
 
-int channel_rename_user(luna_state *state, const char *oldprefix,
-                        const char *newnick)
+int channel_remove_user(luna_network *net, const char *chan_name,
+                        const char *nick)
 {
-    list_node *cur = NULL;
-
-    for (cur = state->channels->root; cur != NULL; cur = cur->next)
-    {
-        irc_channel *channel = (irc_channel *)(cur->data);
-        irc_user *u = NULL;
+    irc_channel *chan = NULL;
+    irc_member *member = NULL;
 
-        if ((u = list_find(channel->users, oldprefix, &user_cmp)) != NULL)
-        {
-            char *oldpost = strchr(u->prefix, '!');
-            size_t len = strlen(oldpost) + strlen(newnick);;
-            char *newpref = (char *)mm_malloc(len + 1);
+    if ((chan = channel_get(net, chan_name)) == NULL)
+        return 1;
 
-            memset(newpref, 0, len + 1);
-            strncat(newpref, newnick, len + 1);
-            strncat(newpref, oldpost, len + 1);
+    if ((member = member_find(chan, nick, irc_nick_len(nick))) == NULL)
+        return 1;
 
-            mm_free(u->prefix);
-            u->prefix = newpref;
-        }
-    }
+    member_detach(member);
 
     return 0;
 }
 
-irc_user *channel_get_user(luna_state *state, const char *channel,
-                           const char *user)
+irc_member *channel_get_member(luna_network *net, const char *channel,
+                               const char *nick)
 {
-    irc_channel *chan = list_find(state->channels, channel, &channel_cmp);
+    irc_channel *chan = channel_get(net, channel);
 
     if (chan)
-    {
-        void *user_data = list_find(chan->users, (void *)user, &user_cmp);
-
-        if (user_data)
-            return (irc_user *)user_data;
-    }
+        return member_find(chan, nick, irc_nick_len(nick));
 
     return NULL;
 }
-
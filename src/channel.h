@@ -23,6 +23,8 @@
 
 #include "state.h"
 #include "irc.h"
+#include "ilist.h"
+#include "vector.h"
 
 #define FLAG(x) ((x) - 'A')
 
@@ -42,7 +44,7 @@ typedef struct flag
     {
         int bool;
         char *string;
-        linked_list *list;
+        vector *list;
     };
 } flag;
 
@@ -55,35 +57,55 @@ typedef struct irc_channel
     time_t topic_set;
     time_t created;
 
-    linked_list *users;
+    ilist members; /* irc_member, in order of arrival */
+    struct strmap *index; /* The same members by nick */
     flag flags[64]; /* enough to cover flags [a-zA-Z] */
+
+    luna_network *net;
+    ilist_node link; /* In the network's channel list */
 } irc_channel;
 
+/* One per nick on a network, shared by every channel it is seen in. Lives
+ * in the network's user registry for as long as it has memberships. */
 typedef struct irc_user
 {
     char *prefix;
+    size_t nicklen; /* The registry key is the nick part of the prefix */
 
-    char modes[16];
+    ilist channels; /* irc_member, through in_user */
 } irc_user;
 
+/* A user's presence in one channel */
+typedef struct irc_member
+{
+    irc_user *user;
+    irc_channel *channel;
+
+    ilist_node in_channel;
+    ilist_node in_user;
+
+    char modes[16];
+} irc_member;
 
-int channel_cmp(const void *, const void *);
-int user_cmp(const void *, const void *);
 
 void channel_free(void *);
-void user_free(void *);
 
-int channel_add(luna_state *, const char *);
-int channel_remove(luna_state *, const char *);
-irc_channel *channel_get(luna_state *, const char *);
+int channel_add(luna_network *, const char *);
+int channel_remove(luna_network *, const char *);
+irc_channel *channel_get(luna_network *, const char *);
+void channel_clear(luna_network *);
+int channel_set_casemap(luna_network *, irc_casemapping);
+
+int channel_set_topic(luna_network *, const char *, const char *);
+int channel_set_topic_meta(luna_network *, const char *, const char *, time_t);
+int channel_set_creation_time(luna_network *, const char *, time_t);
 
-int channel_set_topic(luna_state *, const char *, const char *);
-int channel_set_topic_meta(luna_state *, const char *, const char *, time_t);
-int channel_set_creation_time(luna_state *, const char *, time_t);
+int channel_add_user(luna_network *, const char *, const char *);
+int channel_remove_user(luna_network *, const char *, const char *);
+irc_member *channel_get_member(luna_network *, const char *, const char *);
 
-int channel_add_user(luna_state *, const char *, const char *);
-int channel_remove_user(luna_state *, const char *, const char *);
-int channel_rename_user(luna_state *, const char *, const char *);
-irc_user *channel_get_user(luna_state *, const char *, const char *);
+irc_user *user_get(luna_network *, const char *);
+int user_rename(luna_network *, const char *, const char *);
+int user_quit(luna_network *, const char *);
 
 #endif
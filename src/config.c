@@ -28,9 +28,12 @@
 #include "mm.h"
 
 
-int config_get_userinfo(luna_state *, lua_State *);
-int config_get_serverinfo(luna_state *, lua_State *);
-int config_get_netinfo(luna_state *, lua_State *);
+void config_get_field(lua_State *, int, const char *);
+const char *config_get_string(lua_State *, int, const char *);
+int config_get_network(luna_state *, lua_State *, int);
+int config_get_userinfo(luna_network *, lua_State *, int);
+int config_get_serverinfo(luna_network *, lua_State *, int);
+int config_get_netinfo(luna_network *, lua_State *, int);
 
 
 int config_load(luna_state *state, const char *filename)
@@ -44,11 +47,72 @@ int config_load(luna_state *state, const char *filename)
 
         if (luaL_dofile(L, filename) == 0)
         {
-            /* Both user and server must be set (== 0) */
-            if (config_get_userinfo(state, L) || config_get_serverinfo(state, L))
-                status = 1;
+            lua_getglobal(L, "networks");
+
+            if (lua_istable(L, -1))
+            {
+                /* networks = { { name = ..., server = ... }, ... } */
+                int networks = lua_gettop(L);
+                int i;
+
+                for (i = 1; !status; ++i)
+                {
+                    lua_rawgeti(L, networks, i);
+
+                    if (lua_isnil(L, -1))
+                        break;
+
+                    if (!lua_istable(L, -1) ||
+                            config_get_network(state, L, lua_gettop(L)))
+                    {
+                        logger_log(state->logger, LOGLEV_ERROR,
+                                   "Invalid network #%d", i);
+
+                        status = 1;
+                    }
+
+                    lua_pop(L, 1);
+                }
+            }
             else
-                config_get_netinfo(state, L);
+            {
+                /* Old style, a single network described by globals */
+#if LUA_VERSION_NUM == 502
+                lua_pushglobaltable(L);
+#else
+                lua_pushvalue(L, LUA_GLOBALSINDEX);
+#endif
+
+                status = config_get_network(state, L, lua_gettop(L));
+            }
+
+            /* Optional, scripts may use as much memory as they like */
+            lua_getglobal(L, "script_memory_limit");
+
+            if (lua_type(L, -1) == LUA_TNUMBER)
+                state->script_memlimit = lua_tonumber(L, -1);
+
+            lua_pop(L, 1);
+
+            /* Optional as well, handlers aren't timed unless asked to */
+            lua_getglobal(L, "profiling");
+            state->profiling = lua_toboolean(L, -1);
+            lua_pop(L, 1);
+
+            lua_getglobal(L, "profile_interval");
+
+            if (lua_type(L, -1) == LUA_TNUMBER)
+                state->profile_interval = lua_tonumber(L, -1);
+
+            lua_pop(L, 1);
+
+            if (!status && (state->networks->length == 0))
+            {
+                logger_log(state->logger, LOGLEV_ERROR,
+                           "No networks configured");
+
+                status = 1;
+            }
         }
         else
         {
@@ -67,26 +131,93 @@ int config_load(luna_state *state, const char *filename)
     return 1;
 }
 
-int config_get_userinfo(luna_state *state, lua_State *L)
+void config_get_field(lua_State *L, int table, const char *key)
+{
+    /* Network tables inherit everything they don't set themselves from the
+     * globals. Leaves the value on the stack. */
+    lua_getfield(L, table, key);
+
+    if (lua_isnil(L, -1))
+    {
+        lua_pop(L, 1);
+        lua_getglobal(L, key);
+    }
+
+    return;
+}
+
+const char *config_get_string(lua_State *L, int table, const char *key)
+{
+    config_get_field(L, table, key);
+
+    return lua_tostring(L, -1);
+}
+
+int config_get_network(luna_state *state, lua_State *L, int table)
+{
+    const char *name = NULL;
+    luna_network *net = NULL;
+    int top = lua_gettop(L);
+
+    if ((net = network_new(state)) == NULL)
+        return 1;
+
+    /* Both user and server must be set (== 0) */
+    if (config_get_userinfo(net, L, table) ||
+            config_get_serverinfo(net, L, table))
+    {
+        lua_settop(L, top);
+        network_free(net);
+
+        return 1;
+    }
+
+    config_get_netinfo(net, L, table);
+
+    /* Networks are named after their server unless told otherwise */
+    lua_getfield(L, table, "name");
+
+    if ((name = lua_tostring(L, -1)) == NULL)
+        name = net->serverinfo.host;
+
+    strncpy(net->name, name, sizeof(net->name) - 1);
+    lua_settop(L, top);
+
+    if (network_get(state, net->name) != NULL)
+    {
+        logger_log(state->logger, LOGLEV_ERROR,
+                   "Duplicate network name `%s'", net->name);
+
+        network_free(net);
+
+        return 1;
+    }
+
+    list_push_back(state->networks, net);
+
+    return 0;
+}
+
+int config_get_userinfo(luna_network *net, lua_State *L, int table)
 {
     const char *nick = NULL;
     const char *user = NULL;
     const char *real = NULL;
 
-    nick = (lua_getglobal(L, "nick"), lua_tostring(L, lua_gettop(L)));
-    user = (lua_getglobal(L, "user"), lua_tostring(L, lua_gettop(L)));
-    real = (lua_getglobal(L, "realname"), lua_tostring(L, lua_gettop(L)));
+    nick = config_get_string(L, table, "nick");
+    user = config_get_string(L, table, "user");
+    real = config_get_string(L, table, "realname");
 
     /* Nick and user can not be empty */
     if ((nick && (strcmp("", nick))) && (user && (strcmp("", user))))
     {
         /* Userinfo okay */
-        strncpy(state->userinfo.nick, nick, sizeof(state->userinfo.nick) - 1);
-        strncpy(state->userinfo.user, user, sizeof(state->userinfo.user) - 1);
+        strncpy(net->userinfo.nick, nick, sizeof(net->userinfo.nick) - 1);
+        strncpy(net->userinfo.user, user, sizeof(net->userinfo.user) - 1);
 
         if (real)
-            strncpy(state->userinfo.real, real,
-                    sizeof(state->userinfo.real) - 1);
+            strncpy(net->userinfo.real, real,
+                    sizeof(net->userinfo.real) - 1);
 
         return 0;
     }
@@ -94,25 +225,24 @@ int config_get_userinfo(luna_state *state, lua_State *L)
     return 1;
 }
 
-int config_get_serverinfo(luna_state *state, lua_State *L)
+int config_get_serverinfo(luna_network *net, lua_State *L, int table)
 {
     const char *host = NULL;
 
-    lua_getglobal(L, "server");
-    host = lua_tostring(L, lua_gettop(L));
+    host = config_get_string(L, table, "server");
 
     /* Server nonempty string, port may be ommited (=6667) */
     if (host && (strcmp("", host)))
     {
-        strncpy(state->serverinfo.host, host,
-                sizeof(state->serverinfo.host) - 1);
+        strncpy(net->serverinfo.host, host,
+                sizeof(net->serverinfo.host) - 1);
 
-        lua_getglobal(L, "port");
+        config_get_field(L, table, "port");
 
         if (lua_type(L, lua_gettop(L)) == LUA_TNUMBER)
-            state->serverinfo.port = lua_tonumber(L, lua_gettop(L));
+            net->serverinfo.port = lua_tonumber(L, lua_gettop(L));
         else
-            state->serverinfo.port = 6667;
+            net->serverinfo.port = 6667;
 
         return 0;
     }
@@ -120,22 +250,22 @@ int config_get_serverinfo(luna_state *state, lua_State *L)
     return 1;
 }
 
-int config_get_netinfo(luna_state *state, lua_State *L)
+int config_get_netinfo(luna_network *net, lua_State *L, int table)
 {
     const char *bind = NULL;
 
-    bind = (lua_getglobal(L, "bind"), lua_tostring(L, lua_gettop(L)));
+    bind = config_get_string(L, table, "bind");
 
     if (bind && strcmp("", bind))
     {
-        if ((state->bind = mm_malloc(strlen(bind) + 1)) == NULL)
+        if ((net->bind = mm_malloc(strlen(bind) + 1)) == NULL)
         {
-            logger_log(state->logger, LOGLEV_WARNING,
+            logger_log(net->state->logger, LOGLEV_WARNING,
                        "Couldn't allocate memory for bind, keeping NULL");
         }
         else
         {
-            strcpy(state->bind, bind);
+            strcpy(net->bind, bind);
         }
     }
 
@@ -0,0 +1,559 @@
+/*
+ * This file is part of Luna
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "event.h"
+#include "linked_list.h"
+#include "mm.h"
+
+
+void event_keep(void *);
+int event_watch_cmp(const void *, const void *);
+int event_rearm(event_loop *);
+void event_run_timers(event_loop *);
+void event_reap(event_loop *);
+void event_wheel_insert(event_loop *, event_timer *);
+void event_wheel_remove(event_loop *, event_timer *);
+int event_wheel_next(event_loop *, uint64_t *);
+void event_wheel_cascade(event_loop *, int, int);
+
+
+int event_init(event_loop **loop)
+{
+    event_loop *tmp = NULL;
+    struct epoll_event ev;
+    int level;
+    int i;
+
+    if ((tmp = mm_malloc(sizeof(*tmp))) == NULL)
+        return 1;
+
+    memset(tmp, 0, sizeof(*tmp));
+
+    tmp->epfd = -1;
+    tmp->timerfd = -1;
+    tmp->tick = event_now();
+
+    for (level = 0; level < EVENT_WHEEL_LEVELS; ++level)
+        for (i = 0; i < EVENT_WHEEL_SIZE; ++i)
+            ilist_init(&(tmp->wheel[level][i]));
+
+    if (((tmp->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) ||
+        ((tmp->timerfd = timerfd_create(CLOCK_MONOTONIC,
+                                        TFD_NONBLOCK | TFD_CLOEXEC)) < 0))
+        goto fail;
+
+    if (list_init(&(tmp->watches)) || list_init(&(tmp->dead_watches)) ||
+        list_init(&(tmp->dead_timers)))
+        goto fail;
+
+    /* The timer fd is the only watch without a record, it's recognized by
+     * its NULL data pointer */
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+
+    if (epoll_ctl(tmp->epfd, EPOLL_CTL_ADD, tmp->timerfd, &ev) < 0)
+        goto fail;
+
+    *loop = tmp;
+
+    return 0;
+
+fail:
+    event_destroy(tmp);
+
+    return 1;
+}
+
+void event_destroy(event_loop *loop)
+{
+    int level;
+    int i;
+
+    for (level = 0; level < EVENT_WHEEL_LEVELS; ++level)
+    {
+        for (i = 0; i < EVENT_WHEEL_SIZE; ++i)
+        {
+            ilist *slot = &(loop->wheel[level][i]);
+
+            while (slot->head != NULL)
+            {
+                event_timer *timer = ilist_entry(slot->head, event_timer,
+                                                 link);
+
+                ilist_remove(slot, &(timer->link));
+                mm_free(timer);
+            }
+        }
+    }
+
+    if (loop->epfd >= 0)
+        close(loop->epfd);
+
+    if (loop->timerfd >= 0)
+        close(loop->timerfd);
+
+    list_destroy(loop->watches, &mm_free);
+    list_destroy(loop->dead_watches, &mm_free);
+    list_destroy(loop->dead_timers, &mm_free);
+
+    mm_free(loop);
+
+    return;
+}
+
+/*
+ * File descriptor watches
+ */
+int event_add(event_loop *loop, int fd, int events, event_io_fn f, void *data)
+{
+    struct epoll_event ev;
+    event_watch *watch = NULL;
+
+    if ((watch = mm_malloc(sizeof(*watch))) == NULL)
+        return 1;
+
+    watch->fd = fd;
+    watch->events = events;
+    watch->callback = f;
+    watch->data = data;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = ((events & EVENT_READ)  ? EPOLLIN  : 0) |
+                ((events & EVENT_WRITE) ? EPOLLOUT : 0) |
+                ((events & EVENT_EDGE)  ? EPOLLET  : 0);
+    ev.data.ptr = watch;
+
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    {
+        mm_free(watch);
+
+        return 1;
+    }
+
+    list_push_back(loop->watches, watch);
+
+    return 0;
+}
+
+int event_modify(event_loop *loop, int fd, int events)
+{
+    struct epoll_event ev;
+    event_watch *watch = list_find(loop->watches, &fd, &event_watch_cmp);
+
+    if (watch == NULL)
+        return 1;
+
+    watch->events = events;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = ((events & EVENT_READ)  ? EPOLLIN  : 0) |
+                ((events & EVENT_WRITE) ? EPOLLOUT : 0) |
+                ((events & EVENT_EDGE)  ? EPOLLET  : 0);
+    ev.data.ptr = watch;
+
+    return epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev) < 0;
+}
+
+int event_remove(event_loop *loop, int fd)
+{
+    event_watch *watch = list_find(loop->watches, &fd, &event_watch_cmp);
+
+    if (watch == NULL)
+        return 1;
+
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+
+    /* Events for it may still be pending in the current batch, so only
+     * disarm it now and free it once the batch is done */
+    watch->callback = NULL;
+
+    list_delete(loop->watches, watch, &event_keep);
+    list_push_back(loop->dead_watches, watch);
+
+    return 0;
+}
+
+/*
+ * Timers
+ */
+event_timer *event_timer_add(event_loop *loop, uint64_t after,
+                             uint64_t interval, event_timer_fn f, void *data)
+{
+    event_timer *timer = NULL;
+
+    if ((timer = mm_malloc(sizeof(*timer))) == NULL)
+        return NULL;
+
+    timer->deadline = event_now() + after;
+    timer->interval = interval;
+
+    /* An empty wheel may have fallen behind the clock, start it afresh */
+    if ((loop->ntimers == 0) && (loop->tick < timer->deadline - after))
+        loop->tick = timer->deadline - after;
+    timer->callback = f;
+    timer->data = data;
+    timer->slot = NULL;
+
+    event_wheel_insert(loop, timer);
+
+    return timer;
+}
+
+void event_timer_cancel(event_loop *loop, event_timer *timer)
+{
+    if ((timer == NULL) || (timer->callback == NULL))
+        return;
+
+    timer->callback = NULL;
+
+    event_wheel_remove(loop, timer);
+    list_push_back(loop->dead_timers, timer);
+
+    return;
+}
+
+/*
+ * Dispatching
+ */
+int event_dispatch(event_loop *loop)
+{
+    struct epoll_event evs[EVENT_BATCH];
+    int ready;
+    int i;
+
+    event_rearm(loop);
+
+    /* Sleep until there is I/O or the timer fd fires */
+    if ((ready = epoll_wait(loop->epfd, evs, EVENT_BATCH, -1)) < 0)
+        return (errno == EINTR) ? 0 : -1;
+
+    for (i = 0; i < ready; ++i)
+    {
+        event_watch *watch = evs[i].data.ptr;
+        int events = 0;
+
+        if (watch == NULL)
+        {
+            uint64_t expirations;
+
+            /* Clear the timer fd, the deadlines themselves are checked
+             * against the clock */
+            while (read(loop->timerfd, &expirations, sizeof(expirations)) > 0)
+                ;
+
+            event_run_timers(loop);
+
+            continue;
+        }
+
+        if (watch->callback == NULL)
+            continue; /* Removed earlier in this batch */
+
+        if (evs[i].events & EPOLLIN)
+            events |= EVENT_READ;
+
+        if (evs[i].events & EPOLLOUT)
+            events |= EVENT_WRITE;
+
+        /* Let readers find out about hangups and errors on their own */
+        if (evs[i].events & (EPOLLERR | EPOLLHUP))
+            events |= EVENT_ERROR | EVENT_READ;
+
+        watch->callback(loop, watch->fd, events, watch->data);
+    }
+
+    event_reap(loop);
+
+    return ready;
+}
+
+uint64_t event_now()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+void event_keep(void *data)
+{
+    /* list_delete() deallocator for records that live on elsewhere */
+    return;
+}
+
+int event_watch_cmp(const void *data, const void *list_data)
+{
+    const int *fd = (const int *)data;
+    const event_watch *watch = (const event_watch *)list_data;
+
+    return *fd != watch->fd;
+}
+
+int event_rearm(event_loop *loop)
+{
+    struct itimerspec its;
+    uint64_t next = 0;
+
+    if (event_wheel_next(loop, &next) != 0)
+        next = 0;
+
+    if (next == loop->armed)
+        return 0;
+
+    /* An all-zero it_value disarms the timer */
+    memset(&its, 0, sizeof(its));
+
+    if (next)
+    {
+        /* A deadline of zero would disarm, so round it up a millisecond */
+        its.it_value.tv_sec = next / 1000;
+        its.it_value.tv_nsec = (next % 1000) * 1000000;
+
+        if (!its.it_value.tv_sec && !its.it_value.tv_nsec)
+            its.it_value.tv_nsec = 1000000;
+    }
+
+    loop->armed = next;
+
+    return timerfd_settime(loop->timerfd, TFD_TIMER_ABSTIME, &its, NULL) < 0;
+}
+
+void event_run_timers(event_loop *loop)
+{
+    uint64_t now = event_now();
+    uint64_t tick;
+
+    /* Jumps straight to the next slot that holds something, empty stretches
+     * cost nothing however long they are */
+    while ((event_wheel_next(loop, &tick) == 0) && (tick <= now))
+    {
+        int level;
+        int index = tick & (EVENT_WHEEL_SIZE - 1);
+        ilist expired;
+        ilist_node *node;
+
+        loop->tick = tick;
+
+        /* Slots of the upper levels are spread out over the lower ones as
+         * their turn comes */
+        for (level = 1; level < EVENT_WHEEL_LEVELS; ++level)
+        {
+            if (tick & ((1ULL << (level * EVENT_WHEEL_BITS)) - 1))
+                break;
+
+            event_wheel_cascade(loop, level,
+                (tick >> (level * EVENT_WHEEL_BITS)) & (EVENT_WHEEL_SIZE - 1));
+        }
+
+        /* Callbacks are free to add and cancel timers, so take the slot's
+         * timers out first. Whatever is added now lands after this tick. */
+        expired = loop->wheel[0][index];
+        ilist_init(&(loop->wheel[0][index]));
+
+        loop->wheel_used[0] &= ~(1ULL << index);
+        loop->ntimers -= expired.length;
+        loop->tick = tick + 1;
+
+        for (node = expired.head; node != NULL; node = node->next)
+            ilist_entry(node, event_timer, link)->slot = &expired;
+
+        while (expired.head != NULL)
+        {
+            event_timer *timer = ilist_entry(expired.head, event_timer, link);
+            event_timer_fn f = timer->callback;
+
+            ilist_remove(&expired, &(timer->link));
+            timer->slot = NULL;
+
+            if (timer->interval)
+            {
+                /* Skip missed periods instead of firing them in a burst */
+                timer->deadline += timer->interval;
+
+                if (timer->deadline <= now)
+                    timer->deadline = now + timer->interval;
+
+                event_wheel_insert(loop, timer);
+            }
+            else
+            {
+                /* One-shot timers stay valid for the duration of the call */
+                event_timer_cancel(loop, timer);
+            }
+
+            f(loop, timer, timer->data);
+        }
+    }
+
+    /* Nothing is due in between, so the wheel may as well catch up */
+    if (loop->tick <= now)
+        loop->tick = now + 1;
+
+    /* Force the timer fd to be re-armed, it has just expired */
+    loop->armed = 0;
+
+    return;
+}
+
+void event_wheel_insert(event_loop *loop, event_timer *timer)
+{
+    uint64_t deadline = timer->deadline;
+    uint64_t delta;
+    int level;
+    int index;
+
+    if (deadline < loop->tick)
+        deadline = loop->tick;
+
+    delta = deadline - loop->tick;
+
+    for (level = 0; level < EVENT_WHEEL_LEVELS - 1; ++level)
+        if (delta < (1ULL << ((level + 1) * EVENT_WHEEL_BITS)))
+            break;
+
+    /* Beyond the top level, park it on its furthest slot until it's near */
+    if (delta >= (1ULL << (EVENT_WHEEL_LEVELS * EVENT_WHEEL_BITS)))
+        deadline = loop->tick +
+                   (1ULL << (EVENT_WHEEL_LEVELS * EVENT_WHEEL_BITS)) - 1;
+
+    index = (deadline >> (level * EVENT_WHEEL_BITS)) & (EVENT_WHEEL_SIZE - 1);
+
+    timer->slot = &(loop->wheel[level][index]);
+    ilist_push_back(timer->slot, &(timer->link));
+
+    loop->wheel_used[level] |= 1ULL << index;
+    loop->ntimers++;
+
+    return;
+}
+
+void event_wheel_remove(event_loop *loop, event_timer *timer)
+{
+    ilist *first = &(loop->wheel[0][0]);
+    ilist *slot = timer->slot;
+
+    if (slot == NULL)
+        return;
+
+    ilist_remove(slot, &(timer->link));
+    timer->slot = NULL;
+
+    /* Or it was already taken out with the rest of an expired slot */
+    if ((slot >= first) &&
+        (slot < first + EVENT_WHEEL_LEVELS * EVENT_WHEEL_SIZE))
+    {
+        int pos = slot - first;
+
+        if (slot->head == NULL)
+            loop->wheel_used[pos / EVENT_WHEEL_SIZE] &=
+                ~(1ULL << (pos % EVENT_WHEEL_SIZE));
+
+        loop->ntimers--;
+    }
+
+    return;
+}
+
+void event_wheel_cascade(event_loop *loop, int level, int index)
+{
+    ilist pending = loop->wheel[level][index];
+
+    ilist_init(&(loop->wheel[level][index]));
+
+    loop->wheel_used[level] &= ~(1ULL << index);
+    loop->ntimers -= pending.length;
+
+    while (pending.head != NULL)
+    {
+        event_timer *timer = ilist_entry(pending.head, event_timer, link);
+
+        ilist_remove(&pending, &(timer->link));
+        event_wheel_insert(loop, timer);
+    }
+
+    return;
+}
+
+int event_wheel_next(event_loop *loop, uint64_t *next)
+{
+    int level;
+    int found = 0;
+
+    if (loop->ntimers == 0)
+        return 1;
+
+    /* A level's slots come up every 64^level milliseconds, on the ticks
+     * that are a multiple of it. The first occupied slot from the next
+     * such tick on is the earliest that level needs attention. */
+    for (level = 0; level < EVENT_WHEEL_LEVELS; ++level)
+    {
+        int shift = level * EVENT_WHEEL_BITS;
+        uint64_t span = 1ULL << shift;
+        uint64_t used = loop->wheel_used[level];
+        uint64_t start;
+        uint64_t when;
+        int base;
+
+        if (used == 0)
+            continue;
+
+        start = (loop->tick + span - 1) & ~(span - 1);
+        base = (start >> shift) & (EVENT_WHEEL_SIZE - 1);
+
+        /* Rotate so the slot at start is bit 0 */
+        if (base)
+            used = (used >> base) | (used << (EVENT_WHEEL_SIZE - base));
+
+        when = start + (uint64_t)__builtin_ctzll(used) * span;
+
+        if (!found || (when < *next))
+            *next = when;
+
+        found = 1;
+    }
+
+    return !found;
+}
+
+void event_reap(event_loop *loop)
+{
+    if (loop->dead_watches->length)
+    {
+        list_destroy(loop->dead_watches, &mm_free);
+        list_init(&(loop->dead_watches));
+    }
+
+    if (loop->dead_timers->length)
+    {
+        list_destroy(loop->dead_timers, &mm_free);
+        list_init(&(loop->dead_timers));
+    }
+
+    return;
+}
@@ -0,0 +1,109 @@
+/*
+ * This file is part of Luna
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef EVENT_H
+#define EVENT_H
+
+#include <stdint.h>
+
+#include "linked_list.h"
+#include "ilist.h"
+
+/* Interest and readiness flags */
+#define EVENT_READ  0x01
+#define EVENT_WRITE 0x02
+#define EVENT_ERROR 0x04 /* Only ever reported, never requested */
+#define EVENT_EDGE  0x08 /* Edge-triggered, callback must drain the fd */
+
+/* Maximum number of readiness events handled per dispatch round */
+#define EVENT_BATCH 64
+
+/* Timer wheel, four levels of 64 slots at a millisecond per slot on the
+ * lowest level. Covers about 4.6 hours, later deadlines wait on the top
+ * level and move down as they come closer. */
+#define EVENT_WHEEL_BITS   6
+#define EVENT_WHEEL_SIZE   (1 << EVENT_WHEEL_BITS)
+#define EVENT_WHEEL_LEVELS 4
+
+typedef struct event_loop event_loop;
+typedef struct event_watch event_watch;
+typedef struct event_timer event_timer;
+
+typedef void (*event_io_fn)(event_loop *, int, int, void *);
+typedef void (*event_timer_fn)(event_loop *, event_timer *, void *);
+
+struct event_watch
+{
+    int fd;
+    int events;
+
+    event_io_fn callback;
+    void *data;
+};
+
+struct event_timer
+{
+    uint64_t deadline; /* Absolute, in milliseconds of the monotonic clock */
+    uint64_t interval; /* Zero for one-shot timers */
+
+    event_timer_fn callback;
+    void *data;
+
+    ilist_node link;
+    ilist *slot; /* List the timer is in, NULL if none */
+};
+
+struct event_loop
+{
+    int epfd;
+    int timerfd;
+
+    uint64_t armed; /* Deadline the timerfd is currently set to, 0 if none */
+
+    linked_list *watches;
+
+    /* Next millisecond the wheel hasn't processed yet */
+    uint64_t tick;
+    size_t ntimers;
+
+    /* Which slots of each level hold timers, one bit each */
+    uint64_t wheel_used[EVENT_WHEEL_LEVELS];
+    ilist wheel[EVENT_WHEEL_LEVELS][EVENT_WHEEL_SIZE];
+
+    /* Watches and timers removed while dispatching, freed afterwards */
+    linked_list *dead_watches;
+    linked_list *dead_timers;
+};
+
+
+int event_init(event_loop **);
+void event_destroy(event_loop *);
+
+int event_add(event_loop *, int, int, event_io_fn, void *);
+int event_modify(event_loop *, int, int);
+int event_remove(event_loop *, int);
+
+event_timer *event_timer_add(event_loop *, uint64_t, uint64_t,
+                             event_timer_fn, void *);
+void event_timer_cancel(event_loop *, event_timer *);
+
+int event_dispatch(event_loop *);
+
+uint64_t event_now();
+
+#endif
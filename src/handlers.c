@@ -21,352 +21,407 @@
 #include <ctype.h>
 
 #include "irc.h"
+#include "handlers.h"
 #include "state.h"
 #include "net.h"
 #include "util.h"
 #include "channel.h"
 #include "mm.h"
+#include "arena.h"
+#include "strmap.h"
 
 #include "lua_api/lua_manager.h"
 #include "lua_api/lua_util.h"
 
 
-char *_strdup(const char *);
-
-int handle_ping(luna_state *,    irc_message *);
-int handle_numeric(luna_state *, irc_message *);
-int handle_privmsg(luna_state *, irc_message *);
-int handle_join(luna_state *,    irc_message *);
-int handle_part(luna_state *,    irc_message *);
-int handle_quit(luna_state *,    irc_message *);
-int handle_notice(luna_state *,  irc_message *);
-int handle_nick(luna_state *,    irc_message *);
-int handle_mode(luna_state *,    irc_message *);
-int handle_invite(luna_state *,  irc_message *);
-int handle_topic(luna_state *,   irc_message *);
-int handle_kick(luna_state *,    irc_message *);
-int handle_unknown(luna_state *, irc_message *);
-int handle_command(luna_state *, irc_message *, const char *, char *);
-int handle_ctcp(luna_state *,    irc_message *, const char *, char *);
-int handle_action(luna_state *,  irc_message *, const char *);
-int handle_server_supports(luna_state *, irc_message *);
-int handle_mode_change(luna_state *, const char *, const char *, char **, int);
-
-int mode_set(luna_state *, const char *, char, const char *);
-int mode_unset(luna_state *, const char *, char, const char *);
-
-
-int handle_event(luna_state *env, irc_message *ev)
+int handle_ping(luna_network *,    irc_message *);
+int handle_numeric(luna_network *, irc_message *);
+int handle_privmsg(luna_network *, irc_message *);
+int handle_join(luna_network *,    irc_message *);
+int handle_part(luna_network *,    irc_message *);
+int handle_quit(luna_network *,    irc_message *);
+int handle_notice(luna_network *,  irc_message *);
+int handle_nick(luna_network *,    irc_message *);
+int handle_mode(luna_network *,    irc_message *);
+int handle_invite(luna_network *,  irc_message *);
+int handle_topic(luna_network *,   irc_message *);
+int handle_kick(luna_network *,    irc_message *);
+int handle_unknown(luna_network *, irc_message *);
+int handle_command(luna_network *, irc_message *, const irc_view *,
+                   const irc_view *);
+int handle_ctcp(luna_network *, irc_message *, const irc_view *,
+                const irc_view *);
+int handle_action(luna_network *, irc_message *, const irc_view *);
+int parse_ctcp(irc_message *, irc_view *, irc_view *);
+int handle_server_supports(luna_network *, irc_message *);
+int handle_mode_change(luna_network *, const char *, const char *, irc_view *,
+                       int, int);
+
+int handle_who_end(luna_network *, irc_message *);
+int handle_end_of_motd(luna_network *, irc_message *);
+int handle_who(luna_network *, irc_message *);
+int handle_topic_reply(luna_network *, irc_message *);
+int handle_topic_meta(luna_network *, irc_message *);
+int handle_channel_modes(luna_network *, irc_message *);
+int handle_channel_created(luna_network *, irc_message *);
+
+int mode_set(luna_network *, const char *, char, const char *);
+int mode_unset(luna_network *, const char *, char, const char *);
+void print_user(void *, void *);
+
+
+typedef int (*irc_handler)(luna_network *, irc_message *);
+
+/* Indexed by the command ID the parser interned */
+static const irc_handler command_handlers[IRC_CMD_COUNT] =
 {
-    signal_dispatch(env, "raw", &luaX_push_raw, ev, NULL);
-
-    /* Core event handlers */
-    if (isdigit(*(ev->m_command)))
-        return handle_numeric(env, ev);
-    else if (!strcmp(ev->m_command, "PING"))
-        return handle_ping(env, ev);
-    else if (!strcmp(ev->m_command, "PRIVMSG"))
-        return handle_privmsg(env, ev);
-    else if (!strcmp(ev->m_command, "JOIN"))
-        return handle_join(env, ev);
-    else if (!strcmp(ev->m_command, "PART"))
-        return handle_part(env, ev);
-    else if (!strcmp(ev->m_command, "QUIT"))
-        return handle_quit(env, ev);
-    else if (!strcmp(ev->m_command, "NOTICE"))
-        return handle_notice(env, ev);
-    else if (!strcmp(ev->m_command, "NICK"))
-        return handle_nick(env, ev);
-    else if (!strcmp(ev->m_command, "MODE"))
-        return handle_mode(env, ev);
-    else if (!strcmp(ev->m_command, "INVITE"))
-        return handle_invite(env, ev);
-    else if (!strcmp(ev->m_command, "TOPIC"))
-        return handle_topic(env, ev);
-    else if (!strcmp(ev->m_command, "KICK"))
-        return handle_kick(env, ev);
-    else
-        return handle_unknown(env, ev);
+    [IRC_CMD_UNKNOWN] = &handle_unknown,
+    [IRC_CMD_NUMERIC] = &handle_numeric,
+    [IRC_CMD_PING]    = &handle_ping,
+    [IRC_CMD_PRIVMSG] = &handle_privmsg,
+    [IRC_CMD_JOIN]    = &handle_join,
+    [IRC_CMD_PART]    = &handle_part,
+    [IRC_CMD_QUIT]    = &handle_quit,
+    [IRC_CMD_NOTICE]  = &handle_notice,
+    [IRC_CMD_NICK]    = &handle_nick,
+    [IRC_CMD_MODE]    = &handle_mode,
+    [IRC_CMD_INVITE]  = &handle_invite,
+    [IRC_CMD_TOPIC]   = &handle_topic,
+    [IRC_CMD_KICK]    = &handle_kick,
+};
+
+/* Indexed by the numeric itself, scripts get theirs through signals */
+static const irc_handler numeric_handlers[IRC_NUMERIC_MAX] =
+{
+    [5]   = &handle_server_supports,  /* ISUPPORT */
+    [315] = &handle_who_end,          /* RPL_ENDOFWHO */
+    [324] = &handle_channel_modes,    /* RPL_CHANNELMODEIS */
+    [329] = &handle_channel_created,  /* RPL_CREATIONTIME */
+    [332] = &handle_topic_reply,      /* RPL_TOPIC */
+    [333] = &handle_topic_meta,       /* RPL_TOPICWHOTIME */
+    [352] = &handle_who,              /* RPL_WHOREPLY */
+    [376] = &handle_end_of_motd,      /* RPL_ENDOFMOTD */
+};
+
+
+int handle_event(luna_network *net, irc_message *ev)
+{
+    signal_dispatch(net->state, net, LUNA_SIG_RAW, &luaX_event_raw, ev, NULL);
 
-    return 0;
+    /* Core event handlers, the parser already interned the command */
+    if (ev->m_id == IRC_CMD_NUMERIC)
+        return handle_numeric(net, ev);
+
+    return command_handlers[ev->m_id](net, ev);
 }
 
-int handle_privmsg(luna_state *env, irc_message *ev)
+int handle_privmsg(luna_network *net, irc_message *ev)
 {
-    char *msgcopy;
-    char *isitme = NULL;
-    char *command = NULL;
+    irc_view ctcp, args;
+    char *colon;
     int priv;
 
-    /* Needs at least the target */
-    if (ev->m_paramcount < 1)
+    /* Needs at least the target and a message */
+    if ((ev->m_paramcount < 1) || (ev->m_msg.ptr == NULL))
         return 1;
 
-    priv = strchr(env->chantypes, ev->m_params[0][0]) == NULL;
-
-    /* Make a copy of the message that we can modify without screwing
-     * later operations */
-    if ((msgcopy = xstrdup(ev->m_msg)) == NULL)
-        return 1;
+    priv = strchr(net->chantypes, ev->m_params[0].ptr[0]) == NULL;
 
     /* Check for CTCP */
-    if ((ev->m_msg[0] == 0x01) && (ev->m_msg[strlen(ev->m_msg) - 1] == 0x01))
-    {
-        char *ctcp = NULL;
-        char *args = NULL;
-        char *j = NULL;
+    if (parse_ctcp(ev, &ctcp, &args))
+        return handle_ctcp(net, ev, &ctcp, &args);
 
-        ev->m_msg[strlen(ev->m_msg) - 1] = '\0';
-        j = ev->m_msg + strlen(ev->m_msg) - 1;
+    /* Check for a "<botnick>: <command> <...>" command */
+    // TODO: Make trigger configurable
+    if ((colon = memchr(ev->m_msg.ptr, ':', ev->m_msg.len)) != NULL)
+    {
+        irc_view isitme, text, command, rest;
 
-        while ((j >= ev->m_msg) && isspace(*j))
-            j--;
+        isitme.ptr = ev->m_msg.ptr;
+        isitme.len = colon - ev->m_msg.ptr;
 
-        *(j + 1) = 0;
+        text.ptr = colon + 1;
+        text.len = ev->m_msg.len - isitme.len - 1;
 
-        ctcp = strtok(ev->m_msg + 1, " ");
-        args = strtok(NULL, "");
+        for (; (text.len > 0) && (*text.ptr == ' '); ++text.ptr, --text.len);
 
-        return handle_ctcp(env, ev, ctcp, args);
-    }
+        if (!irc_view_casecmp(&isitme, net->userinfo.nick))
+        {
+            irc_view_split(&text, &command, &rest);
 
-    /* Check for a "<botnick>: <command> <...>" command */
-    // TODO: Make trigger configurable
-    if  (((isitme = strtok(msgcopy, ":")) != NULL) &&
-            (strcasecmp(isitme, env->userinfo.nick) == 0))
-    {
-        if ((command = strtok(NULL, " ")) != NULL)
-            return handle_command(env, ev, command, strtok(NULL, ""));
+            if (command.len > 0)
+                return handle_command(net, ev, &command, &rest);
+        }
     }
 
     if (priv)
-        signal_dispatch(env, "private_message", &luaX_push_privmsg, ev, NULL);
+        signal_dispatch(net->state, net, LUNA_SIG_PRIVATE_MESSAGE,
+                &luaX_event_privmsg, ev, NULL);
     else
-        signal_dispatch(env, "public_message", &luaX_push_privmsg, ev, NULL);
+        signal_dispatch(net->state, net, LUNA_SIG_PUBLIC_MESSAGE,
+                &luaX_event_privmsg, ev, NULL);
 
     return 0;
 }
 
-int handle_ctcp(luna_state *env, irc_message *ev, const char *ctcp, char *msg)
+int parse_ctcp(irc_message *ev, irc_view *ctcp, irc_view *args)
+{
+    irc_view body;
+
+    if ((ev->m_msg.len < 2) || (ev->m_msg.ptr[0] != 0x01) ||
+        (ev->m_msg.ptr[ev->m_msg.len - 1] != 0x01))
+        return 0;
+
+    body.ptr = ev->m_msg.ptr + 1;
+    body.len = ev->m_msg.len - 2;
+
+    /* Ignore trailing whitespace */
+    while ((body.len > 0) && isspace(body.ptr[body.len - 1]))
+        body.len--;
+
+    irc_view_split(&body, ctcp, args);
+
+    return 1;
+}
+
+int handle_ctcp(luna_network *net, irc_message *ev, const irc_view *ctcp,
+                const irc_view *msg)
 {
-    int priv = strchr(env->chantypes, ev->m_params[0][0]) == NULL;
+    int priv = strchr(net->chantypes, ev->m_params[0].ptr[0]) == NULL;
 
     /* Special case for /ME commands */
-    if (!strcmp(ctcp, "ACTION"))
-        return handle_action(env, ev, msg);
+    if (!irc_view_cmp(ctcp, "ACTION"))
+        return handle_action(net, ev, msg);
 
     if (priv)
     {
-        if (!strcmp(ev->m_command, "PRIVMSG"))
-            signal_dispatch(env, "private_ctcp", &luaX_push_ctcp,
-                    ev, ctcp, msg, NULL);
+        if (!strcmp(ev->m_command.ptr, "PRIVMSG"))
+            signal_dispatch(net->state, net, LUNA_SIG_PRIVATE_CTCP,
+                    &luaX_event_ctcp, ev, ctcp, msg, NULL);
 
-        else if (!strcmp(ev->m_command, "NOTICE"))
-            signal_dispatch(env, "private_ctcp_response", &luaX_push_ctcp_rsp,
-                    ev, ctcp, msg, NULL);
+        else if (!strcmp(ev->m_command.ptr, "NOTICE"))
+            signal_dispatch(net->state, net, LUNA_SIG_PRIVATE_CTCP_RESPONSE,
+                    &luaX_event_ctcp_rsp, ev, ctcp, msg, NULL);
     }
     else
     {
-        if (!strcmp(ev->m_command, "PRIVMSG"))
-            signal_dispatch(env, "public_ctcp", &luaX_push_ctcp,
-                    ev, ctcp, msg, NULL);
+        if (!strcmp(ev->m_command.ptr, "PRIVMSG"))
+            signal_dispatch(net->state, net, LUNA_SIG_PUBLIC_CTCP,
+                    &luaX_event_ctcp, ev, ctcp, msg, NULL);
 
-        else if (!strcmp(ev->m_command, "NOTICE"))
-            signal_dispatch(env, "public_ctcp_response", &luaX_push_ctcp_rsp,
-                    ev, ctcp, msg, NULL);
+        else if (!strcmp(ev->m_command.ptr, "NOTICE"))
+            signal_dispatch(net->state, net, LUNA_SIG_PUBLIC_CTCP_RESPONSE,
+                    &luaX_event_ctcp_rsp, ev, ctcp, msg, NULL);
     }
 
     return 0;
 }
 
-int handle_action(luna_state *env, irc_message *ev, const char *message)
+int handle_action(luna_network *net, irc_message *ev, const irc_view *message)
 {
-    int priv = strchr(env->chantypes, ev->m_params[0][0]) == NULL;
+    int priv = strchr(net->chantypes, ev->m_params[0].ptr[0]) == NULL;
 
     if (priv)
-        signal_dispatch(env, "private_action", &luaX_push_action,
-                ev, message, NULL);
+        signal_dispatch(net->state, net, LUNA_SIG_PRIVATE_ACTION,
+                &luaX_event_action, ev, message, NULL);
     else
-        signal_dispatch(env, "public_action", &luaX_push_action,
-                ev, message, NULL);
+        signal_dispatch(net->state, net, LUNA_SIG_PUBLIC_ACTION,
+                &luaX_event_action, ev, message, NULL);
 
     return 0;
 }
 
-int handle_command(luna_state *env, irc_message *ev, const char *cmd, char *rest)
+int handle_command(luna_network *net, irc_message *ev, const irc_view *cmd,
+                   const irc_view *rest)
 {
-    int priv = strchr(env->chantypes, ev->m_params[0][0]) == NULL;
+    int priv = strchr(net->chantypes, ev->m_params[0].ptr[0]) == NULL;
 
     if (priv)
-        signal_dispatch(env, "private_command", &luaX_push_command,
-                ev, cmd, rest, NULL);
+        signal_dispatch(net->state, net, LUNA_SIG_PRIVATE_COMMAND,
+                &luaX_event_command, ev, cmd, rest, NULL);
     else
-        signal_dispatch(env, "public_command", &luaX_push_command,
-                ev, cmd, rest, NULL);
+        signal_dispatch(net->state, net, LUNA_SIG_PUBLIC_COMMAND,
+                &luaX_event_command, ev, cmd, rest, NULL);
 
     return 0;
 }
 
-int handle_ping(luna_state *env, irc_message *ev)
+int handle_ping(luna_network *net, irc_message *ev)
 {
-    const char *pingstr;
+    if ((ev->m_msg.ptr == NULL) && (ev->m_paramcount < 1))
+        return 1;
+
+    /* Answered by the I/O thread as soon as it came in, see netio_ping() */
+    signal_dispatch(net->state, net, LUNA_SIG_PING, NULL);
+
+    return 0;
+}
+
+void print_user(void *_net, void *_member)
+{
+    luna_network *net = _net;
+    irc_member *member = _member;
+
+    logger_log(net->state->logger, LOGLEV_DEBUG, "-> '%s' = %s",
+               member->user->prefix, member->modes);
+}
+
+int handle_numeric(luna_network *net, irc_message *ev)
+{
+    irc_handler handler = numeric_handlers[ev->m_numeric];
+    int result = 0;
+
+    if (handler != NULL)
+        result = handler(net, ev);
 
-    if ((ev->m_msg == NULL) && (ev->m_paramcount < 1))
+    /* Scripts only hear about the numerics they asked for */
+    signal_dispatch_numeric(net->state, net, ev);
+
+    return result;
+}
+
+int handle_who_end(luna_network *net, irc_message *ev)
+{
+    irc_member *target = NULL;
+    irc_channel *chan = NULL;
+    ilist_node *cur;
+
+    /* param 0: me
+     * param 1: channel
+     */
+    if (ev->m_paramcount < 2)
+        return 1;
+
+    if ((chan = channel_get(net, ev->m_params[1].ptr)) == NULL)
         return 1;
 
-    pingstr = (ev->m_paramcount > 0) ? ev->m_params[0] : ev->m_msg;
-    net_sendfln(env, "PONG :%s", pingstr);
+    target = channel_get_member(net, ev->m_params[1].ptr,
+                                ev->m_params[0].ptr);
 
-    signal_dispatch(env, "ping", NULL);
+    logger_log(net->state->logger, LOGLEV_DEBUG, "Joined channel '%s'",
+            chan->name);
+    for (cur = chan->members.head; cur != NULL; cur = cur->next)
+        print_user(net, ilist_entry(cur, irc_member, in_channel));
+    logger_log(net->state->logger, LOGLEV_DEBUG,
+            "Topic: '%s' (Set %d by %s)",
+            chan->topic, chan->topic_set, chan->topic_setter);
+
+    if (target)
+        signal_dispatch(net->state, net, LUNA_SIG_CHANNEL_JOIN_SYNC,
+                &luaX_event_join_sync, ev, NULL);
 
     return 0;
 }
 
-void print_user(void *_env, void *_user)
+int handle_end_of_motd(luna_network *net, irc_message *ev)
 {
-    luna_state *env = _env;
-    irc_user *user = _user;
+    /* Dispatch connect event */
+    signal_dispatch(net->state, net, LUNA_SIG_CONNECT, NULL);
+    net_sendfln(net, NET_PRIO_INTERACTIVE, "JOIN #luna");
 
-    logger_log(env->logger, LOGLEV_DEBUG, "-> '%s' = %s", user->prefix, user->modes);
+    return 0;
 }
 
-int handle_numeric(luna_state *env, irc_message *ev)
+int handle_who(luna_network *net, irc_message *ev)
 {
-    int i = 0;
-    int numeric = atoi(ev->m_command);
+    irc_member *target = NULL;
+    char *prefix;
+    int i;
 
-    irc_user *target = NULL;
+    /* param : me
+     * param : channel
+     * param : user
+     * param : host
+     * param : server
+     * param : nick
+     * param : modestr
+     * msg: <ops> <realname> */
+    if (ev->m_paramcount < 7)
+        return 1;
 
-    switch (numeric)
-    {
-    case 5: /* ISUPPORT */
-        handle_server_supports(env, ev);
+    /* Only needed until channel_add_user() has made its own copy */
+    prefix = arena_sprintf(net->state->scratch, "%s!%s@%s",
+                           ev->m_params[5].ptr,
+                           ev->m_params[2].ptr,
+                           ev->m_params[3].ptr);
 
-        break;
+    if (prefix == NULL)
+        return 1;
 
-    case 315: /* WHO End */
+    channel_add_user(net, ev->m_params[1].ptr, prefix);
+    target = channel_get_member(net, ev->m_params[1].ptr,
+                                ev->m_params[5].ptr);
 
-        /* param 0: me
-         * param 1: channel
-         */
-        if (ev->m_paramcount < 2)
-            return 1;
-
-        target = channel_get_user(env, ev->m_params[1], ev->m_params[0]);
-        irc_channel *chan = channel_get(env, ev->m_params[1]);
-
-        logger_log(env->logger, LOGLEV_DEBUG, "Joined channel '%s'",
-                chan->name);
-        list_map(chan->users, &print_user, env);
-        logger_log(env->logger, LOGLEV_DEBUG, "Topic: '%s' (Set %d by %s)",
-                chan->topic, chan->topic_set, chan->topic_setter);
-
-        if (target)
-            signal_dispatch(env, "channel_join_sync", &luaX_push_join_sync,
-                            ev, NULL);
-
-        break;
-
-    case 376:
-        /* Dispatch connect event */
-        signal_dispatch(env, "connect", NULL);
-        net_sendfln(env, "JOIN #luna");
-
-        break;
-
-    case 352: /* RPL_WHO */
-
-        /* param : me
-         * param : channel
-         * param : user
-         * param : host
-         * param : server
-         * param : nick
-         * param : modestr
-         * msg: <ops> <realname> */
-        if (ev->m_paramcount < 7)
-            return 1;
-
-        char prefix[128] = {0};
-        snprintf(prefix, sizeof(prefix), "%s!%s@%s",
-                ev->m_params[5],
-                ev->m_params[2],
-                ev->m_params[3]);
-
-        channel_add_user(env, ev->m_params[1], prefix);
-        target = channel_get_user(env, ev->m_params[1], ev->m_params[5]);
-
-        if (target)
-        {
-            int max = sizeof(env->userprefix) / sizeof(env->userprefix[0]);
-            char *mode = ev->m_params[6];
+    if (target)
+    {
+        int max = sizeof(net->userprefix) / sizeof(net->userprefix[0]);
+        char *mode = ev->m_params[6].ptr;
 
-            while (*mode++)
+        while (*mode++)
+        {
+            for (i = 0; ((i < max) && (net->userprefix[i].prefix != 0)); ++i)
             {
-                for (i = 0; ((i < max) && (env->userprefix[i].prefix != 0));
-                        ++i)
+                if (net->userprefix[i].prefix == *mode)
                 {
-                    if (env->userprefix[i].prefix == *mode)
-                    {
-                        int len = strlen(target->modes);
-                        target->modes[len] = env->userprefix[i].mode;
-                        target->modes[len + 1] = 0;
-                    }
+                    int len = strlen(target->modes);
+                    target->modes[len] = net->userprefix[i].mode;
+                    target->modes[len + 1] = 0;
                 }
             }
         }
+    }
 
-        break;
-
-    case 332: /* TOPIC */
-
-        if (ev->m_paramcount < 2)
-            return 1;
-
-        channel_set_topic(env, ev->m_params[1], ev->m_msg);
-
-        break;
-
-    case 333: /* TOPIC META */
-
-        if (ev->m_paramcount < 4)
-            return 1;
+    return 0;
+}
 
-        channel_set_topic_meta(env,
-                ev->m_params[1],
-                ev->m_params[2],
-                atoi(ev->m_params[3]));
+int handle_topic_reply(luna_network *net, irc_message *ev)
+{
+    if (ev->m_paramcount < 2)
+        return 1;
 
-        break;
+    channel_set_topic(net, ev->m_params[1].ptr, ev->m_msg.ptr);
 
-    case 324: /* REPL_MODE */
+    return 0;
+}
 
-        /* <server> 324 <me> <channel> <flags> [param[,param[,...]]] */
-        if (ev->m_paramcount < 3)
-            return 1;
+int handle_topic_meta(luna_network *net, irc_message *ev)
+{
+    if (ev->m_paramcount < 4)
+        return 1;
 
-        handle_mode_change(env,
-                ev->m_params[1],
-                ev->m_params[2],
-                ev->m_params, 3);
+    channel_set_topic_meta(net,
+            ev->m_params[1].ptr,
+            ev->m_params[2].ptr,
+            atoi(ev->m_params[3].ptr));
 
-        break;
+    return 0;
+}
 
-    case 329: /* REPL_MODE2 */
+int handle_channel_modes(luna_network *net, irc_message *ev)
+{
+    /* <server> 324 <me> <channel> <flags> [param[,param[,...]]] */
+    if (ev->m_paramcount < 3)
+        return 1;
 
-        /* :aperture.esper.net 329 Luna^ #lulz2 1298798377 */
-        if (ev->m_paramcount < 3)
-            return 1;
+    return handle_mode_change(net,
+            ev->m_params[1].ptr,
+            ev->m_params[2].ptr,
+            ev->m_params, ev->m_paramcount, 3);
+}
 
-        channel_set_creation_time(env, ev->m_params[1], atoi(ev->m_params[2]));
+int handle_channel_created(luna_network *net, irc_message *ev)
+{
+    /* :aperture.esper.net 329 Luna^ #lulz2 1298798377 */
+    if (ev->m_paramcount < 3)
+        return 1;
 
-        break;
-    }
+    channel_set_creation_time(net, ev->m_params[1].ptr,
+                              atoi(ev->m_params[2].ptr));
 
     return 0;
 }
 
-int handle_join(luna_state *env, irc_message *ev)
+int handle_join(luna_network *net, irc_message *ev)
 {
     const char *c;
 
@@ -374,138 +429,128 @@ int handle_join(luna_state *env, irc_message *ev)
      * Some IRC servers are weird like that and put the joined channel
      * into the trailing message.
      */
-    if ((ev->m_msg == NULL) && ev->m_paramcount < 1)
+    if ((ev->m_msg.ptr == NULL) && ev->m_paramcount < 1)
         return 1;
 
-    c = ev->m_msg ? ev->m_msg : ev->m_params[0];
+    c = ev->m_msg.ptr ? ev->m_msg.ptr : ev->m_params[0].ptr;
 
     /* Is it me? */
-    if (!irc_user_cmp(ev->m_prefix, env->userinfo.nick))
+    if (!irc_user_cmp(net->casemapping, ev->m_prefix.ptr,
+                      net->userinfo.nick))
     {
         /* Yes! Add channel to list */
-        channel_add(env, c);
+        channel_add(net, c);
 
-        /* Query userlist and modes */
-        net_sendfln(env, "MODE %s", c);
-        net_sendfln(env, "WHO %s", c);
+        /* Query userlist and modes, ahead of bulk output since scripts
+         * depend on them */
+        net_sendfln(net, NET_PRIO_INTERACTIVE, "MODE %s", c);
+        net_sendfln(net, NET_PRIO_INTERACTIVE, "WHO %s", c);
     }
     else
     {
         /* Nah, add user to channel */
-        channel_add_user(env, c, ev->m_prefix);
+        channel_add_user(net, c, ev->m_prefix.ptr);
 
-        signal_dispatch(env, "channel_join", &luaX_push_join, ev, NULL);
+        signal_dispatch(net->state, net, LUNA_SIG_CHANNEL_JOIN,
+                &luaX_event_join, ev, NULL);
     }
 
     return 0;
 }
 
-int handle_part(luna_state *env, irc_message *ev)
+int handle_part(luna_network *net, irc_message *ev)
 {
     if (ev->m_paramcount < 1)
         return 1;
 
-    signal_dispatch(env, "channel_part", &luaX_push_part, ev, NULL);
+    signal_dispatch(net->state, net, LUNA_SIG_CHANNEL_PART, &luaX_event_part,
+            ev, NULL);
 
     /* Is it me? */
-    if (!irc_user_cmp(ev->m_prefix, env->userinfo.nick))
+    if (!irc_user_cmp(net->casemapping, ev->m_prefix.ptr,
+                      net->userinfo.nick))
         /* Yes! Remove channel from list */
-        channel_remove(env, ev->m_params[0]);
+        channel_remove(net, ev->m_params[0].ptr);
     else
         /* Nah, remove user from channel */
-        channel_remove_user(env, ev->m_params[0], ev->m_prefix);
+        channel_remove_user(net, ev->m_params[0].ptr, ev->m_prefix.ptr);
 
     return 0;
 }
 
-int handle_quit(luna_state *env, irc_message *ev)
+int handle_quit(luna_network *net, irc_message *ev)
 {
-    /* Remove user from all channels */
-    list_node *cur;
-
-    for (cur = env->channels->root; cur != NULL; cur = cur->next)
-    {
-        irc_channel *channel = (irc_channel *)(cur->data);
-        channel_remove_user(env, channel->name, ev->m_prefix);
-    }
+    /* Remove user from the channels it was in */
+    user_quit(net, ev->m_prefix.ptr);
 
-    signal_dispatch(env, "user_quit", &luaX_push_quit, ev, NULL);
+    signal_dispatch(net->state, net, LUNA_SIG_USER_QUIT, &luaX_event_quit, ev,
+            NULL);
 
     return 0;
 }
 
-int handle_notice(luna_state *env, irc_message *ev)
+int handle_notice(luna_network *net, irc_message *ev)
 {
+    irc_view ctcp, args;
     int priv;
 
     if (ev->m_paramcount < 1)
         return 1;
 
-    if (env->chantypes)
-        priv = strchr(env->chantypes, ev->m_params[0][0]) == NULL;
+    if (net->chantypes)
+        priv = strchr(net->chantypes, ev->m_params[0].ptr[0]) == NULL;
     else
         priv = 1;
 
     /* CTCP response? */
-    if ((ev->m_msg[0] == 0x01) && (ev->m_msg[strlen(ev->m_msg) - 1] == 0x01))
+    if (parse_ctcp(ev, &ctcp, &args))
     {
-        char *ctcp;
-        char *args;
-        char *j;
-
-        ev->m_msg[strlen(ev->m_msg) - 1] = '\0';
-
-        j = ev->m_msg + strlen(ev->m_msg) - 1;
-
-        while ((j >= ev->m_msg) && isspace(*j))
-            j--;
-
-        *(j + 1) = 0;
-
-        ctcp = strtok(ev->m_msg + 1, " ");
-        args = strtok(NULL, "");
-
-        return handle_ctcp(env, ev, ctcp, args);
+        return handle_ctcp(net, ev, &ctcp, &args);
     }
     else
     {
         if (priv)
-            signal_dispatch(env, "private_notice", &luaX_push_notice, ev, NULL);
+            signal_dispatch(net->state, net, LUNA_SIG_PRIVATE_NOTICE,
+                    &luaX_event_notice, ev, NULL);
         else
-            signal_dispatch(env, "public_notice", &luaX_push_notice, ev, NULL);
+            signal_dispatch(net->state, net, LUNA_SIG_PUBLIC_NOTICE,
+                    &luaX_event_notice, ev, NULL);
     }
 
     return 0;
 }
 
-int handle_nick(luna_state *env, irc_message *ev)
+int handle_nick(luna_network *net, irc_message *ev)
 {
-    const char *newnick;
+    const irc_view *newnick;
 
     /*
      * Again, weird IRC servers.
      */
-    if ((ev->m_msg == NULL) && (ev->m_paramcount < 1))
+    if ((ev->m_msg.ptr == NULL) && (ev->m_paramcount < 1))
         return 1;
 
-    newnick = ev->m_msg ? ev->m_msg : ev->m_params[0];
+    newnick = ev->m_msg.ptr ? &(ev->m_msg) : &(ev->m_params[0]);
 
     /* Is it me? */
-    if (!irc_user_cmp(ev->m_prefix, env->userinfo.nick))
+    if (!irc_user_cmp(net->casemapping, ev->m_prefix.ptr,
+                      net->userinfo.nick))
     {
         /* Rename myself internally */
-        memset(env->userinfo.nick, 0, sizeof(env->userinfo.nick));
-        strncpy(env->userinfo.nick, newnick, sizeof(env->userinfo.nick) - 1);
+        memset(net->userinfo.nick, 0, sizeof(net->userinfo.nick));
+        strncpy(net->userinfo.nick, newnick->ptr,
+                sizeof(net->userinfo.nick) - 1);
     }
 
-    /* Rename user in all channels */
-    channel_rename_user(env, ev->m_prefix, newnick);
-    signal_dispatch(env, "nick_change", &luaX_push_nick, ev, newnick, NULL);
+    /* Every channel shares the one record */
+    user_rename(net, ev->m_prefix.ptr, newnick->ptr);
+    signal_dispatch(net->state, net, LUNA_SIG_NICK_CHANGE, &luaX_event_nick, ev,
+            newnick, NULL);
 
     return 0;
 }
 
-int handle_mode(luna_state *env, irc_message *ev)
+int handle_mode(luna_network *net, irc_message *ev)
 {
     /* <sender> MODE <channel> <flags> [param[,param[,...]]] */
 
@@ -513,101 +558,107 @@ int handle_mode(luna_state *env, irc_message *ev)
         return 1;
 
     /* If not me... */
-    if (strcasecmp(ev->m_params[0], env->userinfo.nick))
-        handle_mode_change(env,
-                ev->m_params[0],
-                ev->m_params[1],
-                ev->m_params, 2);
+    if (irc_user_cmp(net->casemapping, ev->m_params[0].ptr,
+                     net->userinfo.nick))
+        handle_mode_change(net,
+                ev->m_params[0].ptr,
+                ev->m_params[1].ptr,
+                ev->m_params, ev->m_paramcount, 2);
 
     return 0;
 }
 
-int handle_invite(luna_state *env, irc_message *ev)
+int handle_invite(luna_network *net, irc_message *ev)
 {
-    signal_dispatch(env, "invite", &luaX_push_invite, ev, NULL);
+    signal_dispatch(net->state, net, LUNA_SIG_INVITE, &luaX_event_invite, ev,
+            NULL);
 
     return 0;
 }
 
-int handle_topic(luna_state *env, irc_message *ev)
+int handle_topic(luna_network *net, irc_message *ev)
 {
     if (ev->m_paramcount < 1)
         return 1;
 
-    channel_set_topic(env, ev->m_params[0], ev->m_msg);
-    channel_set_topic_meta(env, ev->m_params[0], ev->m_prefix, time(NULL));
+    channel_set_topic(net, ev->m_params[0].ptr, ev->m_msg.ptr);
+    channel_set_topic_meta(net, ev->m_params[0].ptr, ev->m_prefix.ptr,
+                           time(NULL));
 
-    signal_dispatch(env, "topic_change", &luaX_push_topic, ev, NULL);
+    signal_dispatch(net->state, net, LUNA_SIG_TOPIC_CHANGE, &luaX_event_topic,
+            ev, NULL);
 
     return 0;
 }
 
-int handle_kick(luna_state *env, irc_message *ev)
+int handle_kick(luna_network *net, irc_message *ev)
 {
     if (ev->m_paramcount < 2)
         return 1;
 
-    signal_dispatch(env, "user_kicked", &luaX_push_kick, ev, NULL);
+    signal_dispatch(net->state, net, LUNA_SIG_USER_KICKED, &luaX_event_kick, ev,
+            NULL);
 
-    /* Remove user from all channels (ev->m_params[1]) */
-    if (!irc_user_cmp(ev->m_params[1], env->userinfo.nick))
+    /* Remove user from all channels (ev->m_params[1].ptr) */
+    if (!irc_user_cmp(net->casemapping, ev->m_params[1].ptr,
+                      net->userinfo.nick))
     {
         /* It's me! Geez! */
-        channel_remove(env, ev->m_params[0]);
+        channel_remove(net, ev->m_params[0].ptr);
     }
     else
     {
         /* Remove user from channel! */
-        channel_remove_user(env, ev->m_params[0], ev->m_params[1]);
+        channel_remove_user(net, ev->m_params[0].ptr, ev->m_params[1].ptr);
     }
 
     return 0;
 }
 
-int handle_unknown(luna_state *env, irc_message *ev)
+int handle_unknown(luna_network *net, irc_message *ev)
 {
     return 0;
 }
 
-int handle_server_supports(luna_state *env, irc_message *ev)
+int handle_server_supports(luna_network *net, irc_message *ev)
 {
     int i;
 
     for (i = 1; i < ev->m_paramcount; ++i)
     {
-        char *key = strtok(ev->m_params[i], "=");
+        char *key = strtok(ev->m_params[i].ptr, "=");
         char *val = strtok(NULL, "");
 
         if (!strcasecmp(key, "CHANMODES"))
         {
             char *tok = strtok(val, ",");
-            strncpy(env->chanmodes.param_address, tok,
-                    sizeof(env->chanmodes.param_address) - 1);
+            strncpy(net->chanmodes.param_address, tok,
+                    sizeof(net->chanmodes.param_address) - 1);
 
             tok = strtok(NULL, ",");
-            strncpy(env->chanmodes.param_always, tok,
-                    sizeof(env->chanmodes.param_always) - 1);
+            strncpy(net->chanmodes.param_always, tok,
+                    sizeof(net->chanmodes.param_always) - 1);
 
             tok = strtok(NULL, ",");
-            strncpy(env->chanmodes.param_whenset, tok,
-                    sizeof(env->chanmodes.param_whenset) - 1);
+            strncpy(net->chanmodes.param_whenset, tok,
+                    sizeof(net->chanmodes.param_whenset) - 1);
 
             tok = strtok(NULL, ",");
-            strncpy(env->chanmodes.param_never, tok,
-                    sizeof(env->chanmodes.param_never) - 1);
+            strncpy(net->chanmodes.param_never, tok,
+                    sizeof(net->chanmodes.param_never) - 1);
         }
         else if (!strcasecmp(key, "PREFIX"))
         {
             /*PREFIX=(ov)@+ */
             int k;
-            int max = sizeof(env->userprefix) / sizeof(env->userprefix[0]);
+            int max = sizeof(net->userprefix) / sizeof(net->userprefix[0]);
 
             for (k = 0; (k < strlen(val) / 2 - 1) && (k < max); ++k)
             {
-                env->userprefix[k].mode = *(val + k + 1);
-                env->userprefix[k].prefix = *(val + k + strlen(val) / 2 + 1);
+                net->userprefix[k].mode = *(val + k + 1);
+                net->userprefix[k].prefix = *(val + k + strlen(val) / 2 + 1);
 
-                channel_modes *m = &(env->chanmodes);
+                channel_modes *m = &(net->chanmodes);
 
                 if (strlen(m->param_nick) < sizeof(m->param_nick) - 1)
                 {
@@ -618,26 +669,32 @@ int handle_server_supports(luna_state *env, irc_message *ev)
                 }
             }
         }
+        else if (!strcasecmp(key, "CASEMAPPING"))
+        {
+            channel_set_casemap(net, irc_casemap_from_string(val));
+        }
         else if (!strcasecmp(key, "CHANTYPES"))
         {
-            env->chantypes = xstrdup(val);
+            /* Outlives the event, so it goes to the long-lived heap */
+            mm_free(net->chantypes);
+            net->chantypes = xstrdup(val);
         }
     }
 
     return 0;
 }
 
-int handle_mode_change(luna_state *state, const char *channel,
-                       const char *flags, char **args, int argind)
+int handle_mode_change(luna_network *net, const char *channel,
+                       const char *flags, irc_view *args, int argc, int argind)
 {
     int action = 0; /* 0 = set, 1 = unset */
     int i = argind;
 
-    irc_channel *target = channel_get(state, channel);
+    irc_channel *target = channel_get(net, channel);
 
     if (!target)
     {
-        logger_log(state->logger, LOGLEV_WARNING, "Unknown channel `%s'",
+        logger_log(net->state->logger, LOGLEV_WARNING, "Unknown channel `%s'",
                    channel);
         return 1;
     }
@@ -662,24 +719,30 @@ int handle_mode_change(luna_state *state, const char *channel,
 
         if (flag >= max)
         {
-            logger_log(state->logger, LOGLEV_WARNING, "Mode `%c' out of range",
-                       *flags);
+            logger_log(net->state->logger, LOGLEV_WARNING,
+                       "Mode `%c' out of range", *flags);
             return 0;
         }
 
         /*
          * Do all modes that need an argument
          */
-        if  (strchr(state->chanmodes.param_address, *flags) ||
-             strchr(state->chanmodes.param_always, *flags) ||
-             (strchr(state->chanmodes.param_whenset, *flags) && !action))
+        if  (strchr(net->chanmodes.param_address, *flags) ||
+             strchr(net->chanmodes.param_always, *flags) ||
+             (strchr(net->chanmodes.param_whenset, *flags) && !action))
         {
             /* Set/Unset flag "*flags" with argument "args[i]" */
-            char *arg = args[i++];
+            char *arg;
+
+            /* Parameter missing, the line is malformed */
+            if (i >= argc)
+                return 1;
+
+            arg = args[i++].ptr;
 
             if (!action)
             {
-                if (strchr(state->chanmodes.param_address, *flags))
+                if (strchr(net->chanmodes.param_address, *flags))
                 {
                     /* Add to (or create) list */
                     if (!target->flags[flag].set)
@@ -687,10 +750,10 @@ int handle_mode_change(luna_state *state, const char *channel,
                         /* Flag not set, set it and create the list */
                         target->flags[flag].set = 1;
                         target->flags[flag].type = FLAG_LIST;
-                        list_init(&target->flags[flag].list);
+                        vector_init(&target->flags[flag].list, 0);
                     }
 
-                    list_push_back(target->flags[flag].list, xstrdup(arg));
+                    vector_push(target->flags[flag].list, xstrdup(arg));
                 }
                 else
                 {
@@ -704,22 +767,26 @@ int handle_mode_change(luna_state *state, const char *channel,
                 /* Remove from list, possibly remove list, too */
                 if (target->flags[flag].set)
                 {
-                    if (strchr(state->chanmodes.param_address, *flags))
+                    if (strchr(net->chanmodes.param_address, *flags))
                     {
-                        char *entry = (char *)list_find(
-                                          target->flags[flag].list,
-                                          arg,
-                                          (list_find_fn)&strcasecmp);
+                        vector *list = target->flags[flag].list;
+                        size_t k;
 
-                        if (entry)
+                        /* Masks have no order worth keeping */
+                        for (k = 0; k < list->length; ++k)
                         {
-                            list_delete(target->flags[flag].list, entry,
-                                        &mm_free);
+                            if (!strcasecmp(list->items[k], arg))
+                            {
+                                mm_free(list->items[k]);
+                                vector_swap_remove(list, k);
+
+                                break;
+                            }
                         }
 
-                        if (target->flags[flag].list->length == 0)
+                        if (list->length == 0)
                         {
-                            list_destroy(target->flags[flag].list, &mm_free);
+                            vector_destroy(list, &mm_free);
                             target->flags[flag].type = FLAG_NONE;
                             target->flags[flag].set = 0;
                         }
@@ -734,11 +801,16 @@ int handle_mode_change(luna_state *state, const char *channel,
                 }
             }
         }
-        else if (strchr(state->chanmodes.param_nick, *flags))
+        else if (strchr(net->chanmodes.param_nick, *flags))
         {
-            const char *arg = args[i++];
+            const char *arg;
+
+            if (i >= argc)
+                return 1;
+
+            arg = args[i++].ptr;
 
-            irc_user *user = channel_get_user(state, channel, arg);
+            irc_member *user = channel_get_member(net, channel, arg);
 
             if (user)
             {
@@ -772,7 +844,7 @@ int handle_mode_change(luna_state *state, const char *channel,
             }
             else
             {
-                logger_log(state->logger, LOGLEV_WARNING,
+                logger_log(net->state->logger, LOGLEV_WARNING,
                            "Tried to alter unknown user `%s'", arg);
             }
         }
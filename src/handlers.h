@@ -22,6 +22,6 @@
 #include "irc.h"
 #include "state.h"
 
-int handle_event(luna_state *, irc_message *);
+int handle_event(luna_network *, irc_message *);
 
 #endif
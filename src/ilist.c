@@ -0,0 +1,81 @@
+/*
+ * This file is part of Luna
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <stdlib.h>
+
+#include "ilist.h"
+
+
+void ilist_init(ilist *list)
+{
+    list->head = NULL;
+    list->tail = NULL;
+    list->length = 0;
+
+    return;
+}
+
+void ilist_push_back(ilist *list, ilist_node *node)
+{
+    node->prev = list->tail;
+    node->next = NULL;
+
+    if (list->tail != NULL)
+        list->tail->next = node;
+    else
+        list->head = node;
+
+    list->tail = node;
+    list->length++;
+
+    return;
+}
+
+void ilist_push_front(ilist *list, ilist_node *node)
+{
+    node->prev = NULL;
+    node->next = list->head;
+
+    if (list->head != NULL)
+        list->head->prev = node;
+    else
+        list->tail = node;
+
+    list->head = node;
+    list->length++;
+
+    return;
+}
+
+void ilist_remove(ilist *list, ilist_node *node)
+{
+    if (node->prev != NULL)
+        node->prev->next = node->next;
+    else
+        list->head = node->next;
+
+    if (node->next != NULL)
+        node->next->prev = node->prev;
+    else
+        list->tail = node->prev;
+
+    node->prev = node->next = NULL;
+    list->length--;
+
+    return;
+}
@@ -0,0 +1,53 @@
+/*
+ * This file is part of Luna
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef ILIST_H
+#define ILIST_H
+
+#include <stddef.h>
+
+/*
+ * Intrusive doubly linked list. The node lives inside the element, so
+ * linking needs no allocation and an element unlinks itself in O(1)
+ * without searching. An element can be in as many lists as it has nodes.
+ */
+typedef struct ilist_node
+{
+    struct ilist_node *prev;
+    struct ilist_node *next;
+} ilist_node;
+
+typedef struct ilist
+{
+    ilist_node *head;
+    ilist_node *tail;
+
+    size_t length;
+} ilist;
+
+/* Element a node is embedded in */
+#define ilist_entry(node, type, member) \
+    ((type *)((char *)(node) - offsetof(type, member)))
+
+
+void ilist_init(ilist *);
+void ilist_push_back(ilist *, ilist_node *);
+void ilist_push_front(ilist *, ilist_node *);
+void ilist_remove(ilist *, ilist_node *);
+
+#endif
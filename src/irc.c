@@ -28,125 +28,288 @@
 #include "mm.h"
 
 
-irc_parse_status irc_parse_message(const char *line, irc_message *msg)
+/*
+ * Perfect hash over the commands we handle, found by brute force. Adding a
+ * command means finding new factors, the table must stay collision free.
+ */
+#define IRC_CMD_HASH(c0, c1, len) (((c0) + 7 * (c1) + 15 * (len)) & 15)
+
+static const struct
+{
+    const char *name;
+    irc_command id;
+} irc_commands[16] =
+{
+    [IRC_CMD_HASH('P', 'I', 4)] = { "PING",    IRC_CMD_PING },
+    [IRC_CMD_HASH('P', 'R', 7)] = { "PRIVMSG", IRC_CMD_PRIVMSG },
+    [IRC_CMD_HASH('J', 'O', 4)] = { "JOIN",    IRC_CMD_JOIN },
+    [IRC_CMD_HASH('P', 'A', 4)] = { "PART",    IRC_CMD_PART },
+    [IRC_CMD_HASH('Q', 'U', 4)] = { "QUIT",    IRC_CMD_QUIT },
+    [IRC_CMD_HASH('N', 'O', 6)] = { "NOTICE",  IRC_CMD_NOTICE },
+    [IRC_CMD_HASH('N', 'I', 4)] = { "NICK",    IRC_CMD_NICK },
+    [IRC_CMD_HASH('M', 'O', 4)] = { "MODE",    IRC_CMD_MODE },
+    [IRC_CMD_HASH('I', 'N', 6)] = { "INVITE",  IRC_CMD_INVITE },
+    [IRC_CMD_HASH('T', 'O', 5)] = { "TOPIC",   IRC_CMD_TOPIC },
+    [IRC_CMD_HASH('K', 'I', 4)] = { "KICK",    IRC_CMD_KICK },
+};
+
+
+irc_parse_status irc_parse_message(char *line, irc_message *msg)
 {
-    const char *prev = line;
-    const char *next = line;
-    size_t len;
+    char *cur = line;
+    char *end;
+    int i;
 
-    memset(msg, 0, sizeof(*msg));
+    msg->m_prefix.ptr = NULL;
+    msg->m_prefix.len = 0;
+    msg->m_paramcount = 0;
+    msg->m_msg.ptr = NULL;
+    msg->m_msg.len = 0;
 
     /* Check for prefix */
-    if (*prev == ':')
+    if (*cur == ':')
     {
-        ++prev; /* skip the ':' */
+        ++cur; /* skip the ':' */
 
         /* Prefix must not be the last part in a message */
-        if ((next = strchr(prev, ' ')) == NULL)
+        if ((end = strchr(cur, ' ')) == NULL)
             return SINVALID;
 
-        /* Calculate token lenght and skip the space */
-        len = next - prev;
-        for (;*next == ' '; ++next);
-
-        if ((msg->m_prefix = xstrndup(prev, len)) == NULL)
-            return SNOMEM;
+        msg->m_prefix.ptr = cur;
+        msg->m_prefix.len = end - cur;
+        *end = '\0';
 
-        prev = next;
+        for (cur = end + 1; *cur == ' '; ++cur);
     }
 
     /* Command also must not be the last argument in a message */
-    if ((next = strchr(next, ' ')) == NULL)
+    if ((end = strchr(cur, ' ')) == NULL)
         return SINVALID;
 
-    len = next - prev;
-    for (;*next == ' '; ++next);
+    msg->m_command.ptr = cur;
+    msg->m_command.len = end - cur;
+    *end = '\0';
 
-    if ((msg->m_command = xstrndup(prev, len)) == NULL)
-        return SNOMEM;
+    msg->m_id = irc_command_id(&(msg->m_command), &(msg->m_numeric));
 
-    do
-    {
-        prev = next;
-        next = strchr(next, ' ') != NULL
-            ? strchr(next, ' ')
-            : next + strlen(next);
-        len = next - prev;
+    for (cur = end + 1; *cur == ' '; ++cur);
 
-        for (;*next == ' '; ++next);
+    while (*cur)
+    {
+        irc_view *param;
 
-        if (*prev != ':')
+        /* Trailing part, or more parameters than we have room for */
+        if ((*cur == ':') || (msg->m_paramcount == IRC_MAXPARAMS))
         {
-            char **nparams = (char **)mm_realloc(msg->m_params,
-                    sizeof(char*) * (msg->m_paramcount + 1));
-            char *narg = xstrndup(prev, len);
+            if (*cur == ':')
+                ++cur;
+
+            msg->m_msg.ptr = cur;
+            msg->m_msg.len = strlen(cur);
 
-            if (!nparams || !narg)
-                return SNOMEM;
+            break;
+        }
+
+        end = cur + strcspn(cur, " ");
+
+        param = &(msg->m_params[msg->m_paramcount++]);
+        param->ptr = cur;
+        param->len = end - cur;
+
+        if (*end)
+        {
+            *end = '\0';
 
-            msg->m_params = nparams;
-            msg->m_params[msg->m_paramcount++] = narg;
+            for (cur = end + 1; *cur == ' '; ++cur);
         }
         else
         {
-            ++prev;
-            len = strlen(prev);
-
-            msg->m_msg = xstrndup(prev, len);
-
-            break;
+            cur = end;
         }
     }
-    while (next < line + strlen(line));
+
+    /* Parameters past the count read as absent, not as a previous line */
+    for (i = msg->m_paramcount; i < IRC_MAXPARAMS; ++i)
+    {
+        msg->m_params[i].ptr = NULL;
+        msg->m_params[i].len = 0;
+    }
 
     return SOK;
 }
 
-void irc_free_message(irc_message *msg)
+irc_command irc_command_id(const irc_view *command, int *numeric)
 {
-    int i;
+    const char *c = command->ptr;
+    int slot;
+
+    *numeric = -1;
+
+    /* Numerics index their handlers directly */
+    if ((command->len == 3) && isdigit(c[0]) && isdigit(c[1]) &&
+        isdigit(c[2]))
+    {
+        *numeric = (c[0] - '0') * 100 + (c[1] - '0') * 10 + (c[2] - '0');
+
+        return IRC_CMD_NUMERIC;
+    }
 
-    mm_free(msg->m_prefix);
-    mm_free(msg->m_command);
+    if (command->len < 2)
+        return IRC_CMD_UNKNOWN;
 
-    for (i = 0; i < msg->m_paramcount; ++i)
-        mm_free(msg->m_params[i]);
+    slot = IRC_CMD_HASH(c[0], c[1], command->len);
 
-    mm_free(msg->m_params);
-    mm_free(msg->m_msg);
+    /* One comparison settles it */
+    if ((irc_commands[slot].name != NULL) &&
+        !irc_view_cmp(command, irc_commands[slot].name))
+        return irc_commands[slot].id;
+
+    return IRC_CMD_UNKNOWN;
 }
 
 void irc_print_message(struct irc_message *i)
 {
     int j;
 
-    if (i->m_prefix != NULL)
-        printf(":%s ", i->m_prefix);
+    if (i->m_prefix.ptr != NULL)
+        printf(":%.*s ", (int)i->m_prefix.len, i->m_prefix.ptr);
 
-    printf("%s ", i->m_command);
+    printf("%.*s ", (int)i->m_command.len, i->m_command.ptr);
 
     for (j = 0; j < i->m_paramcount; j++)
-        printf("%s ", i->m_params[j]);
+        printf("%.*s ", (int)i->m_params[j].len, i->m_params[j].ptr);
 
-    if (i->m_msg != NULL)
-        printf(":%s", i->m_msg);
+    if (i->m_msg.ptr != NULL)
+        printf(":%.*s", (int)i->m_msg.len, i->m_msg.ptr);
 
     printf("\n");
 }
 
-int irc_user_cmp(const char *a, const char *b)
+void irc_view_split(const irc_view *src, irc_view *head, irc_view *rest)
+{
+    size_t i = 0;
+
+    /* Up to the first space is the head ... */
+    while ((i < src->len) && (src->ptr[i] != ' '))
+        ++i;
+
+    head->ptr = src->ptr;
+    head->len = i;
+
+    /* ... and whatever follows the spaces after it the rest */
+    while ((i < src->len) && (src->ptr[i] == ' '))
+        ++i;
+
+    rest->ptr = (i < src->len) ? src->ptr + i : NULL;
+    rest->len = src->len - i;
+}
+
+int irc_view_cmp(const irc_view *view, const char *str)
+{
+    size_t len = strlen(str);
+
+    if ((view->ptr == NULL) || (view->len != len))
+        return 1;
+
+    return strncmp(view->ptr, str, len);
+}
+
+int irc_view_casecmp(const irc_view *view, const char *str)
+{
+    size_t len = strlen(str);
+
+    if ((view->ptr == NULL) || (view->len != len))
+        return 1;
+
+    return strncasecmp(view->ptr, str, len);
+}
+
+int irc_user_cmp(irc_casemapping map, const char *a, const char *b)
 {
     /*
      * Since nicks are enough to identify someone uniquely on a network,
      * we can skip the whole address part and compare complete prefixes
      * only until the end of the nick part.
      */
-    int reallen_a = strchr(a, '!') ? (strchr(a, '!') - a) : strlen(a);
-    int reallen_b = strchr(b, '!') ? (strchr(b, '!') - b) : strlen(b);
-    int cmplen = reallen_a > reallen_b ? reallen_b : reallen_a;
+    size_t reallen_a = irc_nick_len(a);
+    size_t reallen_b = irc_nick_len(b);
 
     if (reallen_a != reallen_b)
         return 1;
     else
-        return strncasecmp(a, b, cmplen);
+        return irc_casencmp(map, a, b, reallen_a);
+}
+
+size_t irc_nick_len(const char *prefix)
+{
+    /* Nick part of a nick!user@host prefix, or all of a bare nick */
+    return strcspn(prefix, "!@");
+}
+
+irc_casemapping irc_casemap_from_string(const char *name)
+{
+    if (name && !strcasecmp(name, "ascii"))
+        return IRC_CASEMAP_ASCII;
+    else if (name && !strcasecmp(name, "strict-rfc1459"))
+        return IRC_CASEMAP_STRICT_RFC1459;
+    else
+        return IRC_CASEMAP_RFC1459;
+}
+
+int irc_casefold(irc_casemapping map, int c)
+{
+    if ((c >= 'A') && (c <= 'Z'))
+        return c + ('a' - 'A');
+
+    if (map == IRC_CASEMAP_ASCII)
+        return c;
+
+    switch (c)
+    {
+    case '[':
+        return '{';
+    case ']':
+        return '}';
+    case '\\':
+        return '|';
+    case '~':
+        return (map == IRC_CASEMAP_RFC1459) ? '^' : c;
+    default:
+        return c;
+    }
+}
+
+int irc_casencmp(irc_casemapping map, const char *a, const char *b, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; ++i)
+    {
+        int ca = irc_casefold(map, (unsigned char)a[i]);
+        int cb = irc_casefold(map, (unsigned char)b[i]);
+
+        if (ca != cb)
+            return ca - cb;
+
+        if (ca == 0)
+            break;
+    }
+
+    return 0;
+}
+
+unsigned int irc_casehash(irc_casemapping map, const char *s, size_t len)
+{
+    /* FNV-1a over the folded characters, so names equal under the
+     * casemapping hash alike */
+    unsigned int hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < len; ++i)
+    {
+        hash ^= (unsigned int)irc_casefold(map, (unsigned char)s[i]);
+        hash *= 16777619u;
+    }
+
+    return hash;
 }
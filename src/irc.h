@@ -28,22 +28,84 @@ typedef enum irc_parse_status
     SNOMEM
 } irc_parse_status;
 
+/* Most middle parameters a message can have, anything beyond ends up in the
+ * trailing part */
+#define IRC_MAXPARAMS 15
+
+/*
+ * Slice of a line buffer, ptr is NULL if the part is absent.
+ *
+ * The parser terminates every token in place, so the views of a parsed
+ * message double as C strings. Views made by irc_view_split() are not
+ * terminated and must be used through their length.
+ */
+typedef struct irc_view
+{
+    char *ptr;
+    size_t len;
+} irc_view;
+
+/* Interned commands, anything the parser doesn't know is IRC_CMD_UNKNOWN */
+typedef enum irc_command
+{
+    IRC_CMD_UNKNOWN,
+    IRC_CMD_NUMERIC, /* Three digit reply, see m_numeric */
+    IRC_CMD_PING,
+    IRC_CMD_PRIVMSG,
+    IRC_CMD_JOIN,
+    IRC_CMD_PART,
+    IRC_CMD_QUIT,
+    IRC_CMD_NOTICE,
+    IRC_CMD_NICK,
+    IRC_CMD_MODE,
+    IRC_CMD_INVITE,
+    IRC_CMD_TOPIC,
+    IRC_CMD_KICK,
+
+    IRC_CMD_COUNT
+} irc_command;
+
+/* How nicks and channel names fold case, as advertised by CASEMAPPING in
+ * ISUPPORT. RFC 1459 is the default when the server doesn't say. */
+typedef enum irc_casemapping
+{
+    IRC_CASEMAP_ASCII,          /* A-Z only */
+    IRC_CASEMAP_STRICT_RFC1459, /* plus []\ as {}| */
+    IRC_CASEMAP_RFC1459         /* plus ~ as ^ */
+} irc_casemapping;
+
+/* Numerics are three digits */
+#define IRC_NUMERIC_MAX 1000
+
 typedef struct irc_message
 {
-    char *m_prefix;
-    char *m_command;
+    irc_view m_prefix;
+    irc_view m_command;
 
-    char **m_params;
+    irc_command m_id;
+    int m_numeric;   /* 0 - 999 if m_id is IRC_CMD_NUMERIC, else -1 */
+
+    irc_view m_params[IRC_MAXPARAMS];
     int m_paramcount;
 
-    char *m_msg;
+    irc_view m_msg;
 } irc_message;
 
 
-irc_parse_status irc_parse_message(const char *, irc_message *);
-void irc_free_message(irc_message *);
+irc_parse_status irc_parse_message(char *, irc_message *);
+irc_command irc_command_id(const irc_view *, int *);
 void irc_print_message(irc_message *);
 
-int irc_user_cmp(const char *, const char *);
+void irc_view_split(const irc_view *, irc_view *, irc_view *);
+int irc_view_cmp(const irc_view *, const char *);
+int irc_view_casecmp(const irc_view *, const char *);
+
+int irc_user_cmp(irc_casemapping, const char *, const char *);
+size_t irc_nick_len(const char *);
+
+irc_casemapping irc_casemap_from_string(const char *);
+int irc_casefold(irc_casemapping, int);
+int irc_casencmp(irc_casemapping, const char *, const char *, size_t);
+unsigned int irc_casehash(irc_casemapping, const char *, size_t);
 
 #endif
@@ -30,6 +30,7 @@ int list_init(linked_list **list)
     if (*list)
     {
         (*list)->root = NULL;
+        (*list)->tail = NULL;
         (*list)->length = 0;
 
         return 0;
@@ -70,6 +71,7 @@ list_node *list_push_front(linked_list *list, void *data)
         else
         {
             list->root = tmp;
+            list->tail = tmp;
         }
 
         list->length++;
@@ -137,24 +139,15 @@ list_node *list_push_back(linked_list *list, void *data)
 
     if (tmp)
     {
-        list_node *root = list_get_root(list);
-
         memset(tmp, 0, sizeof(*tmp));
         tmp->data = data;
 
-        if (root)
-        {
-            list_node *current = root;
-
-            while (current->next != NULL)
-                current = current->next;
-
-            current->next = tmp;
-        }
+        if (list->tail)
+            list->tail->next = tmp;
         else
-        {
             list->root = tmp;
-        }
+
+        list->tail = tmp;
 
         list->length++;
     }
@@ -191,7 +184,12 @@ void list_delete(linked_list *list, void *plugin, void (*f)(void *))
             else
                 old->next = current->next;
 
-            f(current->data);
+            if (list->tail == current)
+                list->tail = old;
+
+            if (f != NULL)
+                f(current->data);
+
             mm_free(current);
 
             list->length--;
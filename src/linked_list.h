@@ -28,6 +28,7 @@ typedef int (*list_find_fn)(const void *, const void *);
 struct linked_list
 {
     list_node *root;
+    list_node *tail; /* So appending doesn't have to walk the list */
 
     size_t length;
 };
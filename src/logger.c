@@ -131,11 +131,14 @@ int logger_format_timestamp(time_t stamp, char *dest, size_t len)
 {
     char *format = TIMESTAMP_FORMAT;
 
+    struct tm tm;
+
+    /* The reentrant versions, other threads log too */
 #ifdef TIMESTAMP_LOCAL
-    struct tm *tm = localtime(&stamp);
+    localtime_r(&stamp, &tm);
 #else
-    struct tm *tm = gmtime(&stamp);
+    gmtime_r(&stamp, &tm);
 #endif
 
-    return strftime(dest, len, format, tm);
+    return strftime(dest, len, format, &tm);
 }
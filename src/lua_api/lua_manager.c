@@ -17,6 +17,7 @@
  */
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
 
 #include <lua.h>
@@ -27,6 +28,8 @@
 
 #include "lua_manager.h"
 #include "lua_util.h"
+#include "lua_worker.h"
+#include "lua_profile.h"
 
 #include "lua_util.h"
 
@@ -34,13 +37,52 @@
 #include "modules/lua_self.h"
 #include "modules/lua_script.h"
 #include "modules/lua_channel.h"
+#include "modules/lua_network.h"
+#include "modules/lua_timers.h"
 
 
-int script_emit(luna_state *, luna_script *, const char *,
-                luaX_push_helper, va_list vargs);
+void script_deliver(luna_state *, luna_network *, luna_script *, luna_signal,
+                    const luaX_event *);
 int script_identify(luna_state *, lua_State *, luna_script *);
+void script_bind(lua_State *, luna_script *, int);
+int script_api_index(lua_State *);
+int script_api_newindex(lua_State *);
+int script_panic(lua_State *);
 
 const char *env_key = "LUNA_ENV";
+const char *script_key = "LUNA_SCRIPT";
+
+/* Indexed by luna_signal */
+const char *signal_names[LUNA_SIG_COUNT] =
+{
+    "raw",
+    "private_message",
+    "public_message",
+    "private_ctcp",
+    "private_ctcp_response",
+    "public_ctcp",
+    "public_ctcp_response",
+    "private_action",
+    "public_action",
+    "private_command",
+    "public_command",
+    "ping",
+    "numeric",
+    "connect",
+    "disconnect",
+    "channel_join",
+    "channel_join_sync",
+    "channel_part",
+    "user_quit",
+    "private_notice",
+    "public_notice",
+    "nick_change",
+    "invite",
+    "topic_change",
+    "user_kicked",
+    "script_load",
+    "script_unload"
+};
 
 
 int script_cmp(const void *data, const void *list_data)
@@ -56,11 +98,105 @@ void script_free(void *list_data)
     luna_script *script = (luna_script *)list_data;
 
     lua_close(script->state);
+
+    /* After the state, which was allocated for it */
+    if (script->worker != NULL)
+        worker_destroy(script->worker);
+
+    profile_free(script);
+
     mm_free(list_data);
 
     return;
 }
 
+void script_shutdown(luna_state *state)
+{
+    size_t i;
+
+    /* Worker threads and timers are tied to the event loop, which goes
+     * away before the scripts */
+    for (i = 0; i < state->scripts->length; ++i)
+    {
+        luna_script *script = (luna_script *)(state->scripts->items[i]);
+
+        if (script->worker != NULL)
+            worker_stop(script->worker);
+
+        luaX_timers_clear(state, script);
+    }
+
+    return;
+}
+
+void *script_lalloc(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+    luna_script *script = (luna_script *)ud;
+    size_t used, limit;
+    void *newd;
+
+    /* Lua 5.2 passes a type tag as osize for new blocks */
+    if (ptr == NULL)
+        osize = 0;
+
+    /* Workers allocate on their own thread while the main one reads the
+     * counters and sets the limit, hence the atomics. Only whoever runs
+     * the state at the time writes them */
+    if (nsize == 0)
+    {
+        if (ptr != NULL)
+        {
+            __atomic_sub_fetch(&(script->mem_used), osize, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&(script->mem_frees), 1, __ATOMIC_RELAXED);
+        }
+
+        if (script->worker != NULL)
+            free(ptr);
+        else
+            mm_free(ptr);
+
+        return NULL;
+    }
+
+    used = __atomic_load_n(&(script->mem_used), __ATOMIC_RELAXED);
+    limit = __atomic_load_n(&(script->mem_limit), __ATOMIC_RELAXED);
+
+    /* Only growth can be refused, Lua relies on shrinking to succeed */
+    if (limit && (nsize > osize) && (used + (nsize - osize) > limit))
+        return NULL;
+
+    /* Small blocks, which is most of what Lua asks for, come from the mm
+     * size classes. Worker scripts allocate off the main thread, mm isn't
+     * safe to use there */
+    if (script->worker != NULL)
+        newd = realloc(ptr, nsize);
+    else
+        newd = mm_realloc(ptr, nsize);
+
+    if (newd == NULL)
+        return NULL;
+
+    if (ptr == NULL)
+        __atomic_add_fetch(&(script->mem_allocs), 1, __ATOMIC_RELAXED);
+
+    used = __atomic_add_fetch(&(script->mem_used), nsize - osize,
+                              __ATOMIC_RELAXED);
+
+    if (used > __atomic_load_n(&(script->mem_peak), __ATOMIC_RELAXED))
+        __atomic_store_n(&(script->mem_peak), used, __ATOMIC_RELAXED);
+
+    return newd;
+}
+
+int script_panic(lua_State *L)
+{
+    /* Same as the lauxlib default, which lua_newstate() doesn't install */
+    fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n",
+            lua_tostring(L, -1));
+
+    return 0;
+}
+
 int script_identify(luna_state *state, lua_State *L, luna_script *script)
 {
     int api_table;
@@ -102,18 +238,104 @@ int script_identify(luna_state *state, lua_State *L, luna_script *script)
     return 1;
 }
 
+void script_bind(lua_State *L, luna_script *script, int api_table)
+{
+    int i;
+
+    for (i = 0; i < LUNA_SIG_COUNT; ++i)
+    {
+        lua_pushstring(L, signal_names[i]);
+        script->signal_refs[i] = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+
+    /* The dispatcher leaves the API table, so that a script assigning its
+     * own goes through __newindex and we get to update the reference */
+    lua_getfield(L, api_table, "emit_signal");
+    script->dispatch_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    lua_pushnil(L);
+    lua_setfield(L, api_table, "emit_signal");
+
+    lua_newtable(L);
+
+    lua_pushcfunction(L, &script_api_index);
+    lua_setfield(L, -2, "__index");
+
+    lua_pushcfunction(L, &script_api_newindex);
+    lua_setfield(L, -2, "__newindex");
+
+    lua_setmetatable(L, api_table);
+
+    return;
+}
+
+int script_api_index(lua_State *L)
+{
+    const char *key = lua_tostring(L, 2);
+
+    if ((lua_type(L, 2) == LUA_TSTRING) && !strcmp(key, "emit_signal"))
+    {
+        luna_script *script = api_getscript(L);
+
+        lua_rawgeti(L, LUA_REGISTRYINDEX, script->dispatch_ref);
+        return 1;
+    }
+
+    return 0;
+}
+
+int script_api_newindex(lua_State *L)
+{
+    const char *key = lua_tostring(L, 2);
+
+    lua_settop(L, 3);
+
+    if ((lua_type(L, 2) == LUA_TSTRING) && !strcmp(key, "emit_signal"))
+    {
+        luna_script *script = api_getscript(L);
+
+        luaL_unref(L, LUA_REGISTRYINDEX, script->dispatch_ref);
+        script->dispatch_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+        return 0;
+    }
+
+    lua_rawset(L, 1);
+
+    return 0;
+}
+
 int script_unload(luna_state *state, const char *file)
 {
     void *key = (void *)file;
-    void *result = list_find(state->scripts, key, &script_cmp);
+    void *result = vector_find(state->scripts, key, &script_cmp);
 
     if (result)
     {
+        luna_worker *worker = ((luna_script *)result)->worker;
+
+        /* A call the worker forwarded is running on its state, which
+         * can't go away under it. Unloaded once that returned */
+        if ((worker != NULL) && worker->calling)
+        {
+            worker->unload = 1;
+
+            return 0;
+        }
+
         /* Call unload signal */
-        signal_dispatch(state, "script_unload", &luaX_push_script_unload,
-                        file, NULL);
+        signal_dispatch(state, NULL, LUNA_SIG_SCRIPT_UNLOAD,
+                        &luaX_event_script_unload, file, NULL);
+
+        /* Its thread ends after the handler it's in, what it didn't get
+         * to (the unload signal included) runs right here */
+        if (worker != NULL)
+            worker_stop(worker);
 
-        list_delete(state->scripts, result, &script_free);
+        luaX_timers_clear(state, result);
+
+        /* Keeps the load order, which is the order signals arrive in */
+        vector_delete(state->scripts, result, &script_free);
 
         return 0;
     }
@@ -121,23 +343,39 @@ int script_unload(luna_state *state, const char *file)
     return 1;
 }
 
-int script_load(luna_state *state, const char *file)
+int script_load(luna_state *state, const char *file, int worker)
 {
     lua_State *L = NULL;
     luna_script *script = NULL;
     int api_table = 0;
 
-    /* Script can be openened and allocated, or Lua state cannot be created ? */
-    //if (!(script = mm_malloc(sizeof(*script))) || !((L = lua_newstate(&mm_lalloc, NULL))))
+    if ((script = mm_malloc(sizeof(*script))) == NULL)
+        return 1;
+
+    memset(script, 0, sizeof(*script));
+    script->mem_limit = state->script_memlimit;
+    ilist_init(&(script->timers));
 
-    if (!(script = mm_malloc(sizeof(*script))) || !((L = luaL_newstate())))
+    /* Before the state, which allocates differently for workers */
+    if (worker && (worker_init(&(script->worker), state, script) != 0))
     {
         mm_free(script);
 
         return 1;
     }
 
-    memset(script, 0, sizeof(*script));
+    /* Every script gets its own accounted allocator */
+    if ((L = lua_newstate(&script_lalloc, script)) == NULL)
+    {
+        if (script->worker != NULL)
+            worker_destroy(script->worker);
+
+        mm_free(script);
+
+        return 1;
+    }
+
+    lua_atpanic(L, &script_panic);
     script->state = L;
     strncpy(script->filename, file, sizeof(script->filename));
 
@@ -148,6 +386,11 @@ int script_load(luna_state *state, const char *file)
     lua_pushlightuserdata(L, state);
     lua_settable(L, LUA_REGISTRYINDEX);
 
+    /* And its own record, it isn't in the script list until loaded */
+    lua_pushlightuserdata(L, (void *)script_key);
+    lua_pushlightuserdata(L, script);
+    lua_settable(L, LUA_REGISTRYINDEX);
+
     /* Register core library methods */
     api_table = (luaX_register_core(L), lua_gettop(L));
 
@@ -159,6 +402,8 @@ int script_load(luna_state *state, const char *file)
     luaX_register_self(L, api_table);   /* luna.self */
     luaX_register_script(L, api_table); /* luna.scripts */
     luaX_register_channel(L, api_table); /* luna.channels */
+    luaX_register_network(L, api_table); /* luna.networks */
+    luaX_register_timers(L, api_table); /* luna.timers */
 
     if (luaL_dofile(L, "corelib.lua") != 0)
     {
@@ -168,17 +413,48 @@ int script_load(luna_state *state, const char *file)
                    "Error was: %s", lua_tostring(L, -1));
     }
 
+    script_bind(L, script, api_table);
+    luaX_register_event(L);
+
+    /* Before the script runs, it may keep API functions around */
+    if (script->worker != NULL)
+        worker_wrap(L, script->worker);
+
+    /* Workers call these directly */
+    luaX_register_profile(L, api_table);
+
     /* Clean the stack */
     lua_pop(L, -1);
 
     /* Execute */
     if ((luaL_dofile(L, file) == 0) && (script_identify(state, L, script) == 0))
     {
-        list_push_back(state->scripts, script);
+        if ((script->worker != NULL) && (worker_start(script->worker) != 0))
+        {
+            logger_log(state->logger, LOGLEV_ERROR,
+                       "Unable to start a thread for '%s'", file);
+
+            luaX_timers_clear(state, script);
+            script_free(script);
+
+            return 1;
+        }
+
+        if (vector_push(state->scripts, script) != 0)
+        {
+            if (script->worker != NULL)
+                worker_stop(script->worker);
+
+            luaX_timers_clear(state, script);
+            script_free(script);
+
+            return 1;
+        }
+
         strncpy(script->filename, file, sizeof(script->filename) - 1);
 
-        signal_dispatch(state, "script_load", &luaX_push_script_load,
-                        file, NULL);
+        signal_dispatch(state, NULL, LUNA_SIG_SCRIPT_LOAD,
+                        &luaX_event_script_load, file, NULL);
 
         return 0;
     }
@@ -188,57 +464,175 @@ int script_load(luna_state *state, const char *file)
         logger_log(state->logger, LOGLEV_ERROR, "Lua error: %s",
                    lua_tostring(L, -1));
 
+        luaX_timers_clear(state, script);
         script_free(script);
     }
 
     return 1;
 }
 
-int signal_dispatch(luna_state *state, const char *sig, luaX_push_helper f, ...)
+int signal_from_string(const char *name)
+{
+    int i;
+
+    for (i = 0; i < LUNA_SIG_COUNT; ++i)
+        if (!strcmp(name, signal_names[i]))
+            return i;
+
+    return -1;
+}
+
+int signal_dispatch(luna_state *state, luna_network *net, luna_signal sig,
+                    luaX_event_helper f, ...)
 {
     va_list args;
-    list_node *cur;
+    size_t i;
+    luaX_event event;
+    luaX_event *ev = NULL;
+    luna_network *outer = state->current;
+    int byte = sig / 8;
+    int bit = 1 << (sig % 8);
+
+    /* Remember where the event came from so API calls without an explicit
+     * network end up on the right one */
+    state->current = net;
+
+    /* Indexed, handlers may load scripts and grow the vector under us.
+     * Scripts without a handler for the signal never see it */
+    for (i = 0; i < state->scripts->length; ++i)
+    {
+        luna_script *script = (luna_script *)(state->scripts->items[i]);
+
+        if (!(script->signals[byte] & bit))
+            continue;
+
+        /* Described once, when the first script turns out to want it */
+        if ((f != NULL) && (ev == NULL))
+        {
+            va_start(args, f);
+            f(&event, args);
+            va_end(args);
+
+            ev = &event;
+        }
+
+        script_deliver(state, net, script, sig, ev);
+    }
+
+    state->current = outer;
 
-    for (cur = state->scripts->root; cur != NULL; cur = cur->next)
+    return 0;
+}
+
+int signal_dispatch_numeric(luna_state *state, luna_network *net,
+                            irc_message *ev)
+{
+    size_t i;
+    luaX_event event;
+    luna_network *outer = state->current;
+    int byte = ev->m_numeric / 8;
+    int bit = 1 << (ev->m_numeric % 8);
+
+    state->current = net;
+    luaX_event_init(&event, ev);
+
+    for (i = 0; i < state->scripts->length; ++i)
     {
-        va_start(args, f);
-        script_emit(state, cur->data, sig, f, args);
-        va_end(args);
+        luna_script *script = (luna_script *)(state->scripts->items[i]);
+
+        if (script->numerics[byte] & bit)
+            script_deliver(state, net, script, LUNA_SIG_NUMERIC, &event);
     }
 
+    state->current = outer;
+
     return 0;
 }
 
-int script_emit(luna_state *state, luna_script *script, const char *sig,
-                luaX_push_helper f, va_list vargs)
+void script_watch_numeric(luna_script *script, int numeric, int enable)
 {
-    int api_table;
-    int i = 1;
+    if ((numeric < 0) || (numeric >= IRC_NUMERIC_MAX))
+        return;
+
+    if (enable)
+        script->numerics[numeric / 8] |= 1 << (numeric % 8);
+    else
+        script->numerics[numeric / 8] &= ~(1 << (numeric % 8));
+
+    return;
+}
+
+void script_watch_signal(luna_script *script, luna_signal sig, int enable)
+{
+    if ((sig < 0) || (sig >= LUNA_SIG_COUNT))
+        return;
+
+    if (enable)
+        script->signals[sig / 8] |= 1 << (sig % 8);
+    else
+        script->signals[sig / 8] &= ~(1 << (sig % 8));
+
+    return;
+}
+
+void script_deliver(luna_state *state, luna_network *net,
+                    luna_script *script, luna_signal sig, const luaX_event *ev)
+{
+    /* Workers get a copy and handle it on their own time */
+    if (script->worker != NULL)
+        worker_post_signal(script->worker, net, sig, ev);
+    else
+        script_emit(state, net, script, sig, ev);
+
+    return;
+}
+
+int script_emit(luna_state *state, luna_network *net, luna_script *script,
+                luna_signal sig, const luaX_event *ev)
+{
+    const luaX_event **obj = NULL;
+    int i = 2;
 
     lua_State *L = script->state;
+    int top = lua_gettop(L);
 
-    lua_getglobal(L, LIBNAME);
-    api_table = lua_gettop(L);
+    /* Handlers are timed by corelib, if at all */
+    profile_sync(state, script);
 
-    lua_pushstring(L, "emit_signal");
-    lua_gettable(L, api_table);
+    /* Kept below the call as well, so it can't be collected before it is
+     * invalidated */
+    if (ev != NULL)
+        obj = luaX_push_event(L, ev);
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, script->dispatch_ref);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, script->signal_refs[sig]);
 
-    lua_pushstring(L, sig);
+    /* Originating network, nil for process wide signals */
+    if (net != NULL)
+        lua_pushstring(L, net->name);
+    else
+        lua_pushnil(L);
 
-    /* Push arguments */
-    if (f != NULL)
-        i += f(state, script->state, vargs);
+    if (ev != NULL)
+    {
+        lua_pushvalue(L, top + 1);
+        i++;
+    }
 
     if (lua_pcall(L, i, 0, 0) != 0)
     {
         logger_log(state->logger, LOGLEV_ERROR,
                    "Lua error ('%s@%s'): %s",
-                   sig, script->filename, lua_tostring(L, -1));
-
-        /* Pop off error message */
-        lua_pop(L, 1);
+                   signal_names[sig], script->filename, lua_tostring(L, -1));
     }
 
-    lua_pop(L, -1);
+    /* What it points to doesn't outlive the dispatch, handlers that kept
+     * the object get an error instead */
+    if (obj != NULL)
+        *obj = NULL;
+
+    /* Signals may be emitted from within a Lua call, leave its stack be */
+    lua_settop(L, top);
+
     return 1;
 }
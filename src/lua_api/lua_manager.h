@@ -20,6 +20,8 @@
 #define LUA_MANAGER_H
 
 #include "../state.h"
+#include "../irc.h"
+#include "../ilist.h"
 
 #include <lua.h>
 #include <lualib.h>
@@ -27,6 +29,42 @@
 
 #define LIBNAME "luna"
 
+/* Signals raised from C, signal_names[] holds what Lua knows them as */
+typedef enum luna_signal
+{
+    LUNA_SIG_RAW,
+    LUNA_SIG_PRIVATE_MESSAGE,
+    LUNA_SIG_PUBLIC_MESSAGE,
+    LUNA_SIG_PRIVATE_CTCP,
+    LUNA_SIG_PRIVATE_CTCP_RESPONSE,
+    LUNA_SIG_PUBLIC_CTCP,
+    LUNA_SIG_PUBLIC_CTCP_RESPONSE,
+    LUNA_SIG_PRIVATE_ACTION,
+    LUNA_SIG_PUBLIC_ACTION,
+    LUNA_SIG_PRIVATE_COMMAND,
+    LUNA_SIG_PUBLIC_COMMAND,
+    LUNA_SIG_PING,
+    LUNA_SIG_NUMERIC,
+    LUNA_SIG_CONNECT,
+    LUNA_SIG_DISCONNECT,
+    LUNA_SIG_CHANNEL_JOIN,
+    LUNA_SIG_CHANNEL_JOIN_SYNC,
+    LUNA_SIG_CHANNEL_PART,
+    LUNA_SIG_USER_QUIT,
+    LUNA_SIG_PRIVATE_NOTICE,
+    LUNA_SIG_PUBLIC_NOTICE,
+    LUNA_SIG_NICK_CHANGE,
+    LUNA_SIG_INVITE,
+    LUNA_SIG_TOPIC_CHANGE,
+    LUNA_SIG_USER_KICKED,
+    LUNA_SIG_SCRIPT_LOAD,
+    LUNA_SIG_SCRIPT_UNLOAD,
+
+    LUNA_SIG_COUNT
+} luna_signal;
+
+struct luna_worker;
+
 typedef struct luna_script
 {
     char filename[256];
@@ -37,18 +75,75 @@ typedef struct luna_script
     char author[64];
 
     lua_State *state;
+
+    /* Thread it runs on, NULL for the main thread */
+    struct luna_worker *worker;
+
+    /* Memory the script's Lua state holds through script_lalloc(). Accessed
+     * atomically, workers update them on their own thread */
+    size_t mem_used;
+    size_t mem_peak;
+    size_t mem_limit; /* 0 for none */
+    size_t mem_allocs;
+    size_t mem_frees;
+
+    /* Numerics the script wants to hear about, one bit each */
+    unsigned char numerics[(IRC_NUMERIC_MAX + 7) / 8];
+
+    /* Signals the script has handlers for, kept by corelib */
+    unsigned char signals[(LUNA_SIG_COUNT + 7) / 8];
+
+    /* Registry references to luna.emit_signal and to the signal names, so
+     * emitting doesn't have to look either up */
+    int dispatch_ref;
+    int signal_refs[LUNA_SIG_COUNT];
+
+    /* Its luna.timers timers */
+    ilist timers;
+    int timer_ids;
+
+    /* Time spent in its handlers and timers, see lua_profile.h */
+    struct profile_entry *profile;
+    int profiling; /* What its luna.__profiling was last set to */
 } luna_script;
 
 
-typedef int (*luaX_push_helper)(luna_state *, lua_State *, va_list);
+#define LUAX_EVENT_META "luna.event"
+#define LUAX_EVENT_FIELDS 4
+
+/* What a signal carries, described once per dispatch. Every script gets it
+ * as a userdata that only turns fields into strings when they are read */
+typedef struct luaX_event
+{
+    const irc_message *msg; /* Message fields come from here, may be NULL */
+
+    /* Signal specific fields, looked up before the message ones */
+    int nfields;
+    const char *names[LUAX_EVENT_FIELDS];
+    irc_view fields[LUAX_EVENT_FIELDS];
+} luaX_event;
+
+typedef int (*luaX_event_helper)(luaX_event *, va_list);
 
 extern const char *env_key;
+extern const char *script_key;
+extern const char *signal_names[LUNA_SIG_COUNT];
 
 int script_cmp(const void *, const void *);
-int script_load(luna_state *, const char *);
+int script_load(luna_state *, const char *, int);
 int script_unload(luna_state *, const char *);
 void script_free(void *);
+void script_shutdown(luna_state *);
+void *script_lalloc(void *, void *, size_t, size_t);
+
+int signal_from_string(const char *);
+int signal_dispatch(luna_state *, luna_network *, luna_signal,
+                    luaX_event_helper, ...);
+int signal_dispatch_numeric(luna_state *, luna_network *, irc_message *);
+int script_emit(luna_state *, luna_network *, luna_script *, luna_signal,
+                const luaX_event *);
 
-int signal_dispatch(luna_state *, const char *, luaX_push_helper, ...);
+void script_watch_numeric(luna_script *, int, int);
+void script_watch_signal(luna_script *, luna_signal, int);
 
 #endif
@@ -0,0 +1,324 @@
+/*
+ * This file is part of Luna
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+/*
+ * Where the scripts spend their time.
+ *
+ * corelib times every signal handler it calls and C times the timers, each
+ * against the monotonic clock. While profiling is off scripts only check a
+ * flag per signal.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+
+#include "lua_profile.h"
+#include "lua_util.h"
+
+#include "../logger.h"
+
+
+profile_entry *profile_get(luna_script *, const char *, const char *);
+void profile_add(profile_entry *, uint64_t);
+void profile_on_dump(event_loop *, event_timer *, void *);
+int luaX_profile_begin(lua_State *);
+int luaX_profile_end(lua_State *);
+
+
+uint64_t profile_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int profile_sync(luna_state *state, luna_script *script)
+{
+    lua_State *L = script->state;
+    int on = __atomic_load_n(&(state->profiling), __ATOMIC_RELAXED);
+
+    /* corelib checks luna.__profiling before timing a handler, it only
+     * needs to be told when that changed */
+    if (on != script->profiling)
+    {
+        lua_getglobal(L, LIBNAME);
+        lua_pushboolean(L, on);
+        lua_setfield(L, -2, "__profiling");
+        lua_pop(L, 1);
+
+        script->profiling = on;
+    }
+
+    return on;
+}
+
+void profile_end(luna_script *script, const char *signal, const char *id,
+                 uint64_t start)
+{
+    uint64_t now = profile_now();
+    profile_entry *entry;
+
+    if ((entry = profile_get(script, signal, id)) != NULL)
+        profile_add(entry, now - start);
+
+    return;
+}
+
+profile_entry *profile_get(luna_script *script, const char *signal,
+                           const char *id)
+{
+    profile_entry *entry;
+
+    for (entry = script->profile; entry != NULL; entry = entry->next)
+        if (!strcmp(entry->signal, signal) && !strcmp(entry->id, id))
+            return entry;
+
+    if ((entry = malloc(sizeof(*entry))) == NULL)
+        return NULL;
+
+    memset(entry, 0, sizeof(*entry));
+    strncpy(entry->signal, signal, sizeof(entry->signal) - 1);
+    strncpy(entry->id, id, sizeof(entry->id) - 1);
+
+    /* Published complete, the main thread may be walking the list */
+    entry->next = script->profile;
+    __atomic_store_n(&(script->profile), entry, __ATOMIC_RELEASE);
+
+    return entry;
+}
+
+void profile_add(profile_entry *entry, uint64_t ns)
+{
+    uint64_t limit = 1000;
+    int i;
+
+    for (i = 0; (i < PROFILE_BUCKETS - 1) && (ns >= limit); ++i)
+        limit *= 10;
+
+    __atomic_add_fetch(&(entry->calls), 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&(entry->total), ns, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&(entry->histogram[i]), 1, __ATOMIC_RELAXED);
+
+    /* Nobody else writes it */
+    if (ns > entry->max)
+        __atomic_store_n(&(entry->max), ns, __ATOMIC_RELAXED);
+
+    return;
+}
+
+void profile_free(luna_script *script)
+{
+    profile_entry *entry;
+
+    while ((entry = script->profile) != NULL)
+    {
+        script->profile = entry->next;
+        free(entry);
+    }
+
+    return;
+}
+
+int profile_start(luna_state *state)
+{
+    int interval = state->profile_interval;
+
+    if (interval <= 0)
+        return 0;
+
+    state->profile_timer = event_timer_add(state->loop, interval * 1000,
+                                           interval * 1000, &profile_on_dump,
+                                           state);
+
+    return state->profile_timer == NULL;
+}
+
+void profile_stop(luna_state *state)
+{
+    event_timer_cancel(state->loop, state->profile_timer);
+    state->profile_timer = NULL;
+
+    return;
+}
+
+void profile_on_dump(event_loop *loop, event_timer *timer, void *data)
+{
+    luna_state *state = (luna_state *)data;
+
+    if (__atomic_load_n(&(state->profiling), __ATOMIC_RELAXED))
+        profile_dump(state);
+
+    return;
+}
+
+void profile_dump(luna_state *state)
+{
+    char histogram[PROFILE_BUCKETS * 21];
+    size_t i, len;
+    int k;
+
+    for (i = 0; i < state->scripts->length; ++i)
+    {
+        luna_script *script = (luna_script *)(state->scripts->items[i]);
+        profile_entry *entry;
+
+        entry = __atomic_load_n(&(script->profile), __ATOMIC_ACQUIRE);
+
+        for (; entry != NULL; entry = entry->next)
+        {
+            uint64_t calls = __atomic_load_n(&(entry->calls), __ATOMIC_RELAXED);
+            uint64_t total = __atomic_load_n(&(entry->total), __ATOMIC_RELAXED);
+            uint64_t max = __atomic_load_n(&(entry->max), __ATOMIC_RELAXED);
+
+            for (k = 0, len = 0; k < PROFILE_BUCKETS; ++k)
+                len += snprintf(histogram + len, sizeof(histogram) - len,
+                                k ? "/%llu" : "%llu", (unsigned long long)
+                                __atomic_load_n(&(entry->histogram[k]),
+                                                __ATOMIC_RELAXED));
+
+            logger_log(state->logger, LOGLEV_INFO,
+                       "Profile %s %s/%s: %llu calls, %.3f ms total, "
+                       "%.3f ms max, histogram %s", script->filename,
+                       entry->signal, entry->id, (unsigned long long)calls,
+                       total / 1e6, max / 1e6, histogram);
+        }
+    }
+
+    return;
+}
+
+int luaX_push_profile(lua_State *L, luna_script *script)
+{
+    int arr = (lua_newtable(L), lua_gettop(L));
+    profile_entry *entry;
+    int n = 0;
+    int i;
+
+    entry = __atomic_load_n(&(script->profile), __ATOMIC_ACQUIRE);
+
+    for (; entry != NULL; entry = entry->next)
+    {
+        int table = (lua_newtable(L), lua_gettop(L));
+        uint64_t calls = __atomic_load_n(&(entry->calls), __ATOMIC_RELAXED);
+        uint64_t total = __atomic_load_n(&(entry->total), __ATOMIC_RELAXED);
+
+        lua_pushstring(L, "signal");
+        lua_pushstring(L, entry->signal);
+        lua_settable(L, table);
+
+        lua_pushstring(L, "id");
+        lua_pushstring(L, entry->id);
+        lua_settable(L, table);
+
+        lua_pushstring(L, "calls");
+        lua_pushnumber(L, calls);
+        lua_settable(L, table);
+
+        /* Seconds, like luna.timers */
+        lua_pushstring(L, "total");
+        lua_pushnumber(L, total / 1e9);
+        lua_settable(L, table);
+
+        lua_pushstring(L, "mean");
+        lua_pushnumber(L, calls ? total / 1e9 / calls : 0);
+        lua_settable(L, table);
+
+        lua_pushstring(L, "max");
+        lua_pushnumber(L, __atomic_load_n(&(entry->max), __ATOMIC_RELAXED) /
+                       1e9);
+        lua_settable(L, table);
+
+        lua_pushstring(L, "histogram");
+        lua_newtable(L);
+
+        for (i = 0; i < PROFILE_BUCKETS; ++i)
+        {
+            lua_pushnumber(L, __atomic_load_n(&(entry->histogram[i]),
+                                              __ATOMIC_RELAXED));
+            lua_rawseti(L, -2, i + 1);
+        }
+
+        lua_settable(L, table);
+
+        lua_rawseti(L, arr, ++n);
+    }
+
+    return 1;
+}
+
+int luaX_profile_begin(lua_State *L)
+{
+    lua_pushnumber(L, profile_now());
+
+    return 1;
+}
+
+int luaX_profile_end(lua_State *L)
+{
+    uint64_t now = profile_now();
+    lua_Number start = luaL_checknumber(L, 3);
+    profile_entry *entry;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    /* The handler keeps its entry, it's looked up on its first call */
+    lua_getfield(L, 1, "profile");
+
+    if ((entry = lua_touserdata(L, -1)) == NULL)
+    {
+        const char *id;
+
+        lua_getfield(L, 1, "id");
+
+        if ((id = lua_tostring(L, -1)) == NULL)
+            id = "?";
+
+        entry = profile_get(api_getscript(L), luaL_checkstring(L, 2), id);
+
+        if (entry == NULL)
+            return 0;
+
+        lua_pushlightuserdata(L, entry);
+        lua_setfield(L, 1, "profile");
+    }
+
+    profile_add(entry, now - (uint64_t)start);
+
+    return 0;
+}
+
+int luaX_register_profile(lua_State *L, int regtable)
+{
+    /* Called by corelib around each handler. Plain functions, even for
+     * workers, they only touch the script's own entries */
+    lua_pushcfunction(L, &luaX_profile_begin);
+    lua_setfield(L, regtable, "__profile_begin");
+
+    lua_pushcfunction(L, &luaX_profile_end);
+    lua_setfield(L, regtable, "__profile_end");
+
+    return 0;
+}
@@ -0,0 +1,67 @@
+/*
+ * This file is part of Luna
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef LUA_PROFILE_H
+#define LUA_PROFILE_H
+
+#include <stdint.h>
+
+#include <lua.h>
+
+#include "lua_manager.h"
+
+#include "../state.h"
+#include "../event.h"
+
+/* Latency histogram, one bucket per decade: under 1us, under 10us and so
+ * on up to under 1s, and the last for everything slower */
+#define PROFILE_BUCKETS 8
+
+/*
+ * Time spent in one handler of a script, or in its timers. Only ever
+ * updated by the thread the script runs on, everyone else reads the
+ * counters atomically. Allocated with malloc() since workers create theirs
+ * on their own thread
+ */
+typedef struct profile_entry
+{
+    struct profile_entry *next;
+
+    char signal[32];
+    char id[64];
+
+    uint64_t calls;
+    uint64_t total; /* Nanoseconds */
+    uint64_t max;
+    uint64_t histogram[PROFILE_BUCKETS];
+} profile_entry;
+
+
+uint64_t profile_now(void);
+int profile_sync(luna_state *, luna_script *);
+void profile_end(luna_script *, const char *, const char *, uint64_t);
+void profile_free(luna_script *);
+
+int profile_start(luna_state *);
+void profile_stop(luna_state *);
+void profile_dump(luna_state *);
+
+int luaX_push_profile(lua_State *, luna_script *);
+int luaX_register_profile(lua_State *, int);
+
+#endif
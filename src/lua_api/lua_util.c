@@ -27,6 +27,7 @@
 #include "lua_util.h"
 
 #include "../irc.h"
+#include "../net.h"
 
 
 int api_loglevel_from_string(const char *lev)
@@ -44,6 +45,19 @@ int api_loglevel_from_string(const char *lev)
         return LOGLEV_ERROR;
 }
 
+int api_priority_from_string(const char *prio)
+{
+    if (!prio)
+        return NET_PRIO_INTERACTIVE;
+
+    if (!strcasecmp(prio, "urgent"))
+        return NET_PRIO_URGENT;
+    else if (!strcasecmp(prio, "bulk"))
+        return NET_PRIO_BULK;
+    else
+        return NET_PRIO_INTERACTIVE;
+}
+
 luna_state *api_getstate(lua_State *L)
 {
     luna_state *state = NULL;
@@ -57,205 +71,360 @@ luna_state *api_getstate(lua_State *L)
     return state;
 }
 
-int luaX_push_args(lua_State *L, int n, char **param)
+luna_script *api_getscript(lua_State *L)
+{
+    luna_script *script = NULL;
+
+    lua_pushlightuserdata(L, (void *)script_key);
+    lua_gettable(L, LUA_REGISTRYINDEX);
+
+    script = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    return script;
+}
+
+luna_network *api_getnetwork(lua_State *L, int index)
+{
+    luna_state *state = api_getstate(L);
+    luna_network *net = NULL;
+
+    /* Explicitly named network */
+    if (!lua_isnoneornil(L, index))
+    {
+        const char *name = luaL_checkstring(L, index);
+
+        if ((net = network_get(state, name)) == NULL)
+            luaL_error(L, "no such network '%s'", name);
+
+        return net;
+    }
+
+    /* Otherwise the one whose event is being handled, or the first one
+     * configured when called outside of a network event */
+    if (state->current != NULL)
+        return state->current;
+
+    if (state->networks->root != NULL)
+        return (luna_network *)(state->networks->root->data);
+
+    luaL_error(L, "no networks configured");
+
+    return NULL;
+}
+
+int luaX_push_script_meminfo(lua_State *L, luna_script *script)
+{
+    int table = (lua_newtable(L), lua_gettop(L));
+
+    lua_pushstring(L, "used");
+    lua_pushnumber(L, __atomic_load_n(&(script->mem_used), __ATOMIC_RELAXED));
+    lua_settable(L, table);
+
+    lua_pushstring(L, "peak");
+    lua_pushnumber(L, __atomic_load_n(&(script->mem_peak), __ATOMIC_RELAXED));
+    lua_settable(L, table);
+
+    lua_pushstring(L, "limit");
+    lua_pushnumber(L, __atomic_load_n(&(script->mem_limit), __ATOMIC_RELAXED));
+    lua_settable(L, table);
+
+    lua_pushstring(L, "allocs");
+    lua_pushnumber(L, __atomic_load_n(&(script->mem_allocs), __ATOMIC_RELAXED));
+    lua_settable(L, table);
+
+    lua_pushstring(L, "frees");
+    lua_pushnumber(L, __atomic_load_n(&(script->mem_frees), __ATOMIC_RELAXED));
+    lua_settable(L, table);
+
+    return 1;
+}
+
+int luaX_push_view(lua_State *L, const irc_view *view)
+{
+    if ((view == NULL) || (view->ptr == NULL))
+        lua_pushnil(L);
+    else
+        lua_pushlstring(L, view->ptr, view->len);
+
+    return 1;
+}
+
+int luaX_push_args(lua_State *L, int n, const irc_view *param)
 {
     int i;
     int table = (lua_newtable(L), lua_gettop(L));
 
     for (i = 0; i < n; ++i)
     {
-        lua_pushstring(L, param[i]);
+        luaX_push_view(L, &(param[i]));
         lua_rawseti(L, table, i + 1);
     }
 
     return 1;
 }
 
-int luaX_push_raw(luna_state *st, lua_State *L, va_list args)
+void luaX_event_init(luaX_event *event, const irc_message *msg)
 {
-    irc_message *ev = va_arg(args, irc_message *);
-
-    lua_pushstring(L, ev->m_prefix);
-    lua_pushstring(L, ev->m_command);
-    luaX_push_args(L, ev->m_paramcount, ev->m_params);
-    lua_pushstring(L, ev->m_msg);
+    event->msg = msg;
+    event->nfields = 0;
 
-    return 4;
+    return;
 }
 
-int luaX_push_privmsg(luna_state *st, lua_State *L, va_list args)
+void luaX_event_add(luaX_event *event, const char *name, const irc_view *view)
 {
-    irc_message *ev = va_arg(args, irc_message *);
+    int i = event->nfields;
+
+    if (i >= LUAX_EVENT_FIELDS)
+        return;
 
-    lua_pushstring(L, ev->m_prefix);
-    lua_pushstring(L, ev->m_params[0]);
-    lua_pushstring(L, ev->m_msg);
+    event->names[i] = name;
 
-    return 3;
+    if (view != NULL)
+    {
+        event->fields[i] = *view;
+    }
+    else
+    {
+        event->fields[i].ptr = NULL;
+        event->fields[i].len = 0;
+    }
+
+    event->nfields++;
+
+    return;
 }
 
-int luaX_push_ctcp(luna_state *st, lua_State *L, va_list args)
+void luaX_event_addstr(luaX_event *event, const char *name, const char *str)
 {
-    irc_message *ev = va_arg(args, irc_message *);
-    const char *ctcp = va_arg(args, const char *);
-    const char *msg = va_arg(args, const char *);
+    irc_view view;
+
+    view.ptr = (char *)str;
+    view.len = str ? strlen(str) : 0;
 
-    lua_pushstring(L, ev->m_prefix);
-    lua_pushstring(L, ev->m_params[0]);
-    lua_pushstring(L, ctcp);
-    lua_pushstring(L, msg);
+    luaX_event_add(event, name, &view);
 
-    return 4;
+    return;
 }
 
-int luaX_push_ctcp_rsp(luna_state *st, lua_State *L, va_list args)
+const luaX_event **luaX_push_event(lua_State *L, const luaX_event *event)
 {
-    irc_message *ev = va_arg(args, irc_message *);
-    const char *ctcp = va_arg(args, const char *);
-    const char *msg = va_arg(args, const char *);
+    const luaX_event **ud = lua_newuserdata(L, sizeof(*ud));
+
+    *ud = event;
 
-    lua_pushstring(L, ev->m_prefix);
-    lua_pushstring(L, ev->m_params[0]);
-    lua_pushstring(L, ctcp);
-    lua_pushstring(L, msg);
+    luaL_getmetatable(L, LUAX_EVENT_META);
+    lua_setmetatable(L, -2);
 
-    return 4;
+    return ud;
 }
 
-int luaX_push_action(luna_state *st, lua_State *L, va_list args)
+int luaX_event_index(lua_State *L)
 {
-    irc_message *ev = va_arg(args, irc_message *);
-    const char *msg = va_arg(args, const char *);
+    const luaX_event **ud = luaL_checkudata(L, 1, LUAX_EVENT_META);
+    const char *key = luaL_checkstring(L, 2);
+    const luaX_event *event = *ud;
+    const irc_message *msg;
+    int i;
 
-    lua_pushstring(L, ev->m_prefix);
-    lua_pushstring(L, ev->m_params[0]);
-    lua_pushstring(L, msg);
+    /* The message it described is gone once the signal was handled */
+    if (event == NULL)
+        return luaL_error(L, "event used after its signal was handled");
+
+    for (i = 0; i < event->nfields; ++i)
+        if (!strcmp(key, event->names[i]))
+            return luaX_push_view(L, &(event->fields[i]));
+
+    if ((msg = event->msg) == NULL)
+        return 0;
+
+    if (!strcmp(key, "prefix"))
+        return luaX_push_view(L, &(msg->m_prefix));
+    else if (!strcmp(key, "command"))
+        return luaX_push_view(L, &(msg->m_command));
+    else if (!strcmp(key, "message"))
+        return luaX_push_view(L, &(msg->m_msg));
+    else if (!strcmp(key, "params"))
+        return luaX_push_args(L, msg->m_paramcount, msg->m_params);
+    else if (!strcmp(key, "numeric") && (msg->m_id == IRC_CMD_NUMERIC))
+        return (lua_pushnumber(L, msg->m_numeric), 1);
+
+    return 0;
+}
 
-    return 3;
+int luaX_register_event(lua_State *L)
+{
+    luaL_newmetatable(L, LUAX_EVENT_META);
+
+    lua_pushcfunction(L, &luaX_event_index);
+    lua_setfield(L, -2, "__index");
+
+    lua_pop(L, 1);
+
+    return 0;
 }
 
-int luaX_push_command(luna_state *st, lua_State *L, va_list args)
+/*
+ * What each signal carries on top of the message fields (prefix, command,
+ * message, params and numeric)
+ */
+int luaX_event_raw(luaX_event *event, va_list args)
+{
+    luaX_event_init(event, va_arg(args, irc_message *));
+
+    return 0;
+}
+
+int luaX_event_privmsg(luaX_event *event, va_list args)
 {
     irc_message *ev = va_arg(args, irc_message *);
-    const char *cmd = va_arg(args, const char *);
-    const char *rest = va_arg(args, const char *);
 
-    lua_pushstring(L, ev->m_prefix);
-    lua_pushstring(L, ev->m_params[0]);
-    lua_pushstring(L, cmd);
-    lua_pushstring(L, rest);
+    luaX_event_init(event, ev);
+    luaX_event_add(event, "target", &(ev->m_params[0]));
 
-    return 4;
+    return 0;
 }
 
-int luaX_push_join(luna_state *st, lua_State *L, va_list args)
+int luaX_event_ctcp(luaX_event *event, va_list args)
 {
     irc_message *ev = va_arg(args, irc_message *);
+    const irc_view *ctcp = va_arg(args, const irc_view *);
+    const irc_view *msg = va_arg(args, const irc_view *);
 
-    lua_pushstring(L, ev->m_prefix);
-    lua_pushstring(L, ev->m_params[0]);
+    luaX_event_init(event, ev);
+    luaX_event_add(event, "target", &(ev->m_params[0]));
+    luaX_event_add(event, "ctcp", ctcp);
+    luaX_event_add(event, "args", msg);
 
-    return 2;
+    return 0;
 }
 
-int luaX_push_join_sync(luna_state *st, lua_State *L, va_list args)
+int luaX_event_ctcp_rsp(luaX_event *event, va_list args)
+{
+    return luaX_event_ctcp(event, args);
+}
+
+int luaX_event_action(luaX_event *event, va_list args)
 {
     irc_message *ev = va_arg(args, irc_message *);
+    const irc_view *msg = va_arg(args, const irc_view *);
 
-    lua_pushstring(L, ev->m_params[1]);
+    /* The action text, not the whole CTCP */
+    luaX_event_init(event, ev);
+    luaX_event_add(event, "target", &(ev->m_params[0]));
+    luaX_event_add(event, "message", msg);
 
-    return 1;
+    return 0;
 }
 
-int luaX_push_part(luna_state *st, lua_State *L, va_list args)
+int luaX_event_command(luaX_event *event, va_list args)
 {
     irc_message *ev = va_arg(args, irc_message *);
+    const irc_view *cmd = va_arg(args, const irc_view *);
+    const irc_view *rest = va_arg(args, const irc_view *);
 
-    lua_pushstring(L, ev->m_prefix);
-    lua_pushstring(L, ev->m_params[0]);
-    lua_pushstring(L, ev->m_msg);
+    /* The bot command, not PRIVMSG */
+    luaX_event_init(event, ev);
+    luaX_event_add(event, "target", &(ev->m_params[0]));
+    luaX_event_add(event, "command", cmd);
+    luaX_event_add(event, "args", rest);
 
-    return 3;
+    return 0;
 }
 
-int luaX_push_quit(luna_state *st, lua_State *L, va_list args)
+int luaX_event_join(luaX_event *event, va_list args)
 {
     irc_message *ev = va_arg(args, irc_message *);
 
-    lua_pushstring(L, ev->m_prefix);
-    lua_pushstring(L, ev->m_msg);
+    /* Where handle_join() takes it from, some servers send the channel as
+     * the trailing part */
+    luaX_event_init(event, ev);
+    luaX_event_add(event, "channel", ev->m_msg.ptr ? &(ev->m_msg) :
+                   &(ev->m_params[0]));
 
-    return 2;
+    return 0;
 }
 
-int luaX_push_notice(luna_state *st, lua_State *L, va_list args)
+int luaX_event_join_sync(luaX_event *event, va_list args)
 {
     irc_message *ev = va_arg(args, irc_message *);
 
-    lua_pushstring(L, ev->m_prefix);
-    lua_pushstring(L, ev->m_params[0]);
-    lua_pushstring(L, ev->m_msg);
+    luaX_event_init(event, ev);
+    luaX_event_add(event, "channel", &(ev->m_params[1]));
 
-    return 3;
+    return 0;
 }
 
-int luaX_push_nick(luna_state *st, lua_State *L, va_list args)
+int luaX_event_part(luaX_event *event, va_list args)
 {
     irc_message *ev = va_arg(args, irc_message *);
-    const char *newnick = va_arg(args, const char *);
 
-    lua_pushstring(L, ev->m_prefix);
-    lua_pushstring(L, newnick);
+    /* The trailing part is the reason here */
+    luaX_event_init(event, ev);
+    luaX_event_add(event, "channel", &(ev->m_params[0]));
 
-    return 2;
+    return 0;
 }
 
-int luaX_push_invite(luna_state *st, lua_State *L, va_list args)
+int luaX_event_quit(luaX_event *event, va_list args)
+{
+    return luaX_event_raw(event, args);
+}
+
+int luaX_event_notice(luaX_event *event, va_list args)
+{
+    return luaX_event_privmsg(event, args);
+}
+
+int luaX_event_nick(luaX_event *event, va_list args)
 {
     irc_message *ev = va_arg(args, irc_message *);
-    const char *target = va_arg(args, const char *);
+    const irc_view *newnick = va_arg(args, const irc_view *);
 
-    lua_pushstring(L, ev->m_prefix);
-    lua_pushstring(L, target);
+    luaX_event_init(event, ev);
+    luaX_event_add(event, "nick", newnick);
 
-    return 2;
+    return 0;
 }
 
-int luaX_push_topic(luna_state *st, lua_State *L, va_list args)
+int luaX_event_invite(luaX_event *event, va_list args)
 {
     irc_message *ev = va_arg(args, irc_message *);
 
-    lua_pushstring(L, ev->m_prefix);
-    lua_pushstring(L, ev->m_params[0]);
-    lua_pushstring(L, ev->m_msg);
+    /* The channel comes either as the trailing part or the second param */
+    luaX_event_init(event, ev);
+    luaX_event_add(event, "channel", ev->m_msg.ptr ? &(ev->m_msg) :
+                   (ev->m_paramcount > 1) ? &(ev->m_params[1]) : NULL);
+
+    return 0;
+}
 
-    return 3;
+int luaX_event_topic(luaX_event *event, va_list args)
+{
+    return luaX_event_part(event, args);
 }
 
-int luaX_push_kick(luna_state *st, lua_State *L, va_list args)
+int luaX_event_kick(luaX_event *event, va_list args)
 {
     irc_message *ev = va_arg(args, irc_message *);
 
-    lua_pushstring(L, ev->m_prefix);
-    lua_pushstring(L, ev->m_params[0]);
-    lua_pushstring(L, ev->m_params[1]);
-    lua_pushstring(L, ev->m_msg);
+    luaX_event_init(event, ev);
+    luaX_event_add(event, "channel", &(ev->m_params[0]));
+    luaX_event_add(event, "kicked", &(ev->m_params[1]));
 
-    return 4;
+    return 0;
 }
 
-int luaX_push_script_load(luna_state *st, lua_State *L, va_list args)
+int luaX_event_script_load(luaX_event *event, va_list args)
 {
-    const char *name = va_arg(args, const char *);
+    luaX_event_init(event, NULL);
+    luaX_event_addstr(event, "script", va_arg(args, const char *));
 
-    lua_pushstring(L, name);
-    return 1;
+    return 0;
 }
 
-int luaX_push_script_unload(luna_state *st, lua_State *L, va_list args)
+int luaX_event_script_unload(luaX_event *event, va_list args)
 {
-    const char *name = va_arg(args, const char *);
-
-    lua_pushstring(L, name);
-    return 1;
+    return luaX_event_script_load(event, args);
 }
@@ -25,25 +25,38 @@
 #include "../channel.h"
 
 int api_loglevel_from_string(const char *);
+int api_priority_from_string(const char *);
 luna_state *api_getstate(lua_State *);
+luna_network *api_getnetwork(lua_State *, int);
+luna_script *api_getscript(lua_State *);
+int luaX_push_script_meminfo(lua_State *, luna_script *);
 
-int luaX_push_raw(luna_state *, lua_State *, va_list);
-int luaX_push_idle(luna_state *, lua_State *, va_list);
-int luaX_push_privmsg(luna_state *, lua_State *, va_list);
-int luaX_push_ctcp(luna_state *, lua_State *, va_list);
-int luaX_push_ctcp_rsp(luna_state *, lua_State *, va_list);
-int luaX_push_action(luna_state *, lua_State *, va_list);
-int luaX_push_command(luna_state *, lua_State *, va_list);
-int luaX_push_join(luna_state *, lua_State *, va_list);
-int luaX_push_join_sync(luna_state *, lua_State *, va_list);
-int luaX_push_part(luna_state *, lua_State *, va_list);
-int luaX_push_quit(luna_state *, lua_State *, va_list);
-int luaX_push_notice(luna_state *, lua_State *, va_list);
-int luaX_push_nick(luna_state *, lua_State *, va_list);
-int luaX_push_invite(luna_state *, lua_State *, va_list);
-int luaX_push_topic(luna_state *, lua_State *, va_list);
-int luaX_push_kick(luna_state *, lua_State *, va_list);
-int luaX_push_script_load(luna_state *, lua_State *, va_list);
-int luaX_push_script_unload(luna_state *, lua_State *, va_list);
+int luaX_push_view(lua_State *, const irc_view *);
+int luaX_push_args(lua_State *, int, const irc_view *);
+
+void luaX_event_init(luaX_event *, const irc_message *);
+void luaX_event_add(luaX_event *, const char *, const irc_view *);
+void luaX_event_addstr(luaX_event *, const char *, const char *);
+const luaX_event **luaX_push_event(lua_State *, const luaX_event *);
+int luaX_event_index(lua_State *);
+int luaX_register_event(lua_State *);
+
+int luaX_event_raw(luaX_event *, va_list);
+int luaX_event_privmsg(luaX_event *, va_list);
+int luaX_event_ctcp(luaX_event *, va_list);
+int luaX_event_ctcp_rsp(luaX_event *, va_list);
+int luaX_event_action(luaX_event *, va_list);
+int luaX_event_command(luaX_event *, va_list);
+int luaX_event_join(luaX_event *, va_list);
+int luaX_event_join_sync(luaX_event *, va_list);
+int luaX_event_part(luaX_event *, va_list);
+int luaX_event_quit(luaX_event *, va_list);
+int luaX_event_notice(luaX_event *, va_list);
+int luaX_event_nick(luaX_event *, va_list);
+int luaX_event_invite(luaX_event *, va_list);
+int luaX_event_topic(luaX_event *, va_list);
+int luaX_event_kick(luaX_event *, va_list);
+int luaX_event_script_load(luaX_event *, va_list);
+int luaX_event_script_unload(luaX_event *, va_list);
 
 #endif
@@ -0,0 +1,663 @@
+/*
+ * This file is part of Luna
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+/*
+ * Scripts that run on a thread of their own.
+ *
+ * A worker script's Lua state is only ever used by one thread at a time.
+ * Signals and timers reach the worker through a lock-free queue, and every
+ * C function of the API it calls is forwarded to the main thread, which runs
+ * it on the worker's state while the worker waits for the result. That way
+ * nothing but the main thread touches the bot's state, and a script busy
+ * with something slow holds up nobody but itself.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include <sys/eventfd.h>
+
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+
+#include "lua_worker.h"
+#include "lua_util.h"
+#include "lua_profile.h"
+
+#include "modules/lua_channel.h"
+#include "modules/lua_timers.h"
+
+#include "../event.h"
+#include "../logger.h"
+#include "../util.h"
+#include "../mm.h"
+
+
+void *worker_thread(void *);
+void worker_handle(luna_worker *, worker_msg *);
+void worker_post(luna_worker *, worker_msg *);
+int worker_lossy(const worker_msg *);
+void worker_refill(luna_worker *);
+void worker_on_notify(event_loop *, int, int, void *);
+int worker_forward(luna_worker *, lua_State *);
+int worker_trampoline(lua_State *);
+int worker_run_timer(lua_State *);
+void worker_wrap_table(lua_State *, luna_worker *);
+size_t worker_view_size(const irc_view *);
+char *worker_view_copy(irc_view *, const irc_view *, char *);
+
+/* Worker the current thread is, NULL on the main thread */
+__thread luna_worker *worker_self = NULL;
+
+
+int worker_init(luna_worker **worker, luna_state *state, luna_script *script)
+{
+    luna_worker *tmp = NULL;
+
+    if ((tmp = mm_malloc(sizeof(*tmp))) == NULL)
+        return 1;
+
+    memset(tmp, 0, sizeof(*tmp));
+    tmp->state = state;
+    tmp->script = script;
+    tmp->wake = tmp->notify = -1;
+
+    if ((tmp->wake = eventfd(0, EFD_CLOEXEC)) < 0)
+        goto fail;
+
+    if ((tmp->notify = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+        goto fail;
+
+    if (spsc_init(&(tmp->events), WORKER_QUEUE) != 0)
+        goto fail;
+
+    /* The worker has at most one call outstanding */
+    if (spsc_init(&(tmp->calls), 2) != 0)
+        goto fail;
+
+    *worker = tmp;
+    return 0;
+
+fail:
+    worker_destroy(tmp);
+
+    return 1;
+}
+
+void worker_destroy(luna_worker *worker)
+{
+    worker_msg *msg;
+
+    worker_stop(worker);
+
+    if (worker->events != NULL)
+    {
+        /* Posted after it stopped */
+        while ((msg = spsc_pop(worker->events)) != NULL)
+            free(msg);
+
+        spsc_destroy(worker->events);
+    }
+
+    while ((msg = worker->overflow) != NULL)
+    {
+        worker->overflow = msg->next;
+        free(msg);
+    }
+
+    if (worker->calls != NULL)
+        spsc_destroy(worker->calls);
+
+    if (worker->wake >= 0)
+        close(worker->wake);
+
+    if (worker->notify >= 0)
+        close(worker->notify);
+
+    mm_free(worker);
+
+    return;
+}
+
+int worker_start(luna_worker *worker)
+{
+    luna_state *state = worker->state;
+
+    if (event_add(state->loop, worker->notify, EVENT_READ,
+                  &worker_on_notify, worker) != 0)
+        return 1;
+
+    worker->running = 1;
+
+    if (thread_start(&(worker->thread), &worker_thread, worker) != 0)
+        worker->running = 0;
+
+    if (!worker->running)
+    {
+        event_remove(state->loop, worker->notify);
+
+        return 1;
+    }
+
+    return 0;
+}
+
+void worker_stop(luna_worker *worker)
+{
+    luna_state *state = worker->state;
+    luna_network *outer = state->current;
+    worker_msg *msg;
+
+    if (!worker->running)
+        return;
+
+    /* A call it is waiting on fails unless it is already running, which
+     * script_unload() waits for. The main thread won't answer it */
+    __atomic_store_n(&(worker->stop), 1, __ATOMIC_RELEASE);
+    eventfd_poke(worker->wake);
+
+    pthread_join(worker->thread, NULL);
+    worker->running = 0;
+
+    while (spsc_pop(worker->calls) != NULL)
+        ;
+
+    event_remove(state->loop, worker->notify);
+
+    /* Whatever it didn't get to, like its own script_unload, is handled
+     * here on the main thread now that the state is ours */
+    while ((msg = spsc_pop(worker->events)) != NULL)
+    {
+        state->current = msg->net;
+        worker_handle(worker, msg);
+    }
+
+    while ((msg = worker->overflow) != NULL)
+    {
+        worker->overflow = msg->next;
+
+        state->current = msg->net;
+        worker_handle(worker, msg);
+    }
+
+    worker->overflow_tail = NULL;
+    worker->overflowed = 0;
+    state->current = outer;
+
+    return;
+}
+
+void *worker_thread(void *data)
+{
+    luna_worker *worker = (luna_worker *)data;
+    worker_msg *msg;
+    uint64_t count;
+
+    worker_self = worker;
+
+    while (!__atomic_load_n(&(worker->stop), __ATOMIC_ACQUIRE))
+    {
+        /* Anything posted after the queue turned out empty pokes wake */
+        if ((msg = spsc_pop(worker->events)) == NULL)
+        {
+            if (read(worker->wake, &count, sizeof(count)) < 0)
+                ; /* Interrupted, the loop checks again */
+
+            continue;
+        }
+
+        /* Made room. Pairs with the fence in worker_refill(), either it
+         * sees the free slot or we see the flag */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        if (__atomic_load_n(&(worker->overflowed), __ATOMIC_RELAXED) &&
+            __atomic_exchange_n(&(worker->overflowed), 0, __ATOMIC_RELAXED))
+            eventfd_poke(worker->notify);
+
+        worker_handle(worker, msg);
+    }
+
+    return NULL;
+}
+
+void worker_handle(luna_worker *worker, worker_msg *msg)
+{
+    luna_script *script = worker->script;
+    lua_State *L = script->state;
+
+    worker->current = msg->net;
+
+    if (msg->type == WORKER_MSG_TIMER)
+    {
+        uint64_t start = 0;
+
+        if (profile_sync(worker->state, script))
+            start = profile_now();
+
+        lua_pushcfunction(L, &worker_run_timer);
+        lua_pushnumber(L, msg->timer);
+
+        if (lua_pcall(L, 1, 0, 0) != 0)
+        {
+            logger_log(worker->state->logger, LOGLEV_ERROR,
+                       "Lua error ('timer@%s'): %s",
+                       script->filename, lua_tostring(L, -1));
+
+            lua_pop(L, 1);
+        }
+
+        if (start != 0)
+            profile_end(script, "timer", "*", start);
+    }
+    else
+    {
+        script_emit(worker->state, msg->net, script, msg->sig, msg->ev);
+    }
+
+    worker->current = NULL;
+    free(msg);
+
+    return;
+}
+
+void worker_post(luna_worker *worker, worker_msg *msg)
+{
+    luna_state *state = worker->state;
+
+    /* Nothing overtakes what is held back already */
+    if ((worker->overflow != NULL) || (spsc_push(worker->events, msg) != 0))
+    {
+        if (!worker_lossy(msg))
+        {
+            msg->next = NULL;
+
+            if (worker->overflow_tail != NULL)
+                worker->overflow_tail->next = msg;
+            else
+                worker->overflow = msg;
+
+            worker->overflow_tail = msg;
+            worker_refill(worker);
+
+            return;
+        }
+
+        if (worker->dropped++ == 0)
+            logger_log(state->logger, LOGLEV_WARNING,
+                       "Worker '%s' can't keep up, dropping events",
+                       worker->script->filename);
+
+        free(msg);
+
+        return;
+    }
+
+    if (worker->dropped > 0)
+    {
+        logger_log(state->logger, LOGLEV_WARNING,
+                   "Worker '%s' dropped %lu events",
+                   worker->script->filename, (unsigned long)worker->dropped);
+
+        worker->dropped = 0;
+    }
+
+    eventfd_poke(worker->wake);
+
+    return;
+}
+
+int worker_lossy(const worker_msg *msg)
+{
+    /* A lost timer never fires again and its coroutines never resume, a
+     * lost connect or part leaves the script with the wrong picture. What
+     * floods in is chatter, the script only misses a line of it */
+    if (msg->type != WORKER_MSG_SIGNAL)
+        return 0;
+
+    switch (msg->sig)
+    {
+    case LUNA_SIG_RAW:
+    case LUNA_SIG_PING:
+    case LUNA_SIG_PRIVATE_MESSAGE:
+    case LUNA_SIG_PUBLIC_MESSAGE:
+    case LUNA_SIG_PRIVATE_CTCP:
+    case LUNA_SIG_PRIVATE_CTCP_RESPONSE:
+    case LUNA_SIG_PUBLIC_CTCP:
+    case LUNA_SIG_PUBLIC_CTCP_RESPONSE:
+    case LUNA_SIG_PRIVATE_ACTION:
+    case LUNA_SIG_PUBLIC_ACTION:
+    case LUNA_SIG_PRIVATE_COMMAND:
+    case LUNA_SIG_PUBLIC_COMMAND:
+    case LUNA_SIG_PRIVATE_NOTICE:
+    case LUNA_SIG_PUBLIC_NOTICE:
+        return 1;
+
+    default:
+        return 0;
+    }
+}
+
+void worker_refill(luna_worker *worker)
+{
+    worker_msg *msg;
+    int moved = 0;
+
+    while ((msg = worker->overflow) != NULL)
+    {
+        if (spsc_push(worker->events, msg) != 0)
+        {
+            /* Have the worker say when it takes the next one. It may have
+             * done so already, so try once more after asking */
+            __atomic_store_n(&(worker->overflowed), 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+            if (spsc_push(worker->events, msg) != 0)
+                break;
+        }
+
+        worker->overflow = msg->next;
+        moved = 1;
+    }
+
+    if (worker->overflow == NULL)
+        worker->overflow_tail = NULL;
+
+    if (moved)
+        eventfd_poke(worker->wake);
+
+    return;
+}
+
+void worker_post_signal(luna_worker *worker, luna_network *net,
+                        luna_signal sig, const luaX_event *ev)
+{
+    worker_msg *msg;
+    size_t size = 0;
+    char *p;
+    int i;
+
+    /* The event only points into the line being handled, so everything
+     * it refers to goes into the message */
+    if (ev != NULL)
+    {
+        for (i = 0; i < ev->nfields; ++i)
+            size += worker_view_size(&(ev->fields[i]));
+
+        if (ev->msg != NULL)
+        {
+            size += worker_view_size(&(ev->msg->m_prefix));
+            size += worker_view_size(&(ev->msg->m_command));
+            size += worker_view_size(&(ev->msg->m_msg));
+
+            for (i = 0; i < ev->msg->m_paramcount; ++i)
+                size += worker_view_size(&(ev->msg->m_params[i]));
+        }
+    }
+
+    if ((msg = malloc(sizeof(*msg) + size)) == NULL)
+        return;
+
+    msg->type = WORKER_MSG_SIGNAL;
+    msg->net = net;
+    msg->sig = sig;
+    msg->ev = NULL;
+
+    if (ev != NULL)
+    {
+        p = msg->data;
+
+        msg->event = *ev;
+        msg->ev = &(msg->event);
+
+        for (i = 0; i < ev->nfields; ++i)
+            p = worker_view_copy(&(msg->event.fields[i]), &(ev->fields[i]), p);
+
+        if (ev->msg != NULL)
+        {
+            const irc_message *src = ev->msg;
+
+            msg->msg = *src;
+            msg->event.msg = &(msg->msg);
+
+            p = worker_view_copy(&(msg->msg.m_prefix), &(src->m_prefix), p);
+            p = worker_view_copy(&(msg->msg.m_command), &(src->m_command), p);
+            p = worker_view_copy(&(msg->msg.m_msg), &(src->m_msg), p);
+
+            for (i = 0; i < src->m_paramcount; ++i)
+                p = worker_view_copy(&(msg->msg.m_params[i]),
+                                     &(src->m_params[i]), p);
+        }
+    }
+
+    worker_post(worker, msg);
+
+    return;
+}
+
+void worker_post_timer(luna_worker *worker, luna_network *net, int id)
+{
+    worker_msg *msg;
+
+    if ((msg = malloc(sizeof(*msg))) == NULL)
+        return;
+
+    msg->type = WORKER_MSG_TIMER;
+    msg->net = net;
+    msg->timer = id;
+
+    worker_post(worker, msg);
+
+    return;
+}
+
+size_t worker_view_size(const irc_view *view)
+{
+    return (view->ptr != NULL) ? view->len + 1 : 0;
+}
+
+char *worker_view_copy(irc_view *dest, const irc_view *src, char *p)
+{
+    dest->len = src->len;
+
+    if (src->ptr == NULL)
+    {
+        dest->ptr = NULL;
+
+        return p;
+    }
+
+    /* Terminated as well, views of a parsed line double as C strings */
+    memcpy(p, src->ptr, src->len);
+    p[src->len] = '\0';
+    dest->ptr = p;
+
+    return p + src->len + 1;
+}
+
+void worker_on_notify(event_loop *loop, int fd, int events, void *data)
+{
+    luna_worker *worker = (luna_worker *)data;
+    luna_state *state = worker->state;
+    char file[sizeof(worker->script->filename)];
+    worker_call *call;
+    uint64_t count;
+
+    if (read(fd, &count, sizeof(count)) < 0)
+        return;
+
+    if (worker->overflow != NULL)
+        worker_refill(worker);
+
+    /* The worker is blocked until done is set, its state is ours. The
+     * function and its arguments make up the stack of its C call */
+    while ((call = spsc_pop(worker->calls)) != NULL)
+    {
+        luna_network *outer = state->current;
+
+        __atomic_store_n(&(call->taken), 1, __ATOMIC_RELEASE);
+
+        state->current = worker->current;
+        worker->calling = 1;
+        call->failed = lua_pcall(call->L, lua_gettop(call->L) - 1,
+                                 LUA_MULTRET, 0);
+        worker->calling = 0;
+        state->current = outer;
+
+        __atomic_store_n(&(call->done), 1, __ATOMIC_RELEASE);
+        eventfd_poke(worker->wake);
+    }
+
+    /* Unloaded by the call, e.g. from one of its coroutines, now that
+     * nothing runs on the state anymore. The worker goes with it */
+    if (worker->unload)
+    {
+        strcpy(file, worker->script->filename);
+        script_unload(state, file);
+    }
+
+    return;
+}
+
+int worker_forward(luna_worker *worker, lua_State *L)
+{
+    worker_call call;
+    uint64_t count;
+
+    /* Already on the main thread, e.g. a forwarded function calling back
+     * into Lua, or the worker has stopped */
+    if (worker_self != worker)
+    {
+        lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+
+        return lua_gettop(L);
+    }
+
+    call.L = L;
+    call.taken = 0;
+    call.done = 0;
+    call.failed = 0;
+
+    spsc_push(worker->calls, &call);
+    eventfd_poke(worker->notify);
+
+    while (!__atomic_load_n(&(call.done), __ATOMIC_ACQUIRE))
+    {
+        /* Once taken the main thread is running it on our state and the
+         * script isn't stopped before it returned. Until then the main
+         * thread won't get to it anymore when stopping */
+        if (__atomic_load_n(&(worker->stop), __ATOMIC_ACQUIRE) &&
+            !__atomic_load_n(&(call.taken), __ATOMIC_ACQUIRE))
+            return luaL_error(L, "script is stopping");
+
+        if (read(worker->wake, &count, sizeof(count)) < 0)
+            ; /* Interrupted, check again */
+    }
+
+    if (call.failed)
+        return lua_error(L);
+
+    return lua_gettop(L);
+}
+
+/* Stands in for an API function, which is its first upvalue */
+int worker_trampoline(lua_State *L)
+{
+    luna_worker *worker = lua_touserdata(L, lua_upvalueindex(2));
+
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_insert(L, 1);
+
+    return worker_forward(worker, L);
+}
+
+int worker_run_timer(lua_State *L)
+{
+    luna_worker *worker = api_getscript(L)->worker;
+
+    /* Looked up on the main thread, the timer may be gone by now */
+    lua_pushcfunction(L, &luaX_timers_expire);
+    lua_insert(L, 1);
+
+    if ((worker_forward(worker, L) > 0) && lua_isfunction(L, 1))
+        lua_call(L, 0, 0);
+
+    return 0;
+}
+
+void worker_wrap(lua_State *L, luna_worker *worker)
+{
+    /* The API table, its module tables and the methods of the objects it
+     * hands out. Events stay local, they are copies the worker owns */
+    lua_getglobal(L, LIBNAME);
+    worker_wrap_table(L, worker);
+
+    lua_pushnil(L);
+
+    while (lua_next(L, -2) != 0)
+    {
+        if (lua_istable(L, -1))
+            worker_wrap_table(L, worker);
+
+        lua_pop(L, 1);
+    }
+
+    lua_pop(L, 1);
+
+    luaL_getmetatable(L, LUAX_CHANOBJ_META);
+    worker_wrap_table(L, worker);
+    lua_pop(L, 1);
+
+    luaL_getmetatable(L, LUAX_MEMBEROBJ_META);
+    worker_wrap_table(L, worker);
+    lua_pop(L, 1);
+
+    return;
+}
+
+void worker_wrap_table(lua_State *L, luna_worker *worker)
+{
+    int table = lua_gettop(L);
+
+    if (!lua_istable(L, table))
+        return;
+
+    lua_pushnil(L);
+
+    while (lua_next(L, table) != 0)
+    {
+        /* Replacing the value of an existing key is fine while iterating */
+        if (lua_iscfunction(L, -1) &&
+            (lua_tocfunction(L, -1) != &worker_trampoline))
+        {
+            lua_pushvalue(L, -2);
+            lua_insert(L, -2);
+            lua_pushlightuserdata(L, worker);
+            lua_pushcclosure(L, &worker_trampoline, 2);
+            lua_rawset(L, table);
+        }
+        else
+        {
+            lua_pop(L, 1);
+        }
+    }
+
+    return;
+}
@@ -0,0 +1,118 @@
+/*
+ * This file is part of Luna
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef LUA_WORKER_H
+#define LUA_WORKER_H
+
+#include <pthread.h>
+
+#include <lua.h>
+
+#include "lua_manager.h"
+
+#include "../state.h"
+#include "../irc.h"
+#include "../spsc.h"
+
+/* Messages a worker can have waiting. Past that chatter like raw is
+ * dropped, the rest waits on the main thread until there's room */
+#define WORKER_QUEUE 4096
+
+typedef enum worker_msg_type
+{
+    WORKER_MSG_SIGNAL,
+    WORKER_MSG_TIMER
+} worker_msg_type;
+
+/* A signal or timer for a worker script. Allocated with malloc() since it
+ * is freed on the worker thread, which mustn't touch mm */
+typedef struct worker_msg
+{
+    worker_msg_type type;
+    luna_network *net;
+
+    luna_signal sig;
+    luaX_event *ev; /* Points to event, or NULL if the signal has none */
+    luaX_event event;
+    irc_message msg;
+
+    int timer; /* luna.timers id */
+
+    struct worker_msg *next; /* On the worker's overflow list */
+
+    char data[1]; /* What the views of event and msg point to */
+} worker_msg;
+
+/* API call forwarded to the main thread, lives on the worker's stack */
+typedef struct worker_call
+{
+    lua_State *L; /* The script's state or one of its coroutines */
+
+    int taken; /* The main thread is running it, it can't be abandoned */
+    int done;
+    int failed;
+} worker_call;
+
+typedef struct luna_worker
+{
+    luna_state *state;
+    luna_script *script;
+
+    pthread_t thread;
+    int running;
+    int stop;
+
+    int wake;   /* eventfd the worker sleeps on */
+    int notify; /* eventfd in the main loop, for forwarded calls */
+
+    spsc *events; /* Main thread to worker, worker_msg */
+    spsc *calls;  /* Worker to main thread, worker_call */
+
+    /* Main thread only. Its state is in use by a forwarded call, and the
+     * script was unloaded during one, which has to wait until it returned */
+    int calling;
+    int unload;
+
+    /* Network of the message being handled, the default for its calls */
+    luna_network *current;
+
+    size_t dropped; /* Messages refused by a full queue since the last one
+                     * that made it in */
+
+    /* Main thread only. Timers and connection events that found the queue
+     * full, oldest first, they can't be dropped */
+    worker_msg *overflow;
+    worker_msg *overflow_tail;
+
+    int overflowed; /* Set while the worker should say when it made room */
+} luna_worker;
+
+
+int worker_init(luna_worker **, luna_state *, luna_script *);
+void worker_destroy(luna_worker *);
+
+int worker_start(luna_worker *);
+void worker_stop(luna_worker *);
+
+void worker_wrap(lua_State *, luna_worker *);
+
+void worker_post_signal(luna_worker *, luna_network *, luna_signal,
+                        const luaX_event *);
+void worker_post_timer(luna_worker *, luna_network *, int);
+
+#endif
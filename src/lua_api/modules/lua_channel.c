@@ -31,6 +31,28 @@ int luaX_channel_getchannels(lua_State *);
 int luaX_channel_getchannelinfo(lua_State *);
 int luaX_channel_getchannelusers(lua_State *);
 int luaX_channel_getchanneluserinfo(lua_State *);
+int luaX_channel_getchannel(lua_State *);
+int luaX_channel_getchanneluser(lua_State *);
+
+int luaX_chanobj_index(lua_State *);
+int luaX_chanobj_eq(lua_State *);
+int luaX_chanobj_tostring(lua_State *);
+int luaX_chanobj_getname(lua_State *);
+int luaX_chanobj_gettopic(lua_State *);
+int luaX_chanobj_getmodes(lua_State *);
+int luaX_chanobj_getcreated(lua_State *);
+int luaX_chanobj_getusers(lua_State *);
+int luaX_chanobj_getuser(lua_State *);
+int luaX_chanobj_getusermode(lua_State *);
+
+int luaX_memberobj_index(lua_State *);
+int luaX_memberobj_eq(lua_State *);
+int luaX_memberobj_tostring(lua_State *);
+int luaX_memberobj_getnick(lua_State *);
+int luaX_memberobj_getuser(lua_State *);
+int luaX_memberobj_gethost(lua_State *);
+int luaX_memberobj_getchannel(lua_State *);
+int luaX_memberobj_getchannelmodes(lua_State *);
 
 static const struct luaL_Reg luaX_channel_functions[] =
 {
@@ -38,10 +60,56 @@ static const struct luaL_Reg luaX_channel_functions[] =
     { "get_channel_info", luaX_channel_getchannelinfo },
     { "get_channel_users", luaX_channel_getchannelusers },
     { "get_channel_user_info", luaX_channel_getchanneluserinfo },
+    { "get_channel", luaX_channel_getchannel },
+    { "get_channel_user", luaX_channel_getchanneluser },
 
     { NULL, NULL }
 };
 
+/* Methods of luna.channel objects, corelib adds the Lua ones */
+static const struct luaL_Reg luaX_chanobj_methods[] =
+{
+    { "get_name", luaX_chanobj_getname },
+    { "get_addr", luaX_chanobj_getname },
+    { "get_topic", luaX_chanobj_gettopic },
+    { "get_modes", luaX_chanobj_getmodes },
+    { "get_created", luaX_chanobj_getcreated },
+    { "get_users", luaX_chanobj_getusers },
+    { "get_user", luaX_chanobj_getuser },
+    { "get_user_mode", luaX_chanobj_getusermode },
+
+    { NULL, NULL }
+};
+
+/* And of luna.channel_user objects */
+static const struct luaL_Reg luaX_memberobj_methods[] =
+{
+    { "get_nick", luaX_memberobj_getnick },
+    { "get_addr", luaX_memberobj_getnick },
+    { "get_user", luaX_memberobj_getuser },
+    { "get_host", luaX_memberobj_gethost },
+    { "get_channel", luaX_memberobj_getchannel },
+    { "get_channel_modes", luaX_memberobj_getchannelmodes },
+
+    { NULL, NULL }
+};
+
+/*
+ * Channel and channel user objects only hold names. Every access looks the
+ * channel or member up again, which is a hash lookup, so they never point
+ * at state that is gone and always see the current one.
+ */
+typedef struct luaX_chanobj
+{
+    luna_network *net;
+
+    /* Members only: the prefix as last seen, after the channel name */
+    const char *prefix;
+    size_t nicklen;
+
+    char name[1];
+} luaX_chanobj;
+
 
 int luaX_push_modes(lua_State *L, irc_channel *channel)
 {
@@ -53,7 +121,7 @@ int luaX_push_modes(lua_State *L, irc_channel *channel)
     {
         if (channel->flags[i].set)
         {
-            list_node *cur = NULL;
+            size_t k;
             int list;
 
             flag *f = &(channel->flags[i]);
@@ -73,10 +141,10 @@ int luaX_push_modes(lua_State *L, irc_channel *channel)
             case FLAG_LIST:
                 list = (lua_newtable(L), lua_gettop(L));
 
-                for (cur = f->list->root; cur != NULL; cur = cur->next)
+                for (k = 0; k < f->list->length; ++k)
                 {
-                    lua_pushstring(L, cur->data);
-                    lua_rawseti(L, list, i++);
+                    lua_pushstring(L, f->list->items[k]);
+                    lua_rawseti(L, list, k + 1);
                 }
 
                 break;
@@ -120,12 +188,12 @@ int luaX_push_channelinfo(lua_State *L, irc_channel *channel)
     return 1;
 }
 
-int luaX_push_channeluserinfo(lua_State *L, irc_user *user)
+int luaX_push_channeluserinfo(lua_State *L, irc_member *member)
 {
     int table = (lua_newtable(L), lua_gettop(L));
 
     lua_pushstring(L, "modes");
-    lua_pushstring(L, user->modes);
+    lua_pushstring(L, member->modes);
     lua_settable(L, table);
 
     return 1;
@@ -135,14 +203,14 @@ int luaX_channel_getchannels(lua_State *L)
 {
     int arr;
     int i = 1;
-    list_node *cur;
+    ilist_node *cur;
 
-    luna_state *state = api_getstate(L);
+    luna_network *net = api_getnetwork(L, 1);
 
     arr = (lua_newtable(L), lua_gettop(L));
-    for (cur = state->channels->root; cur != NULL; cur = cur->next)
+    for (cur = net->channels.head; cur != NULL; cur = cur->next)
     {
-        lua_pushstring(L, ((irc_channel *)(cur->data))->name);
+        lua_pushstring(L, ilist_entry(cur, irc_channel, link)->name);
         lua_rawseti(L, arr, i++);
     }
 
@@ -154,9 +222,9 @@ int luaX_channel_getchannelinfo(lua_State *L)
     const char *name = luaL_checkstring(L, 1);
     irc_channel *result;
 
-    luna_state *state = api_getstate(L);
+    luna_network *net = api_getnetwork(L, 2);
 
-    if ((result = list_find(state->channels, name, &channel_cmp)) != NULL)
+    if ((result = channel_get(net, name)) != NULL)
         luaX_push_channelinfo(L, result);
     else
         return luaL_error(L, "no such channel '%s'", name);
@@ -169,19 +237,19 @@ int luaX_channel_getchannelusers(lua_State *L)
     const char *name = luaL_checkstring(L, 1);
     irc_channel *result = NULL;
 
-    luna_state *state = api_getstate(L);
+    luna_network *net = api_getnetwork(L, 2);
 
-    if ((result = list_find(state->channels, name, &channel_cmp)) != NULL)
+    if ((result = channel_get(net, name)) != NULL)
     {
-        list_node *cur;
+        ilist_node *cur;
         int i = 1;
         int list = (lua_newtable(L), lua_gettop(L));
 
-        for (cur = result->users->root; cur != NULL; cur = cur->next)
+        for (cur = result->members.head; cur != NULL; cur = cur->next)
         {
-            irc_user *user = cur->data;
+            irc_member *member = ilist_entry(cur, irc_member, in_channel);
 
-            lua_pushstring(L, user->prefix);
+            lua_pushstring(L, member->user->prefix);
             lua_rawseti(L, list, i++);
         }
 
@@ -198,16 +266,14 @@ int luaX_channel_getchanneluserinfo(lua_State *L)
     const char *name = luaL_checkstring(L, 1);
     const char *nick = luaL_checkstring(L, 2);
 
-    irc_user *result = NULL;
-
-    if (strchr(nick, '!') != NULL)
-        *(strchr(nick, '!')) = 0;
+    irc_channel *result = NULL;
 
-    luna_state *state = api_getstate(L);
+    /* Full prefixes are fine too, only the nick part is looked at */
+    luna_network *net = api_getnetwork(L, 3);
 
-    if ((result = list_find(state->channels, name, &channel_cmp)) != NULL)
+    if ((result = channel_get(net, name)) != NULL)
     {
-        irc_user *resuser = channel_get_user(state, name, nick);
+        irc_member *resuser = channel_get_member(net, name, nick);
 
         if (resuser)
             luaX_push_channeluserinfo(L, resuser);
@@ -222,6 +288,396 @@ int luaX_channel_getchanneluserinfo(lua_State *L)
     }
 }
 
+int luaX_push_chanobj(lua_State *L, luna_network *net, irc_channel *channel)
+{
+    size_t len = strlen(channel->name);
+    luaX_chanobj *obj = lua_newuserdata(L, sizeof(*obj) + len);
+
+    obj->net = net;
+    obj->prefix = NULL;
+    obj->nicklen = 0;
+    memcpy(obj->name, channel->name, len + 1);
+
+    luaL_getmetatable(L, LUAX_CHANOBJ_META);
+    lua_setmetatable(L, -2);
+
+    return 1;
+}
+
+int luaX_push_memberobj(lua_State *L, luna_network *net, irc_member *member)
+{
+    size_t len = strlen(member->channel->name);
+    size_t plen = strlen(member->user->prefix);
+    luaX_chanobj *obj = lua_newuserdata(L, sizeof(*obj) + len + plen + 1);
+
+    obj->net = net;
+    memcpy(obj->name, member->channel->name, len + 1);
+    memcpy(obj->name + len + 1, member->user->prefix, plen + 1);
+
+    obj->prefix = obj->name + len + 1;
+    obj->nicklen = member->user->nicklen;
+
+    luaL_getmetatable(L, LUAX_MEMBEROBJ_META);
+    lua_setmetatable(L, -2);
+
+    return 1;
+}
+
+irc_channel *luaX_check_chanobj(lua_State *L, int index)
+{
+    luaX_chanobj *obj = luaL_checkudata(L, index, LUAX_CHANOBJ_META);
+    irc_channel *channel = channel_get(obj->net, obj->name);
+
+    if (channel == NULL)
+        luaL_error(L, "no such channel '%s'", obj->name);
+
+    return channel;
+}
+
+irc_member *luaX_check_memberobj(lua_State *L, int index)
+{
+    luaX_chanobj *obj = luaL_checkudata(L, index, LUAX_MEMBEROBJ_META);
+    irc_member *member = channel_get_member(obj->net, obj->name, obj->prefix);
+
+    if (member == NULL)
+        luaL_error(L, "no such user '%s' in channel '%s'", obj->prefix,
+                   obj->name);
+
+    return member;
+}
+
+/* The user's prefix if still there, or the one it had when last seen */
+const char *luaX_memberobj_prefix(luaX_chanobj *obj)
+{
+    irc_member *member = channel_get_member(obj->net, obj->name, obj->prefix);
+
+    return member ? member->user->prefix : obj->prefix;
+}
+
+/* Pushes the Lua object corelib keeps for the network */
+int luaX_push_netobj(lua_State *L, luna_network *net)
+{
+    lua_getglobal(L, LIBNAME);
+    lua_getfield(L, -1, "__get_network");
+    lua_remove(L, -2);
+
+    lua_pushstring(L, net->name);
+    lua_call(L, 1, 1);
+
+    return 1;
+}
+
+int luaX_channel_getchannel(lua_State *L)
+{
+    const char *name = luaL_checkstring(L, 1);
+    luna_network *net = api_getnetwork(L, 2);
+    irc_channel *channel = channel_get(net, name);
+
+    if (channel == NULL)
+    {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    return luaX_push_chanobj(L, net, channel);
+}
+
+int luaX_channel_getchanneluser(lua_State *L)
+{
+    const char *nick = luaL_checkstring(L, 2);
+    luna_network *net;
+    irc_member *member;
+
+    /* Either a channel object or a name and an optional network */
+    if (lua_isuserdata(L, 1))
+    {
+        luaX_chanobj *obj = luaL_checkudata(L, 1, LUAX_CHANOBJ_META);
+
+        net = obj->net;
+        member = channel_get_member(net, obj->name, nick);
+    }
+    else
+    {
+        net = api_getnetwork(L, 3);
+        member = channel_get_member(net, luaL_checkstring(L, 1), nick);
+    }
+
+    if (member == NULL)
+    {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    return luaX_push_memberobj(L, net, member);
+}
+
+int luaX_chanobj_index(lua_State *L)
+{
+    luaX_chanobj *obj = luaL_checkudata(L, 1, LUAX_CHANOBJ_META);
+    const char *key = luaL_checkstring(L, 2);
+
+    if (!strcmp(key, "name"))
+    {
+        lua_pushstring(L, obj->name);
+        return 1;
+    }
+    else if (!strcmp(key, "network"))
+    {
+        return luaX_push_netobj(L, obj->net);
+    }
+
+    /* Methods, luna.channel and whatever it inherits */
+    lua_pushvalue(L, 2);
+    lua_gettable(L, lua_upvalueindex(1));
+
+    return 1;
+}
+
+int luaX_chanobj_eq(lua_State *L)
+{
+    luaX_chanobj *a = luaL_checkudata(L, 1, LUAX_CHANOBJ_META);
+    luaX_chanobj *b = luaL_checkudata(L, 2, LUAX_CHANOBJ_META);
+
+    lua_pushboolean(L, (a->net == b->net) &&
+                    !irc_casencmp(a->net->casemapping, a->name, b->name,
+                                  strlen(a->name) + 1));
+
+    return 1;
+}
+
+int luaX_chanobj_tostring(lua_State *L)
+{
+    luaX_chanobj *obj = luaL_checkudata(L, 1, LUAX_CHANOBJ_META);
+
+    lua_pushstring(L, obj->name);
+
+    return 1;
+}
+
+int luaX_chanobj_getname(lua_State *L)
+{
+    lua_pushstring(L, luaX_check_chanobj(L, 1)->name);
+
+    return 1;
+}
+
+int luaX_chanobj_gettopic(lua_State *L)
+{
+    irc_channel *channel = luaX_check_chanobj(L, 1);
+    int table = (lua_newtable(L), lua_gettop(L));
+
+    lua_pushstring(L, "topic");
+    lua_pushstring(L, channel->topic);
+    lua_settable(L, table);
+
+    lua_pushstring(L, "set_by");
+    lua_pushstring(L, channel->topic_setter);
+    lua_settable(L, table);
+
+    lua_pushstring(L, "set_at");
+    lua_pushnumber(L, channel->topic_set);
+    lua_settable(L, table);
+
+    return 1;
+}
+
+int luaX_chanobj_getmodes(lua_State *L)
+{
+    return luaX_push_modes(L, luaX_check_chanobj(L, 1));
+}
+
+int luaX_chanobj_getcreated(lua_State *L)
+{
+    lua_pushnumber(L, luaX_check_chanobj(L, 1)->created);
+
+    return 1;
+}
+
+int luaX_chanobj_getusers(lua_State *L)
+{
+    irc_channel *channel = luaX_check_chanobj(L, 1);
+    ilist_node *cur;
+    int i = 1;
+    int list = (lua_newtable(L), lua_gettop(L));
+
+    for (cur = channel->members.head; cur != NULL; cur = cur->next)
+    {
+        irc_member *member = ilist_entry(cur, irc_member, in_channel);
+
+        luaX_push_memberobj(L, channel->net, member);
+        lua_rawseti(L, list, i++);
+    }
+
+    return 1;
+}
+
+int luaX_chanobj_getuser(lua_State *L)
+{
+    irc_channel *channel = luaX_check_chanobj(L, 1);
+    const char *nick = luaL_checkstring(L, 2);
+    irc_member *member = channel_get_member(channel->net, channel->name, nick);
+
+    if (member == NULL)
+    {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    return luaX_push_memberobj(L, channel->net, member);
+}
+
+int luaX_chanobj_getusermode(lua_State *L)
+{
+    irc_channel *channel = luaX_check_chanobj(L, 1);
+    const char *nick = luaL_checkstring(L, 2);
+    irc_member *member = channel_get_member(channel->net, channel->name, nick);
+
+    if (member == NULL)
+        return luaL_error(L, "no such user '%s' in channel '%s'", nick,
+                          channel->name);
+
+    lua_pushstring(L, member->modes);
+
+    return 1;
+}
+
+int luaX_memberobj_index(lua_State *L)
+{
+    luaX_chanobj *obj = luaL_checkudata(L, 1, LUAX_MEMBEROBJ_META);
+    const char *key = luaL_checkstring(L, 2);
+
+    if (!strcmp(key, "addr"))
+    {
+        lua_pushstring(L, luaX_memberobj_prefix(obj));
+        return 1;
+    }
+    else if (!strcmp(key, "network"))
+    {
+        return luaX_push_netobj(L, obj->net);
+    }
+    else if (!strcmp(key, "channel"))
+    {
+        irc_channel *channel = channel_get(obj->net, obj->name);
+
+        if (channel == NULL)
+            lua_pushnil(L);
+        else
+            luaX_push_chanobj(L, obj->net, channel);
+
+        return 1;
+    }
+
+    /* Methods, luna.channel_user and whatever it inherits */
+    lua_pushvalue(L, 2);
+    lua_gettable(L, lua_upvalueindex(1));
+
+    return 1;
+}
+
+int luaX_memberobj_eq(lua_State *L)
+{
+    luaX_chanobj *a = luaL_checkudata(L, 1, LUAX_MEMBEROBJ_META);
+    luaX_chanobj *b = luaL_checkudata(L, 2, LUAX_MEMBEROBJ_META);
+
+    /* The same user, whichever channel it was found in */
+    lua_pushboolean(L, (a->net == b->net) && (a->nicklen == b->nicklen) &&
+                    !irc_casencmp(a->net->casemapping, a->prefix, b->prefix,
+                                  a->nicklen));
+
+    return 1;
+}
+
+int luaX_memberobj_tostring(lua_State *L)
+{
+    luaX_chanobj *obj = luaL_checkudata(L, 1, LUAX_MEMBEROBJ_META);
+
+    lua_pushstring(L, luaX_memberobj_prefix(obj));
+
+    return 1;
+}
+
+int luaX_memberobj_getnick(lua_State *L)
+{
+    luaX_chanobj *obj = luaL_checkudata(L, 1, LUAX_MEMBEROBJ_META);
+    const char *prefix = luaX_memberobj_prefix(obj);
+
+    lua_pushlstring(L, prefix, irc_nick_len(prefix));
+
+    return 1;
+}
+
+int luaX_memberobj_getuser(lua_State *L)
+{
+    luaX_chanobj *obj = luaL_checkudata(L, 1, LUAX_MEMBEROBJ_META);
+    const char *prefix = luaX_memberobj_prefix(obj);
+    const char *user = strchr(prefix, '!');
+    const char *host = strchr(prefix, '@');
+
+    if ((user == NULL) || (host == NULL) || (host < user))
+        lua_pushnil(L);
+    else
+        lua_pushlstring(L, user + 1, host - user - 1);
+
+    return 1;
+}
+
+int luaX_memberobj_gethost(lua_State *L)
+{
+    luaX_chanobj *obj = luaL_checkudata(L, 1, LUAX_MEMBEROBJ_META);
+    const char *host = strchr(luaX_memberobj_prefix(obj), '@');
+
+    if (host == NULL)
+        lua_pushnil(L);
+    else
+        lua_pushstring(L, host + 1);
+
+    return 1;
+}
+
+int luaX_memberobj_getchannel(lua_State *L)
+{
+    irc_member *member = luaX_check_memberobj(L, 1);
+
+    return luaX_push_chanobj(L, member->channel->net, member->channel);
+}
+
+int luaX_memberobj_getchannelmodes(lua_State *L)
+{
+    lua_pushstring(L, luaX_check_memberobj(L, 1)->modes);
+
+    return 1;
+}
+
+/* Metatable for one of the object types, its methods table is left on the
+ * stack */
+void luaX_register_objtype(lua_State *L, const char *meta,
+                           const luaL_Reg *methods, lua_CFunction index,
+                           lua_CFunction eq, lua_CFunction tostring)
+{
+#if LUA_VERSION_NUM == 502
+    luaL_newlib(L, methods);
+#else
+    lua_newtable(L);
+    luaL_register(L, NULL, methods);
+#endif
+
+    luaL_newmetatable(L, meta);
+
+    lua_pushvalue(L, -2);
+    lua_pushcclosure(L, index, 1);
+    lua_setfield(L, -2, "__index");
+
+    lua_pushcfunction(L, eq);
+    lua_setfield(L, -2, "__eq");
+
+    lua_pushcfunction(L, tostring);
+    lua_setfield(L, -2, "__tostring");
+
+    lua_pop(L, 1);
+
+    return;
+}
+
 int luaX_register_channel(lua_State *L, int regtable)
 {
     /* Register functions inside regtable
@@ -237,5 +693,16 @@ int luaX_register_channel(lua_State *L, int regtable)
 
     lua_settable(L, regtable);
 
+    /* luna.channel and luna.channel_user, the methods of the objects */
+    luaX_register_objtype(L, LUAX_CHANOBJ_META, luaX_chanobj_methods,
+                          &luaX_chanobj_index, &luaX_chanobj_eq,
+                          &luaX_chanobj_tostring);
+    lua_setfield(L, regtable, "channel");
+
+    luaX_register_objtype(L, LUAX_MEMBEROBJ_META, luaX_memberobj_methods,
+                          &luaX_memberobj_index, &luaX_memberobj_eq,
+                          &luaX_memberobj_tostring);
+    lua_setfield(L, regtable, "channel_user");
+
     return 1;
 }
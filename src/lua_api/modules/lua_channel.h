@@ -21,6 +21,9 @@
 
 #include <lua.h>
 
+#define LUAX_CHANOBJ_META "luna.channel"
+#define LUAX_MEMBEROBJ_META "luna.channel_user"
+
 int luaX_register_channel(lua_State *, int);
 
 #endif
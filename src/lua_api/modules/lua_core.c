@@ -28,11 +28,15 @@
 
 int luaX_core_log(lua_State *);
 int luaX_core_sendline(lua_State *);
+int luaX_core_watchnumeric(lua_State *);
+int luaX_core_watchsignal(lua_State *);
 
 const luaL_Reg luaX_core_functions[] =
 {
     { "log",             luaX_core_log },
     { "sendline",        luaX_core_sendline },
+    { "watch_numeric",   luaX_core_watchnumeric },
+    { "watch_signal",    luaX_core_watchsignal },
 
     { NULL, NULL }
 };
@@ -52,9 +56,38 @@ int luaX_core_log(lua_State *L)
 int luaX_core_sendline(lua_State *L)
 {
     const char *line = luaL_checkstring(L, 1);
-    luna_state *state = api_getstate(L);
+    luna_network *net = api_getnetwork(L, 2);
+    int prio = api_priority_from_string(luaL_optstring(L, 3, NULL));
+
+    /* Only queues the line, flood control decides when it goes out */
+    lua_pushnumber(L, net_sendfln(net, prio, "%s", line));
+
+    return 1;
+}
+
+int luaX_core_watchnumeric(lua_State *L)
+{
+    int numeric = luaL_checkint(L, 1);
+    int enable = lua_isnone(L, 2) || lua_toboolean(L, 2);
+
+    luaL_argcheck(L, (numeric >= 0) && (numeric < IRC_NUMERIC_MAX), 1,
+                  "numeric out of range");
+
+    script_watch_numeric(api_getscript(L), numeric, enable);
+
+    return 0;
+}
+
+int luaX_core_watchsignal(lua_State *L)
+{
+    int sig = signal_from_string(luaL_checkstring(L, 1));
+    int enable = lua_isnone(L, 2) || lua_toboolean(L, 2);
+
+    /* Signals only raised from Lua have nothing to route on the C side */
+    if (sig >= 0)
+        script_watch_signal(api_getscript(L), sig, enable);
 
-    lua_pushnumber(L, net_sendfln(state, "%s", line));
+    lua_pushboolean(L, sig >= 0);
 
     return 1;
 }
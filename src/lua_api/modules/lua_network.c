@@ -0,0 +1,183 @@
+/*
+ * This file is part of Luna
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <string.h>
+
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+
+#include "lua_network.h"
+
+#include "../lua_util.h"
+#include "../../net.h"
+#include "../../netio.h"
+
+
+int luaX_network_getnetworks(lua_State *);
+int luaX_network_getnetworkinfo(lua_State *);
+int luaX_network_getcurrent(lua_State *);
+
+static const struct luaL_Reg luaX_network_functions[] =
+{
+    { "get_networks", luaX_network_getnetworks },
+    { "get_network_info", luaX_network_getnetworkinfo },
+    { "get_current", luaX_network_getcurrent },
+
+    { NULL, NULL }
+};
+
+
+int luaX_push_networkinfo(lua_State *L, luna_network *net)
+{
+    int table = (lua_newtable(L), lua_gettop(L));
+
+    lua_pushstring(L, "name");
+    lua_pushstring(L, net->name);
+    lua_settable(L, table);
+
+    lua_pushstring(L, "server");
+    lua_pushstring(L, net->serverinfo.host);
+    lua_settable(L, table);
+
+    lua_pushstring(L, "port");
+    lua_pushnumber(L, net->serverinfo.port);
+    lua_settable(L, table);
+
+    lua_pushstring(L, "nick");
+    lua_pushstring(L, net->userinfo.nick);
+    lua_settable(L, table);
+
+    lua_pushstring(L, "online");
+    lua_pushboolean(L, net->fd >= 0);
+    lua_settable(L, table);
+
+    lua_pushstring(L, "connected");
+    lua_pushnumber(L, net->connected);
+    lua_settable(L, table);
+
+    /* Outbound queue metrics */
+    lua_pushstring(L, "sendq_depth");
+    lua_pushnumber(L, net->sendq ? net->sendq->depth : 0);
+    lua_settable(L, table);
+
+    lua_pushstring(L, "sendq_bytes");
+    lua_pushnumber(L, net->sendq ? net->sendq->pending : 0);
+    lua_settable(L, table);
+
+    lua_pushstring(L, "bytes_sent");
+    lua_pushnumber(L, net->sendq ? net->sendq->sent : 0);
+    lua_settable(L, table);
+
+    /* Flood control metrics */
+    lua_pushstring(L, "flood_tokens");
+    lua_pushnumber(L, net->sendq ? net_tokens(net) : FLOOD_BURST);
+    lua_settable(L, table);
+
+    lua_pushstring(L, "flood_interactive");
+    lua_pushnumber(L, net->sendq ?
+                   net->sendq->classes[NET_PRIO_INTERACTIVE].depth : 0);
+    lua_settable(L, table);
+
+    lua_pushstring(L, "flood_bulk");
+    lua_pushnumber(L, net->sendq ?
+                   net->sendq->classes[NET_PRIO_BULK].depth : 0);
+    lua_settable(L, table);
+
+    lua_pushstring(L, "flood_delayed");
+    lua_pushnumber(L, net->sendq ? net->sendq->delayed : 0);
+    lua_settable(L, table);
+
+    /* Inbound queue metrics, see netio.h */
+    lua_pushstring(L, "recvq_depth");
+    lua_pushnumber(L, net->io ? netio_metric(&(net->io->depth)) : 0);
+    lua_settable(L, table);
+
+    lua_pushstring(L, "recvq_peak");
+    lua_pushnumber(L, net->io ? netio_metric(&(net->io->peak)) : 0);
+    lua_settable(L, table);
+
+    lua_pushstring(L, "recvq_stalls");
+    lua_pushnumber(L, net->io ? netio_metric(&(net->io->stalls)) : 0);
+    lua_settable(L, table);
+
+    lua_pushstring(L, "lines_received");
+    lua_pushnumber(L, net->io ? netio_metric(&(net->io->lines_in)) : 0);
+    lua_settable(L, table);
+
+    lua_pushstring(L, "pings_answered");
+    lua_pushnumber(L, net->io ? netio_metric(&(net->io->pongs)) : 0);
+    lua_settable(L, table);
+
+    return 1;
+}
+
+int luaX_network_getnetworks(lua_State *L)
+{
+    int arr;
+    int i = 1;
+    list_node *cur;
+
+    luna_state *state = api_getstate(L);
+
+    arr = (lua_newtable(L), lua_gettop(L));
+    for (cur = state->networks->root; cur != NULL; cur = cur->next)
+    {
+        lua_pushstring(L, ((luna_network *)(cur->data))->name);
+        lua_rawseti(L, arr, i++);
+    }
+
+    return 1;
+}
+
+int luaX_network_getnetworkinfo(lua_State *L)
+{
+    luna_network *net = api_getnetwork(L, 1);
+
+    return luaX_push_networkinfo(L, net);
+}
+
+int luaX_network_getcurrent(lua_State *L)
+{
+    luna_state *state = api_getstate(L);
+
+    if (state->current != NULL)
+        lua_pushstring(L, state->current->name);
+    else
+        lua_pushnil(L);
+
+    return 1;
+}
+
+int luaX_register_network(lua_State *L, int regtable)
+{
+    /* Register functions inside regtable
+     * luna.networks = { ... } */
+    lua_pushstring(L, "networks");
+
+#if LUA_VERSION_NUM == 502
+    luaL_newlib(L, luaX_network_functions);
+#else
+    lua_newtable(L);
+    luaL_register(L, NULL, luaX_network_functions);
+#endif
+
+    lua_settable(L, regtable);
+
+    return 1;
+}
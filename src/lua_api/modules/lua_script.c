@@ -28,6 +28,7 @@ int luaX_script_getscriptinfo(lua_State *);
 int luaX_script_load(lua_State *);
 int luaX_script_unload(lua_State *);
 int luaX_script_getself(lua_State *);
+int luaX_script_setmemorylimit(lua_State *);
 
 static const struct luaL_Reg luaX_script_functions[] =
 {
@@ -36,6 +37,7 @@ static const struct luaL_Reg luaX_script_functions[] =
     { "load_script", luaX_script_load },
     { "unload_script", luaX_script_unload },
     { "get_self", luaX_script_getself },
+    { "set_memory_limit", luaX_script_setmemorylimit },
 
     { NULL, NULL }
 };
@@ -65,22 +67,31 @@ int luaX_push_scriptinfo(lua_State *L, luna_script *script)
     lua_pushstring(L, script->version);
     lua_settable(L, table);
 
+    lua_pushstring(L, "memory");
+    luaX_push_script_meminfo(L, script);
+    lua_settable(L, table);
+
+    lua_pushstring(L, "worker");
+    lua_pushboolean(L, script->worker != NULL);
+    lua_settable(L, table);
+
     return 1;
 }
 
 int luaX_script_getloadedscripts(lua_State *L)
 {
     int arr;
-    int i = 1;
-    list_node *cur;
+    size_t i;
 
     luna_state *state = api_getstate(L);
 
     arr = (lua_newtable(L), lua_gettop(L));
-    for (cur = state->scripts->root; cur != NULL; cur = cur->next)
+    for (i = 0; i < state->scripts->length; ++i)
     {
-        lua_pushstring(L, ((luna_script *)(cur->data))->filename);
-        lua_rawseti(L, arr, i++);
+        luna_script *script = (luna_script *)(state->scripts->items[i]);
+
+        lua_pushstring(L, script->filename);
+        lua_rawseti(L, arr, i + 1);
     }
 
     return 1;
@@ -93,7 +104,7 @@ int luaX_script_getscriptinfo(lua_State *L)
 
     luna_state *state = api_getstate(L);
 
-    result = list_find(state->scripts, file, &script_cmp);
+    result = vector_find(state->scripts, file, &script_cmp);
 
     if (result)
     {
@@ -112,11 +123,12 @@ int luaX_script_getscriptinfo(lua_State *L)
 int luaX_script_load(lua_State *L)
 {
     const char *file = luaL_checkstring(L, 1);
+    int worker = lua_toboolean(L, 2);
     luna_script *result;
 
     luna_state *state = api_getstate(L);
 
-    result = list_find(state->scripts, file, &script_cmp);
+    result = vector_find(state->scripts, file, &script_cmp);
 
     if (result)
     {
@@ -124,9 +136,9 @@ int luaX_script_load(lua_State *L)
     }
     else
     {
-        if (!script_load(state, file))
+        if (!script_load(state, file, worker))
         {
-            result = list_find(state->scripts, file, &script_cmp);
+            result = vector_find(state->scripts, file, &script_cmp);
 
             return luaX_push_scriptinfo(L, result);
         }
@@ -144,7 +156,7 @@ int luaX_script_unload(lua_State *L)
 
     luna_state *state = api_getstate(L);
 
-    result = list_find(state->scripts, file, &script_cmp);
+    result = vector_find(state->scripts, file, &script_cmp);
 
     if (!result)
     {
@@ -167,22 +179,37 @@ int luaX_script_unload(lua_State *L)
 
 int luaX_script_getself(lua_State *L)
 {
-    list_node *cur;
-    luna_state *state = api_getstate(L);
+    luna_script *script = api_getscript(L);
 
-    for (cur = state->scripts->root; cur != NULL; cur = cur->next)
+    if (script != NULL)
     {
-        if (((luna_script *)(cur->data))->state == L)
-        {
-            lua_pushstring(L, ((luna_script *)(cur->data))->filename);
-            return 1;
-        }
+        lua_pushstring(L, script->filename);
+        return 1;
     }
 
     /* Not gonna happen */
     return 0;
 }
 
+int luaX_script_setmemorylimit(lua_State *L)
+{
+    const char *file = luaL_checkstring(L, 1);
+    lua_Number limit = luaL_optnumber(L, 2, 0);
+    luna_script *result;
+
+    luna_state *state = api_getstate(L);
+
+    luaL_argcheck(L, limit >= 0, 2, "limit must not be negative");
+
+    if (!(result = vector_find(state->scripts, file, &script_cmp)))
+        return luaL_error(L, "script '%s' not loaded", file);
+
+    /* Takes effect on the next allocation, what's held already stays */
+    __atomic_store_n(&(result->mem_limit), (size_t)limit, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
 int luaX_register_script(lua_State *L, int regtable)
 {
     /* Register functions inside regtable
@@ -27,12 +27,15 @@
 #include "../../state.h"
 #include "../../mm.h"
 #include "../lua_util.h"
+#include "../lua_profile.h"
 
 
 int luaX_self_getuserinfo(lua_State *);
 int luaX_self_getserver(lua_State *);
 int luaX_self_getmeminfo(lua_State *);
 int luaX_self_getruntimes(lua_State *);
+int luaX_self_getprofile(lua_State *);
+int luaX_self_setprofiling(lua_State *);
 
 static const struct luaL_Reg luaX_self_functions[] =
 {
@@ -40,6 +43,8 @@ static const struct luaL_Reg luaX_self_functions[] =
     { "get_server_info", luaX_self_getserver },
     { "get_memory_info", luaX_self_getmeminfo },
     { "get_runtime_info", luaX_self_getruntimes },
+    { "get_profile", luaX_self_getprofile },
+    { "set_profiling", luaX_self_setprofiling },
 
     { NULL, NULL }
 };
@@ -49,20 +54,20 @@ int luaX_self_getuserinfo(lua_State *L)
 {
     int table;
 
-    luna_state *state = api_getstate(L);
+    luna_network *net = api_getnetwork(L, 1);
 
     table = (lua_newtable(L), lua_gettop(L));
 
     lua_pushstring(L, "nick");
-    lua_pushstring(L, state->userinfo.nick);
+    lua_pushstring(L, net->userinfo.nick);
     lua_settable(L, table);
 
     lua_pushstring(L, "user");
-    lua_pushstring(L, state->userinfo.user);
+    lua_pushstring(L, net->userinfo.user);
     lua_settable(L, table);
 
     lua_pushstring(L, "realname");
-    lua_pushstring(L, state->userinfo.real);
+    lua_pushstring(L, net->userinfo.real);
     lua_settable(L, table);
 
     return 1;
@@ -70,10 +75,10 @@ int luaX_self_getuserinfo(lua_State *L)
 
 int luaX_self_getserver(lua_State *L)
 {
-    luna_state *state = api_getstate(L);
+    luna_network *net = api_getnetwork(L, 1);
 
-    lua_pushstring(L, state->serverinfo.host);
-    lua_pushnumber(L, state->serverinfo.port);
+    lua_pushstring(L, net->serverinfo.host);
+    lua_pushnumber(L, net->serverinfo.port);
 
     return 2;
 }
@@ -81,6 +86,7 @@ int luaX_self_getserver(lua_State *L)
 int luaX_self_getmeminfo(lua_State *L)
 {
     int table = (lua_newtable(L), lua_gettop(L));
+    int i;
 
     lua_pushstring(L, "used");
     lua_pushnumber(L, mm_inuse());
@@ -94,6 +100,49 @@ int luaX_self_getmeminfo(lua_State *L)
     lua_pushnumber(L, mm_state.mm_frees);
     lua_settable(L, table);
 
+    lua_pushstring(L, "requested");
+    lua_pushnumber(L, mm_state.mm_bytes);
+    lua_settable(L, table);
+
+    /* One entry per slab size class */
+    lua_pushstring(L, "classes");
+    lua_newtable(L);
+
+    for (i = 0; i < MM_NCLASSES; ++i)
+    {
+        struct mm_class *cls = &(mm_state.mm_classes[i]);
+        int entry = (lua_newtable(L), lua_gettop(L));
+
+        lua_pushstring(L, "size");
+        lua_pushnumber(L, cls->mm_size);
+        lua_settable(L, entry);
+
+        lua_pushstring(L, "slabs");
+        lua_pushnumber(L, cls->mm_slabs);
+        lua_settable(L, entry);
+
+        lua_pushstring(L, "inuse");
+        lua_pushnumber(L, cls->mm_inuse);
+        lua_settable(L, entry);
+
+        lua_pushstring(L, "allocs");
+        lua_pushnumber(L, cls->mm_allocs);
+        lua_settable(L, entry);
+
+        lua_pushstring(L, "frees");
+        lua_pushnumber(L, cls->mm_frees);
+        lua_settable(L, entry);
+
+        lua_rawseti(L, -2, i + 1);
+    }
+
+    lua_settable(L, table);
+
+    /* And what the calling script's own Lua state holds */
+    lua_pushstring(L, "script");
+    luaX_push_script_meminfo(L, api_getscript(L));
+    lua_settable(L, table);
+
     return 1;
 }
 
@@ -102,6 +151,7 @@ int luaX_self_getruntimes(lua_State *L)
     int table;
 
     luna_state *state = api_getstate(L);
+    luna_network *net = api_getnetwork(L, 1);
 
     table = (lua_newtable(L), lua_gettop(L));
 
@@ -110,12 +160,55 @@ int luaX_self_getruntimes(lua_State *L)
     lua_settable(L, table);
 
     lua_pushstring(L, "connected");
-    lua_pushnumber(L, state->connected);
+    lua_pushnumber(L, net->connected);
     lua_settable(L, table);
 
     return 1;
 }
 
+int luaX_self_getprofile(lua_State *L)
+{
+    luna_state *state = api_getstate(L);
+    luna_script *script;
+    int table;
+    size_t i;
+
+    /* One script's handlers, or all of them by script */
+    if (!lua_isnoneornil(L, 1))
+    {
+        const char *file = luaL_checkstring(L, 1);
+
+        if (!(script = vector_find(state->scripts, file, &script_cmp)))
+            return luaL_error(L, "script '%s' not loaded", file);
+
+        return luaX_push_profile(L, script);
+    }
+
+    table = (lua_newtable(L), lua_gettop(L));
+
+    for (i = 0; i < state->scripts->length; ++i)
+    {
+        script = (luna_script *)(state->scripts->items[i]);
+
+        lua_pushstring(L, script->filename);
+        luaX_push_profile(L, script);
+        lua_settable(L, table);
+    }
+
+    return 1;
+}
+
+int luaX_self_setprofiling(lua_State *L)
+{
+    luna_state *state = api_getstate(L);
+
+    /* Scripts pick it up with their next signal or timer */
+    __atomic_store_n(&(state->profiling), lua_toboolean(L, 1),
+                     __ATOMIC_RELAXED);
+
+    return 0;
+}
+
 int luaX_register_self(lua_State *L, int regtable)
 {
     /* Register functions inside regtable
@@ -0,0 +1,260 @@
+/*
+ * This file is part of Luna
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+
+#include "lua_timers.h"
+
+#include "../lua_util.h"
+#include "../lua_worker.h"
+#include "../lua_profile.h"
+#include "../../mm.h"
+
+
+int luaX_timers_after(lua_State *);
+int luaX_timers_every(lua_State *);
+int luaX_timers_cancel(lua_State *);
+
+int luaX_timers_start(lua_State *, uint64_t, uint64_t);
+void luaX_timers_fire(event_loop *, event_timer *, void *);
+void luaX_timers_release(luna_state *, luna_timer *);
+
+const char *timer_key = "LUNA_TIMERS";
+
+static const struct luaL_Reg luaX_timers_functions[] =
+{
+    { "after", luaX_timers_after },
+    { "every", luaX_timers_every },
+    { "cancel", luaX_timers_cancel },
+
+    { NULL, NULL }
+};
+
+
+int luaX_timers_after(lua_State *L)
+{
+    lua_Number delay = luaL_checknumber(L, 1);
+
+    luaL_argcheck(L, delay >= 0, 1, "delay must not be negative");
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+
+    return luaX_timers_start(L, (uint64_t)(delay * 1000), 0);
+}
+
+int luaX_timers_every(lua_State *L)
+{
+    lua_Number interval = luaL_checknumber(L, 1);
+
+    /* Below a millisecond it would never leave the wheel's current slot */
+    luaL_argcheck(L, interval >= 0.001, 1, "interval too short");
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+
+    return luaX_timers_start(L, (uint64_t)(interval * 1000),
+                             (uint64_t)(interval * 1000));
+}
+
+int luaX_timers_cancel(lua_State *L)
+{
+    int id = luaL_checkint(L, 1);
+    luna_timer *timer;
+
+    lua_pushlightuserdata(L, (void *)timer_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_rawgeti(L, -1, id);
+
+    if ((timer = lua_touserdata(L, -1)) == NULL)
+    {
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+
+    luaX_timers_release(api_getstate(L), timer);
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+int luaX_timers_start(lua_State *L, uint64_t after, uint64_t interval)
+{
+    luna_state *state = api_getstate(L);
+    luna_script *script = api_getscript(L);
+    luna_timer *timer;
+
+    if ((timer = mm_malloc(sizeof(*timer))) == NULL)
+        return luaL_error(L, "out of memory");
+
+    timer->script = script;
+    timer->net = state->current;
+    timer->id = ++(script->timer_ids);
+
+    timer->timer = event_timer_add(state->loop, after, interval,
+                                   &luaX_timers_fire, timer);
+
+    if (timer->timer == NULL)
+    {
+        mm_free(timer);
+        return luaL_error(L, "unable to start timer");
+    }
+
+    lua_pushvalue(L, 2);
+    timer->callback = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    ilist_push_back(&(script->timers), &(timer->link));
+
+    /* Cancelling goes by id, so look them up through a table */
+    lua_pushlightuserdata(L, (void *)timer_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_pushlightuserdata(L, timer);
+    lua_rawseti(L, -2, timer->id);
+    lua_pop(L, 1);
+
+    lua_pushnumber(L, timer->id);
+    return 1;
+}
+
+void luaX_timers_fire(event_loop *loop, event_timer *event, void *data)
+{
+    luna_timer *timer = (luna_timer *)data;
+    luna_script *script = timer->script;
+    lua_State *L = script->state;
+    luna_state *state = api_getstate(L);
+    luna_network *outer = state->current;
+    luna_network *net = timer->net;
+    uint64_t start = 0;
+    int top;
+
+    /* Workers run it on their own thread, where it's looked up again */
+    if (script->worker != NULL)
+    {
+        /* One-shot, the loop disposes of it */
+        if (event->interval == 0)
+            timer->timer = NULL;
+
+        worker_post_timer(script->worker, net, timer->id);
+
+        return;
+    }
+
+    top = lua_gettop(L);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, timer->callback);
+
+    /* A one-shot timer is done with, the function is on the stack now */
+    if (event->interval == 0)
+        luaX_timers_release(state, timer);
+
+    /* Same default network as where it was started */
+    state->current = net;
+
+    if (profile_sync(state, script))
+        start = profile_now();
+
+    /* The callback may cancel its own timer, so it's not touched after */
+    if (lua_pcall(L, 0, 0, 0) != 0)
+    {
+        logger_log(state->logger, LOGLEV_ERROR, "Lua error ('timer@%s'): %s",
+                   script->filename, lua_tostring(L, -1));
+    }
+
+    if (start != 0)
+        profile_end(script, "timer", "*", start);
+
+    state->current = outer;
+    lua_settop(L, top);
+
+    return;
+}
+
+int luaX_timers_expire(lua_State *L)
+{
+    int id = luaL_checkint(L, 1);
+    luna_timer *timer;
+
+    lua_pushlightuserdata(L, (void *)timer_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_rawgeti(L, -1, id);
+
+    /* Cancelled since it fired */
+    if ((timer = lua_touserdata(L, -1)) == NULL)
+        return 0;
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, timer->callback);
+
+    /* Fired for the last time */
+    if (timer->timer == NULL)
+        luaX_timers_release(api_getstate(L), timer);
+
+    return 1;
+}
+
+void luaX_timers_release(luna_state *state, luna_timer *timer)
+{
+    luna_script *script = timer->script;
+    lua_State *L = script->state;
+
+    event_timer_cancel(state->loop, timer->timer);
+
+    luaL_unref(L, LUA_REGISTRYINDEX, timer->callback);
+
+    lua_pushlightuserdata(L, (void *)timer_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_pushnil(L);
+    lua_rawseti(L, -2, timer->id);
+    lua_pop(L, 1);
+
+    ilist_remove(&(script->timers), &(timer->link));
+    mm_free(timer);
+
+    return;
+}
+
+void luaX_timers_clear(luna_state *state, luna_script *script)
+{
+    while (script->timers.head != NULL)
+        luaX_timers_release(state, ilist_entry(script->timers.head,
+                                               luna_timer, link));
+
+    return;
+}
+
+int luaX_register_timers(lua_State *L, int regtable)
+{
+    /* Timers by id */
+    lua_pushlightuserdata(L, (void *)timer_key);
+    lua_newtable(L);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
+    /* Register functions inside regtable
+     * luna.timers = { ... } */
+    lua_pushstring(L, "timers");
+
+#if LUA_VERSION_NUM == 502
+    luaL_newlib(L, luaX_timers_functions);
+#else
+    lua_newtable(L);
+    luaL_register(L, NULL, luaX_timers_functions);
+#endif
+
+    lua_settable(L, regtable);
+
+    return 1;
+}
@@ -0,0 +1,52 @@
+/*
+ * This file is part of Luna
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef LUA_TIMERS_H
+#define LUA_TIMERS_H
+
+#include <lua.h>
+
+#include "../lua_manager.h"
+#include "../../event.h"
+#include "../../ilist.h"
+
+/* A luna.timers timer, owned by the script that started it */
+typedef struct luna_timer
+{
+    luna_script *script;
+    event_timer *timer;
+
+    /* Network whose event started it, its callback runs on behalf of it */
+    luna_network *net;
+
+    int id;
+    int callback; /* Registry reference to the function */
+
+    ilist_node link; /* In the script's timer list */
+} luna_timer;
+
+extern const char *timer_key;
+
+int luaX_register_timers(lua_State *, int);
+void luaX_timers_clear(luna_state *, luna_script *);
+
+/* Callback of a timer that fired for a worker script, and nothing if it's
+ * gone since. Releases one-shot timers */
+int luaX_timers_expire(lua_State *);
+
+#endif
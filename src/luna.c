@@ -52,6 +52,7 @@ int main(int argc, char **argv)
 {
     char config_file[FILENAMELEN] = "config.lua"; /* Default config file */
     char log_file[FILENAMELEN]    = "luna.log";   /* Default log file */
+    list_node *cur;
     int opt;
 
     mm_init(128);
@@ -114,12 +115,18 @@ int main(int argc, char **argv)
 
     log_session_start(log);
 
-    logger_log(log, LOGLEV_INFO, "Configuration: %s!%s (%s) -> %s:%d",
-               state.userinfo.nick,
-               state.userinfo.user,
-               state.userinfo.real,
-               state.serverinfo.host,
-               state.serverinfo.port);
+    for (cur = state.networks->root; cur != NULL; cur = cur->next)
+    {
+        luna_network *net = (luna_network *)(cur->data);
+
+        logger_log(log, LOGLEV_INFO, "Configuration [%s]: %s!%s (%s) -> %s:%d",
+                   net->name,
+                   net->userinfo.nick,
+                   net->userinfo.user,
+                   net->userinfo.real,
+                   net->serverinfo.host,
+                   net->serverinfo.port);
+    }
 
     logger_log(log, LOGLEV_INFO, "Entering main loop");
     luna_mainloop(&state);
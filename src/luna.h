@@ -40,7 +40,11 @@
 /* Reconnection attempts. TODO: read it from config.lua */
 #define RECONN_MAX 5
 
-/* Seconds of inactivity after which the connection is assumed dead */
+/* Seconds to wait before retrying a failed connection attempt */
+#define RECONN_DELAY 5
+
+/* Seconds of inactivity after which the server is pinged, twice that and the
+ * connection is assumed dead */
 #define TIMEOUT 300
 
 #endif
@@ -26,23 +26,244 @@
 
 struct mm_state mm_state;
 
+static const size_t mm_class_sizes[MM_NCLASSES] =
+{
+    16, 32, 48, 64, 96, 128, 192, 256
+};
+
+/* Maps a request, in steps of MM_ALIGN bytes, to the smallest class fitting
+ * it */
+static unsigned char mm_class_index[MM_SLABMAX / MM_ALIGN + 1];
+
+
+static struct mm_tag *mm_tag_of(void *ptr)
+{
+    return (struct mm_tag *)((char *)ptr - sizeof(struct mm_tag));
+}
+
+static struct mm_header *mm_header_of(void *ptr)
+{
+    return (struct mm_header *)((char *)ptr - MM_HDRSIZE);
+}
+
+static void *mm_payload_of(struct mm_header *hdr)
+{
+    return (char *)hdr + MM_HDRSIZE;
+}
+
+static void mm_link(struct mm_header *hdr)
+{
+    hdr->mm_prev = NULL;
+    hdr->mm_next = mm_state.mm_blocks;
+
+    if (mm_state.mm_blocks != NULL)
+        mm_state.mm_blocks->mm_prev = hdr;
+
+    mm_state.mm_blocks = hdr;
+
+    return;
+}
+
+static void mm_unlink(struct mm_header *hdr)
+{
+    if (hdr->mm_prev != NULL)
+        hdr->mm_prev->mm_next = hdr->mm_next;
+    else
+        mm_state.mm_blocks = hdr->mm_next;
+
+    if (hdr->mm_next != NULL)
+        hdr->mm_next->mm_prev = hdr->mm_prev;
+
+    return;
+}
+
+static void mm_slab_link(struct mm_slab **head, struct mm_slab *slab)
+{
+    slab->mm_prev = NULL;
+    slab->mm_next = *head;
+
+    if (*head != NULL)
+        (*head)->mm_prev = slab;
+
+    *head = slab;
+
+    return;
+}
+
+static void mm_slab_unlink(struct mm_slab **head, struct mm_slab *slab)
+{
+    if (slab->mm_prev != NULL)
+        slab->mm_prev->mm_next = slab->mm_next;
+    else
+        *head = slab->mm_next;
+
+    if (slab->mm_next != NULL)
+        slab->mm_next->mm_prev = slab->mm_prev;
+
+    return;
+}
+
+static void mm_slab_destroy_list(struct mm_slab *slab)
+{
+    while (slab != NULL)
+    {
+        struct mm_slab *next = slab->mm_next;
+
+        free(slab);
+        slab = next;
+    }
+
+    return;
+}
+
+static struct mm_class *mm_class_of(size_t n)
+{
+    return &(mm_state.mm_classes[mm_class_index[(n + MM_ALIGN - 1) /
+                                                MM_ALIGN]]);
+}
+
+static void *mm_slab_alloc(struct mm_class *cls, size_t n)
+{
+    struct mm_slab *slab = cls->mm_partial;
+    struct mm_tag *tag;
+    char *block;
+
+    if (slab == NULL)
+    {
+        if ((slab = malloc(MM_SLABSIZE)) == NULL)
+            return NULL;
+
+        slab->mm_class = cls;
+        slab->mm_free = NULL;
+        slab->mm_fresh = cls->mm_perslab;
+        slab->mm_used = 0;
+
+        mm_slab_link(&(cls->mm_partial), slab);
+
+        cls->mm_slabs++;
+        mm_state.mm_heap += MM_SLABSIZE;
+
+#ifdef MMDEBUG
+        printf("mm: new slab %p for %lu byte blocks\n", slab, cls->mm_size);
+#endif
+    }
+
+    /* Recycle a freed block first, only then carve into untouched memory */
+    if (slab->mm_free != NULL)
+    {
+        block = slab->mm_free;
+        slab->mm_free = *(void **)block;
+    }
+    else
+    {
+        block = (char *)slab + MM_ROUND(sizeof(struct mm_slab)) +
+                (cls->mm_perslab - slab->mm_fresh) * cls->mm_stride +
+                MM_ROUND(sizeof(struct mm_tag));
+        slab->mm_fresh--;
+    }
+
+    if (++(slab->mm_used) == cls->mm_perslab)
+    {
+        mm_slab_unlink(&(cls->mm_partial), slab);
+        mm_slab_link(&(cls->mm_full), slab);
+    }
+
+    tag = mm_tag_of(block);
+    tag->mm_slab = slab;
+    tag->mm_size = n;
+
+    cls->mm_inuse++;
+    cls->mm_allocs++;
+
+    return block;
+}
+
+static void mm_slab_free(struct mm_slab *slab, void *ptr)
+{
+    struct mm_class *cls = slab->mm_class;
+
+    *(void **)ptr = slab->mm_free;
+    slab->mm_free = ptr;
+
+    if (slab->mm_used-- == cls->mm_perslab)
+    {
+        mm_slab_unlink(&(cls->mm_full), slab);
+        mm_slab_link(&(cls->mm_partial), slab);
+    }
+
+    cls->mm_inuse--;
+    cls->mm_frees++;
+
+    /* Hand empty slabs back, but keep the last one around so a class
+     * hovering around a slab boundary doesn't thrash */
+    if ((slab->mm_used == 0) &&
+        ((slab->mm_prev != NULL) || (slab->mm_next != NULL)))
+    {
+        mm_slab_unlink(&(cls->mm_partial), slab);
+        free(slab);
+
+        cls->mm_slabs--;
+        mm_state.mm_heap -= MM_SLABSIZE;
+
+#ifdef MMDEBUG
+        printf("mm: released slab %p for %lu byte blocks\n",
+                slab, cls->mm_size);
+#endif
+    }
+
+    return;
+}
+
+static void *mm_large_alloc(size_t n)
+{
+    struct mm_header *hdr;
+
+    if (n > (size_t)-1 - MM_HDRSIZE)
+        return NULL;
+
+    if ((hdr = malloc(MM_HDRSIZE + n)) == NULL)
+        return NULL;
+
+    mm_link(hdr);
+    mm_tag_of(mm_payload_of(hdr))->mm_slab = NULL;
+    mm_tag_of(mm_payload_of(hdr))->mm_size = n;
+
+    mm_state.mm_heap += MM_HDRSIZE + n;
+
+    return mm_payload_of(hdr);
+}
+
 
 int mm_init(size_t initcount)
 {
-    size_t initsize = initcount * sizeof(struct mm_entry);
+    size_t i;
+    int c = 0;
 
+    /* Blocks carry their own bookkeeping, so there is no table to
+     * preallocate and initcount is only kept for compatibility */
     memset(&mm_state, 0, sizeof(mm_state));
 
-    if ((mm_state.mm_entries = malloc(initsize)) == NULL)
-        return 1;
+    for (i = 0; i < MM_NCLASSES; ++i)
+    {
+        struct mm_class *cls = &(mm_state.mm_classes[i]);
 
-    memset(mm_state.mm_entries, 0, initsize);
+        cls->mm_size = mm_class_sizes[i];
+        cls->mm_stride = MM_ROUND(sizeof(struct mm_tag)) + cls->mm_size;
+        cls->mm_perslab = (MM_SLABSIZE - MM_ROUND(sizeof(struct mm_slab))) /
+                          cls->mm_stride;
+    }
 
-    mm_state.mm_cap = initcount;
-    mm_state.mm_nentries = 0;
+    for (i = 0; i <= MM_SLABMAX / MM_ALIGN; ++i)
+    {
+        while (mm_class_sizes[c] < i * MM_ALIGN)
+            ++c;
+
+        mm_class_index[i] = c;
+    }
 
 #ifdef MMDEBUG
-    printf("mm: new allocation table of size %lu (%lu entries)\n", initsize, initcount);
+    printf("mm: initialized, %d size classes up to %d bytes\n",
+            MM_NCLASSES, MM_SLABMAX);
 #endif
 
     return 0;
@@ -50,54 +271,63 @@ int mm_init(size_t initcount)
 
 void mm_destroy()
 {
+    struct mm_header *cur = mm_state.mm_blocks;
     int i;
 
 #ifdef MMDEBUG
     printf("mm: cleaning up %lu blocks...\n", mm_state.mm_nentries);
 #endif
 
-    for (i = 0; i < mm_state.mm_nentries; ++i)
+    while (cur != NULL)
     {
-        free(mm_state.mm_entries[i].mm_ptr);
-        mm_state.mm_frees++;
+        struct mm_header *next = cur->mm_next;
+
+        free(cur);
+        cur = next;
+    }
+
+    /* Whole slabs go at once, whatever is still live inside them */
+    for (i = 0; i < MM_NCLASSES; ++i)
+    {
+        struct mm_class *cls = &(mm_state.mm_classes[i]);
+
+        mm_slab_destroy_list(cls->mm_partial);
+        mm_slab_destroy_list(cls->mm_full);
+
+        cls->mm_frees += cls->mm_inuse;
+        cls->mm_partial = cls->mm_full = NULL;
+        cls->mm_slabs = cls->mm_inuse = 0;
     }
 
-    free(mm_state.mm_entries);
+    mm_state.mm_frees += mm_state.mm_nentries;
+
+    mm_state.mm_blocks = NULL;
+    mm_state.mm_nentries = 0;
+    mm_state.mm_bytes = 0;
+    mm_state.mm_heap = 0;
 }
 
 void *mm_malloc(size_t n)
 {
-    void *ptr = NULL;
-    struct mm_entry *next = NULL;
+    void *ptr;
 
-    if ((ptr = malloc(n)) == NULL)
+    if (n <= MM_SLABMAX)
+        ptr = mm_slab_alloc(mm_class_of(n), n);
+    else
+        ptr = mm_large_alloc(n);
+
+    if (ptr == NULL)
         return NULL;
 
     memset(ptr, 0, n);
 
-    if (!(mm_state.mm_nentries < mm_state.mm_cap))
-    {
-        /* Allocate some more */
-        size_t size = mm_state.mm_cap * 2 * sizeof(struct mm_entry);
-
-        if ((mm_state.mm_entries = realloc(mm_state.mm_entries, size)) == NULL)
-        {
-            free(ptr);
-            return NULL;
-        }
-
-        mm_state.mm_cap *= 2;
-    }
-
-    next = &mm_state.mm_entries[mm_state.mm_nentries++];
-
-    next->mm_ptr = ptr;
-    next->mm_size = n;
+    mm_state.mm_nentries++;
+    mm_state.mm_bytes += n;
     mm_state.mm_allocs++;
 
 #ifdef MMDEBUG
-    printf("mm: allocated %lu bytes at %p (%lu entries left)\n",
-            n, ptr, mm_state.mm_cap - (mm_state.mm_nentries));
+    printf("mm: allocated %lu bytes at %p (%lu blocks live)\n",
+            n, ptr, mm_state.mm_nentries);
 #endif
 
     return ptr;
@@ -105,7 +335,10 @@ void *mm_malloc(size_t n)
 
 void *mm_realloc(void *ptr, size_t newsize)
 {
-    int i;
+    struct mm_tag *tag;
+    struct mm_header *hdr;
+    struct mm_header *newh;
+    size_t oldsize;
 
     if (ptr == NULL)
         return mm_malloc(newsize);
@@ -116,75 +349,125 @@ void *mm_realloc(void *ptr, size_t newsize)
         return NULL;
     }
 
-    for (i = 0; i < mm_state.mm_nentries; ++i)
+    if (newsize > (size_t)-1 - MM_HDRSIZE)
+        return NULL;
+
+    tag = mm_tag_of(ptr);
+    oldsize = tag->mm_size;
+
+#ifdef MMDEBUG
+    printf("mm: realloc block %p to %lu bytes.. ", ptr, newsize);
+#endif
+
+    if (tag->mm_slab != NULL)
     {
-        if (mm_state.mm_entries[i].mm_ptr == ptr)
-        {
-            struct mm_entry *e = &(mm_state.mm_entries[i]);
-            void *newd = realloc(e->mm_ptr, newsize);
+        void *newd;
 
+        /* Still fits the class, nothing to move */
+        if (newsize <= tag->mm_slab->mm_class->mm_size)
+        {
 #ifdef MMDEBUG
-            printf("mm: realloc block %p to %lu bytes.. ", e->mm_ptr, newsize);
+            printf("fits in place\n");
 #endif
+            tag->mm_size = newsize;
+
+            mm_state.mm_bytes += newsize;
+            mm_state.mm_bytes -= oldsize;
+
+            return ptr;
+        }
+
+        /* Outgrew it, but maybe not the size classes */
+        if (newsize <= MM_SLABMAX)
+            newd = mm_slab_alloc(mm_class_of(newsize), newsize);
+        else
+            newd = mm_large_alloc(newsize);
 
-            if (newd == NULL)
-            {
+        if (newd == NULL)
+        {
 #ifdef MMDEBUG
-                printf("failed\n");
+            printf("failed\n");
 #endif
-                return ptr;
-            }
-            else
-            {
+            return NULL;
+        }
+
 #ifdef MMDEBUG
-                printf("success, new block at %p\n", newd);
+        printf("success, new block at %p\n", newd);
 #endif
 
-                e->mm_ptr = newd;
-                e->mm_size = newsize;
+        memcpy(newd, ptr, oldsize);
+        mm_slab_free(tag->mm_slab, ptr);
 
-                return newd;
-            }
-        }
+        mm_state.mm_bytes += newsize;
+        mm_state.mm_bytes -= oldsize;
+
+        return newd;
     }
 
-    return NULL;
+    /* The block moves, so take it out of the list first and put back
+     * whichever of the two survives */
+    hdr = mm_header_of(ptr);
+    mm_unlink(hdr);
+
+    if ((newh = realloc(hdr, MM_HDRSIZE + newsize)) == NULL)
+    {
+#ifdef MMDEBUG
+        printf("failed\n");
+#endif
+        mm_link(hdr);
+
+        return NULL;
+    }
+
+#ifdef MMDEBUG
+    printf("success, new block at %p\n", mm_payload_of(newh));
+#endif
+
+    mm_link(newh);
+    mm_tag_of(mm_payload_of(newh))->mm_size = newsize;
+
+    mm_state.mm_bytes += newsize;
+    mm_state.mm_bytes -= oldsize;
+    mm_state.mm_heap += newsize;
+    mm_state.mm_heap -= oldsize;
+
+    return mm_payload_of(newh);
 }
 
 void mm_free(void *ptr)
 {
-    int i;
+    struct mm_tag *tag;
+    size_t size;
 
     if (ptr == NULL)
         return;
 
-    for (i = 0; i < mm_state.mm_nentries; ++i)
-    {
-        if (mm_state.mm_entries[i].mm_ptr == ptr)
-        {
-            int j;
+    tag = mm_tag_of(ptr);
+    size = tag->mm_size;
 
 #ifdef MMDEBUG
-            printf("mm: freed %lu bytes at %p (%lu left)\n",
-                    mm_state.mm_entries[i].mm_size,
-                    mm_state.mm_entries[i].mm_ptr,
-                    mm_state.mm_cap - (mm_state.mm_nentries - 1));
+    printf("mm: freed %lu bytes at %p (%lu blocks live)\n",
+            size, ptr, mm_state.mm_nentries - 1);
 #endif
 
-            free(mm_state.mm_entries[i].mm_ptr);
-            mm_state.mm_entries[i].mm_ptr = NULL;
-            mm_state.mm_frees++;
-
-            for (j = i; j < mm_state.mm_nentries; ++j)
-                memcpy(&(mm_state.mm_entries[j]),
-                       &(mm_state.mm_entries[j + 1]), sizeof(struct mm_entry));
+    if (tag->mm_slab != NULL)
+    {
+        mm_slab_free(tag->mm_slab, ptr);
+    }
+    else
+    {
+        struct mm_header *hdr = mm_header_of(ptr);
 
-            mm_state.mm_nentries--;
+        mm_unlink(hdr);
+        free(hdr);
 
-            break;
-        }
+        mm_state.mm_heap -= MM_HDRSIZE + size;
     }
 
+    mm_state.mm_nentries--;
+    mm_state.mm_bytes -= size;
+    mm_state.mm_frees++;
+
     return;
 }
 
@@ -203,11 +486,7 @@ void *mm_lalloc(void *ud, void *ptr, size_t osize, size_t nsize)
 
 size_t mm_inuse()
 {
-    int i;
-    size_t inuse = mm_state.mm_cap * sizeof(struct mm_entry);
-
-    for (i = 0; i < mm_state.mm_nentries; ++i)
-        inuse += mm_state.mm_entries[i].mm_size;
-
-    return inuse;
+    /* Everything taken from the system: slabs, large blocks and their
+     * headers */
+    return mm_state.mm_heap;
 }
@@ -24,17 +24,69 @@
 
 #include <string.h>
 
-struct mm_entry
+struct mm_slab;
+
+/* Sits right in front of every payload, tells which slab (if any) the block
+ * came from and how much the caller asked for */
+struct mm_tag
 {
-    void *mm_ptr;
+    struct mm_slab *mm_slab;
     size_t mm_size;
 };
 
+/* Blocks too big for a size class come straight from malloc() and are
+ * linked into the list of live large blocks through this header, which
+ * ends with the tag */
+struct mm_header
+{
+    struct mm_header *mm_prev;
+    struct mm_header *mm_next;
+};
+
+/* Keep the payload as aligned as malloc() itself would */
+#define MM_ALIGN 16
+#define MM_ROUND(n) (((n) + (MM_ALIGN - 1)) & ~((size_t)MM_ALIGN - 1))
+#define MM_HDRSIZE MM_ROUND(sizeof(struct mm_header) + sizeof(struct mm_tag))
+
+/* Size classes, anything above the last one is a large block */
+#define MM_NCLASSES 8
+#define MM_SLABMAX 256
+#define MM_SLABSIZE 16384
+
+struct mm_slab
+{
+    struct mm_slab *mm_prev;
+    struct mm_slab *mm_next;
+    struct mm_class *mm_class;
+
+    void *mm_free;     /* blocks handed back, linked through their payload */
+    size_t mm_fresh;   /* blocks never handed out yet */
+    size_t mm_used;
+};
+
+struct mm_class
+{
+    size_t mm_size;    /* largest payload served */
+    size_t mm_stride;  /* tag + payload */
+    size_t mm_perslab;
+
+    struct mm_slab *mm_partial; /* slabs with at least one free block */
+    struct mm_slab *mm_full;
+
+    size_t mm_slabs;
+    size_t mm_inuse;   /* blocks currently handed out */
+    size_t mm_allocs;
+    size_t mm_frees;
+};
+
 struct mm_state
 {
-    struct mm_entry *mm_entries;
-    size_t mm_cap;
+    struct mm_header *mm_blocks;
+    struct mm_class mm_classes[MM_NCLASSES];
+
     size_t mm_nentries;
+    size_t mm_bytes;   /* requested by callers */
+    size_t mm_heap;    /* obtained from the system, overhead included */
     size_t mm_allocs;
     size_t mm_frees;
 };
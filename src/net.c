@@ -25,63 +25,329 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
 #include "net.h"
+#include "event.h"
 #include "state.h"
 #include "util.h"
 #include "logger.h"
+#include "mm.h"
+
+
+int net_bind(luna_network *, int, int, const char *);
+int net_setup(luna_network *, int);
+void net_connect_finish(luna_network *, int);
+void net_connect_next(luna_network *);
+void net_on_resolved(resolv_request *, resolv_addr *, int, void *);
+void net_on_connected(event_loop *, int, int, void *);
+void net_on_stagger(event_loop *, event_timer *, void *);
+void net_on_connect_timeout(event_loop *, event_timer *, void *);
+void net_recvbuf_copy(net_recvbuf *, size_t, char *, size_t, size_t);
+void net_sendq_watch(luna_network *, int);
+void net_sendq_push(net_sendq *, net_sendmsg *);
+int net_penalty(const char *, size_t);
+void net_schedule(luna_network *);
+void net_on_tokens(event_loop *, event_timer *, void *);
+int net_pong_write(luna_network *);
+
+
+/* Penalties for commands that cost the server more than a plain message */
+static const struct
+{
+    const char *command;
+    int cost;
+} net_penalties[] =
+{
+    { "PONG",   500 },
+    { "PING",   500 },
+    { "JOIN",  3000 },
+    { "PART",  3000 },
+    { "MODE",  3000 },
+    { "NICK",  4000 },
+    { "WHO",   4000 },
+    { "WHOIS", 3000 },
 
-
-int net_bind(luna_state *, int, int, const char *);
+    { NULL, 0 }
+};
 
 
-int net_connect(luna_state *state)
+int net_connect(luna_network *net, net_connect_fn done)
 {
-    struct addrinfo hints, *resolv, *p;
-    int fd, res;
+    net_connector *c = NULL;
+    int i;
 
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
+    if ((c = mm_malloc(sizeof(*c))) == NULL)
+        return -1;
+
+    memset(c, 0, sizeof(*c));
+    c->done = done;
+
+    for (i = 0; i < RESOLV_MAX_ADDRS; ++i)
+        c->fds[i] = -1;
+
+    net->connector = c;
+
+    c->timeout = event_timer_add(net->state->loop, NET_CONNECT_TIMEOUT, 0,
+                                 &net_on_connect_timeout, net);
+
+    /* May call back right away on a cache hit, c may be gone after this */
+    if (resolver_lookup(net->state->resolver, net->serverinfo.host,
+                        net->serverinfo.port, &net_on_resolved, net,
+                        &(c->lookup)) < 0)
+    {
+        net_connect_abort(net);
 
-    if ((res = getaddrinfo(state->serverinfo.host, itoa(state->serverinfo.port),
-                           &hints, &resolv)) != 0)
         return -1;
+    }
 
-    for (p = resolv; p != NULL; p = p->ai_next)
+    return 0;
+}
+
+void net_connect_abort(luna_network *net)
+{
+    net_connector *c = net->connector;
+    int i;
+
+    if (c == NULL)
+        return;
+
+    resolver_cancel(net->state->resolver, c->lookup);
+
+    event_timer_cancel(net->state->loop, c->stagger);
+    event_timer_cancel(net->state->loop, c->timeout);
+
+    for (i = 0; i < c->count; ++i)
+    {
+        if (c->fds[i] >= 0)
+        {
+            event_remove(net->state->loop, c->fds[i]);
+            close(c->fds[i]);
+        }
+    }
+
+    mm_free(c);
+    net->connector = NULL;
+
+    return;
+}
+
+void net_connect_finish(luna_network *net, int fd)
+{
+    net_connect_fn done = net->connector->done;
+
+    /* Possibly stale, it moved or lost an address family since */
+    if ((fd < 0) && net->connector->cached)
+        resolver_forget(net->state->resolver, net->serverinfo.host,
+                        net->serverinfo.port);
+
+    net_connect_abort(net);
+
+    if ((fd >= 0) && (net_setup(net, fd) != 0))
+    {
+        close(fd);
+        fd = -1;
+    }
+
+    done(net, fd >= 0);
+
+    return;
+}
+
+void net_on_resolved(resolv_request *req, resolv_addr *addrs, int count,
+                     void *data)
+{
+    luna_network *net = (luna_network *)data;
+    net_connector *c = net->connector;
+    int i, j;
+
+    c->lookup = NULL;
+    c->cached = (req == NULL);
+
+    if (count == 0)
+    {
+        logger_log(net->state->logger, LOGLEV_ERROR,
+                   "[%s] Unable to resolve `%s'",
+                   net->name, net->serverinfo.host);
+
+        net_connect_finish(net, -1);
+
+        return;
+    }
+
+    /* Keep the resolver's preference, but alternate between the address
+     * families so a broken one only ever costs a single stagger interval */
+    for (i = 0, j = 0; c->count < count; )
     {
-        if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
-            continue; /* Couldn't create socket */
+        while ((i < count) && (addrs[i].family != addrs[0].family))
+            ++i;
+
+        while ((j < count) && (addrs[j].family == addrs[0].family))
+            ++j;
+
+        if (((c->count % 2 == 0) && (i < count)) || (j >= count))
+            c->addrs[c->count++] = addrs[i++];
+        else
+            c->addrs[c->count++] = addrs[j++];
+    }
+
+    net_connect_next(net);
 
-        if (state->bind)
-            net_bind(state, p->ai_family, fd, state->bind);
+    return;
+}
+
+void net_connect_next(luna_network *net)
+{
+    net_connector *c = net->connector;
 
-        if (connect(fd, p->ai_addr, p->ai_addrlen) < 0)
+    event_timer_cancel(net->state->loop, c->stagger);
+    c->stagger = NULL;
+
+    while (c->next < c->count)
+    {
+        int idx = c->next++;
+        resolv_addr *addr = &(c->addrs[idx]);
+        int fd;
+
+        if ((fd = socket(addr->family, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
+            continue;
+
+        if (net->bind)
+            net_bind(net, addr->family, fd, net->bind);
+
+        if (connect(fd, (struct sockaddr *)&(addr->addr), addr->len) == 0)
+        {
+            /* Made it straight away, happens on the loopback */
+            net_connect_finish(net, fd);
+
+            return;
+        }
+
+        if ((errno != EINPROGRESS) ||
+            event_add(net->state->loop, fd, EVENT_WRITE, &net_on_connected,
+                      net))
         {
             close(fd);
 
             continue;
         }
 
-        /* Connected, abort looping */
-        break;
+        c->fds[idx] = fd;
+        c->pending++;
+
+        /* Give this one a head start before racing the next address */
+        if (c->next < c->count)
+            c->stagger = event_timer_add(net->state->loop, NET_STAGGER, 0,
+                                         &net_on_stagger, net);
+
+        return;
     }
 
-    freeaddrinfo(resolv);
+    /* Out of addresses with nothing left in flight */
+    if (c->pending == 0)
+    {
+        logger_log(net->state->logger, LOGLEV_ERROR,
+                   "[%s] All addresses of `%s' failed",
+                   net->name, net->serverinfo.host);
 
-    /* Loop not terminated manually? */
-    if (p == NULL)
+        net_connect_finish(net, -1);
+    }
+
+    return;
+}
+
+void net_on_connected(event_loop *loop, int fd, int events, void *data)
+{
+    luna_network *net = (luna_network *)data;
+    net_connector *c = net->connector;
+    socklen_t len = sizeof(int);
+    int err = 0;
+    int i;
+
+    for (i = 0; (i < c->count) && (c->fds[i] != fd); ++i)
+        ;
+
+    if (i == c->count)
+        return;
+
+    event_remove(loop, fd);
+    c->fds[i] = -1;
+    c->pending--;
+
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+        err = errno;
+
+    if (err == 0)
+    {
+        net_connect_finish(net, fd);
+
+        return;
+    }
+
+    logger_log(net->state->logger, LOGLEV_DEBUG, "[%s] Attempt #%d: %s",
+               net->name, i + 1, strerror(err));
+
+    close(fd);
+
+    /* Don't wait for the stagger, move on to the next address now */
+    net_connect_next(net);
+
+    return;
+}
+
+void net_on_stagger(event_loop *loop, event_timer *timer, void *data)
+{
+    luna_network *net = (luna_network *)data;
+
+    /* One-shot, the loop disposes of it */
+    net->connector->stagger = NULL;
+
+    net_connect_next(net);
+
+    return;
+}
+
+void net_on_connect_timeout(event_loop *loop, event_timer *timer, void *data)
+{
+    luna_network *net = (luna_network *)data;
+
+    net->connector->timeout = NULL;
+
+    logger_log(net->state->logger, LOGLEV_ERROR, "[%s] Connecting timed out",
+               net->name);
+
+    net_connect_finish(net, -1);
+
+    return;
+}
+
+int net_setup(luna_network *net, int fd)
+{
+    if ((net->recvbuf = mm_malloc(sizeof(*net->recvbuf))) == NULL)
         return -1;
 
-    state->fd = fd;
+    if ((net->sendq = mm_malloc(sizeof(*net->sendq))) == NULL)
+    {
+        mm_free(net->recvbuf);
+        net->recvbuf = NULL;
 
-    return fd;
+        return -1;
+    }
+
+    memset(net->sendq, 0, sizeof(*net->sendq));
+    net->sendq->tokens = FLOOD_BURST;
+    net->sendq->refilled = event_now();
+    pthread_mutex_init(&(net->sendq->lock), NULL);
+
+    net->fd = fd;
+
+    return 0;
 }
 
-int net_bind(luna_state *state, int fam, int fd, const char *host)
+int net_bind(luna_network *net, int fam, int fd, const char *host)
 {
     struct addrinfo hints, *resolv, *p;
     int res;
@@ -100,17 +366,17 @@ int net_bind(luna_state *state, int fam, int fd, const char *host)
         inet_ntop(fam, &(((struct sockaddr_in *)(p->ai_addr))->sin_addr), ipstr, INET6_ADDRSTRLEN);
 
         if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) < 0)
-            logger_log(state->logger, LOGLEV_WARNING,
+            logger_log(net->state->logger, LOGLEV_WARNING,
                        "Unable to set SO_REUSEADDR");
 
         if (bind(fd, p->ai_addr, p->ai_addrlen) < 0)
         {
-            logger_log(state->logger, LOGLEV_ERROR,
+            logger_log(net->state->logger, LOGLEV_ERROR,
                        "Unable to bind to `%s': %s", ipstr, strerror(errno));
             continue;
         }
 
-        logger_log(state->logger, LOGLEV_INFO,
+        logger_log(net->state->logger, LOGLEV_INFO,
                    "Successfully bound to `%s'", ipstr);
 
         break;
@@ -119,71 +385,581 @@ int net_bind(luna_state *state, int fam, int fd, const char *host)
     return 0;
 }
 
-int net_disconnect(luna_state *state)
+int net_disconnect(luna_network *net)
 {
-    return close(state->fd);
+    net_sendmsg *msg;
+    int i;
+
+    /* Last chance for anything already past flood control, like a QUIT */
+    net->sendq->writing = 0;
+    net_flush(net);
+
+    while ((msg = net->sendq->head) != NULL)
+    {
+        net->sendq->head = msg->next;
+        mm_free(msg);
+    }
+
+    for (i = 0; i < NET_PRIO_COUNT; ++i)
+    {
+        while ((msg = net->sendq->classes[i].head) != NULL)
+        {
+            net->sendq->classes[i].head = msg->next;
+            mm_free(msg);
+        }
+    }
+
+    if (net->state->loop != NULL)
+        event_timer_cancel(net->state->loop, net->sendq->timer);
+
+    pthread_mutex_destroy(&(net->sendq->lock));
+    mm_free(net->sendq);
+    net->sendq = NULL;
+
+    mm_free(net->recvbuf);
+    net->recvbuf = NULL;
+
+    return close(net->fd);
 }
 
-int net_sendfln(luna_state *state, const char *format, ...)
+int net_sendfln(luna_network *net, int prio, const char *format, ...)
 {
     va_list args;
     int retval;
 
     va_start(args, format);
-    retval = net_vsendfln(state, format, args);
+    retval = net_vsendfln(net, prio, format, args);
     va_end(args);
 
     return retval;
 }
 
-int net_vsendfln(luna_state *state, const char *format, va_list args)
+int net_vsendfln(luna_network *net, int prio, const char *format,
+                 va_list args)
 {
-    char buffer[LINELEN];
+    net_sendq *q = net->sendq;
+    net_sendmsg *msg;
+    net_sendmsg *after = NULL;
+    int len;
+
+    if (q == NULL)
+        return -1;
+
+    if ((msg = mm_malloc(sizeof(*msg))) == NULL)
+        return -1;
+
+    /* Format straight into the queue entry, keeping two bytes for CRLF */
+    if ((len = vsnprintf(msg->data, sizeof(msg->data) - 2, format, args)) < 0)
+    {
+        mm_free(msg);
+
+        return -1;
+    }
+
+    if (len > (int)sizeof(msg->data) - 3)
+        len = sizeof(msg->data) - 3;
+
+    logger_log(net->state->logger, LOGLEV_DEBUG, "[%s] >> %.*s",
+               net->name, len, msg->data);
+
+    msg->cost = net_penalty(msg->data, len);
+
+    msg->data[len++] = '\r';
+    msg->data[len++] = '\n';
+    msg->len = len;
+    msg->next = NULL;
 
-    memset(buffer, 0, sizeof(buffer));
+    if ((prio <= NET_PRIO_URGENT) || (prio >= NET_PRIO_COUNT))
+    {
+        /* Still charged, so the server's clock and ours stay in step */
+        q->tokens -= msg->cost;
 
-    /* Write at most LINELEN - 3 bytes to leave space for "\r\n\0" */
-    vsnprintf(buffer, sizeof(buffer) - 3, format, args);
+        /* Jump ahead of everything but a partially written line and the
+         * urgent lines before it, which keep their order */
+        if (q->urgent != NULL)
+            after = q->urgent;
+        else if ((q->head != NULL) && (q->offset != 0))
+            after = q->head;
 
-    logger_log(state->logger, LOGLEV_DEBUG, ">> %s", buffer);
+        if (after == NULL)
+        {
+            if ((msg->next = q->head) == NULL)
+                q->tail = msg;
 
-    /* Safe, space was left by vsnprintf */
-    strcat(buffer, "\r\n");
+            q->head = msg;
+        }
+        else
+        {
+            if ((msg->next = after->next) == NULL)
+                q->tail = msg;
+
+            after->next = msg;
+        }
+
+        q->urgent = msg;
+
+        q->depth++;
+        q->pending += msg->len;
+
+        net_sendq_watch(net, 1);
+    }
+    else
+    {
+        net_schedq *cq = &(q->classes[prio]);
+
+        if (cq->tail != NULL)
+            cq->tail->next = msg;
+        else
+            cq->head = msg;
 
-    return send(state->fd, buffer, strlen(buffer), 0);
+        cq->tail = msg;
+        cq->depth++;
+
+        net_schedule(net);
+    }
+
+    return len;
+}
+
+void net_sendq_push(net_sendq *q, net_sendmsg *msg)
+{
+    msg->next = NULL;
+
+    if (q->tail != NULL)
+        q->tail->next = msg;
+    else
+        q->head = msg;
+
+    q->tail = msg;
+    q->depth++;
+    q->pending += msg->len;
+
+    return;
 }
 
-int net_recvln(luna_state *state, char *buffer, size_t len)
+int net_penalty(const char *line, size_t len)
 {
-    char ch;
+    int cost = FLOOD_COST;
+    size_t cmdlen = strcspn(line, " ");
     int i;
 
-    memset(buffer, 0, len);
+    for (i = 0; net_penalties[i].command != NULL; ++i)
+    {
+        if ((strlen(net_penalties[i].command) == cmdlen) &&
+            !strncasecmp(net_penalties[i].command, line, cmdlen))
+        {
+            cost = net_penalties[i].cost;
+
+            break;
+        }
+    }
+
+    cost += (len * 1000) / FLOOD_BYTES;
+
+    /* Anything dearer than a full bucket would never get out */
+    return cost < FLOOD_BURST ? cost : FLOOD_BURST;
+}
+
+void net_schedule(luna_network *net)
+{
+    net_sendq *q = net->sendq;
+    int released = 0;
+    int prio;
+
+    /* Top up the bucket for the time that passed */
+    q->tokens = net_tokens(net);
+    q->refilled = event_now();
 
-    for (i = 0; i < len; i++)
+    /* Interactive output drains completely before bulk gets a go */
+    for (prio = NET_PRIO_INTERACTIVE; prio < NET_PRIO_COUNT; ++prio)
     {
-        int c = recv(state->fd, &ch, 1, 0);
+        net_schedq *cq = &(q->classes[prio]);
 
-        if (c > 0 )
+        while ((cq->head != NULL) && (q->tokens >= cq->head->cost))
         {
-            if (ch == '\r')
-                buffer[i] = 0;
-            else if (ch == '\n')
+            net_sendmsg *msg = cq->head;
+
+            if ((cq->head = msg->next) == NULL)
+                cq->tail = NULL;
+
+            cq->depth--;
+            q->tokens -= msg->cost;
+
+            net_sendq_push(q, msg);
+            released++;
+        }
+
+        if (cq->head != NULL)
+        {
+            /* Out of tokens, wake up once the next line is affordable */
+            if (q->timer == NULL)
             {
-                buffer[i] = 0;
+                q->delayed++;
+                q->timer = event_timer_add(net->state->loop,
+                                           cq->head->cost - q->tokens, 0,
+                                           &net_on_tokens, net);
+            }
+
+            break;
+        }
+    }
+
+    if (released)
+        net_sendq_watch(net, 1);
+
+    return;
+}
+
+long net_tokens(luna_network *net)
+{
+    long tokens = net->sendq->tokens +
+                  (long)(event_now() - net->sendq->refilled);
+
+    return tokens < FLOOD_BURST ? tokens : FLOOD_BURST;
+}
+
+void net_on_tokens(event_loop *loop, event_timer *timer, void *data)
+{
+    luna_network *net = (luna_network *)data;
 
-                return i + 1;
+    /* One-shot, the loop disposes of it */
+    net->sendq->timer = NULL;
+
+    net_schedule(net);
+
+    return;
+}
+
+int net_flush(luna_network *net)
+{
+    net_sendq *q = net->sendq;
+    struct iovec iov[SENDQ_IOV];
+    int total = 0;
+
+    pthread_mutex_lock(&(q->lock));
+
+    while ((q->head != NULL) || (q->pong_off < q->pong_len))
+    {
+        net_sendmsg *msg;
+        size_t offset = q->offset;
+        size_t want = 0;
+        ssize_t n;
+        int cnt = 0;
+        int partial;
+
+        /* A PONG of the I/O thread goes out between two lines */
+        if ((q->offset == 0) && (q->pong_off < q->pong_len))
+        {
+            if ((n = net_pong_write(net)) < 0)
+            {
+                pthread_mutex_unlock(&(q->lock));
+
+                return -1;
             }
-            else
-                buffer[i] = ch;
+
+            total += n;
+
+            if (q->pong_off < q->pong_len)
+                break;
+
+            continue;
         }
-        else
+
+        for (msg = q->head; (msg != NULL) && (cnt < SENDQ_IOV); msg = msg->next)
+        {
+            iov[cnt].iov_base = msg->data + offset;
+            iov[cnt].iov_len = msg->len - offset;
+            want += iov[cnt++].iov_len;
+
+            offset = 0;
+        }
+
+        if ((n = writev(net->fd, iov, cnt)) < 0)
         {
-            perror("recv()");
+            if (errno == EINTR)
+                continue;
+
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                break;
+
+            logger_log(net->state->logger, LOGLEV_ERROR,
+                       "[%s] Write failed: %s", net->name, strerror(errno));
+
+            pthread_mutex_unlock(&(q->lock));
 
             return -1;
         }
+
+        partial = (size_t)n < want;
+
+        q->pending -= n;
+        q->sent += n;
+        total += n;
+
+        /* Retire every line that went out completely and remember how far
+         * into the first unfinished one we got */
+        while (n > 0)
+        {
+            size_t left = q->head->len - q->offset;
+
+            if ((size_t)n < left)
+            {
+                q->offset += n;
+
+                break;
+            }
+
+            n -= left;
+            q->offset = 0;
+
+            msg = q->head;
+            q->head = msg->next;
+            q->depth--;
+
+            if (q->urgent == msg)
+                q->urgent = NULL;
+
+            mm_free(msg);
+        }
+
+        if (q->head == NULL)
+            q->tail = NULL;
+
+        /* Short write, the socket buffer is full */
+        if (partial)
+            break;
+    }
+
+    net_sendq_watch(net, (q->head != NULL) || (q->pong_off < q->pong_len));
+
+    pthread_mutex_unlock(&(q->lock));
+
+    return total;
+}
+
+int net_pong(luna_network *net, const char *token, size_t toklen)
+{
+    net_sendq *q = net->sendq;
+    int len;
+
+    pthread_mutex_lock(&(q->lock));
+
+    /* One answer still on its way is as good as two */
+    if (q->pong_off >= q->pong_len)
+    {
+        len = snprintf(q->pong, sizeof(q->pong) - 2, "PONG :%.*s",
+                       (int)toklen, token);
+
+        if (len > (int)sizeof(q->pong) - 3)
+            len = sizeof(q->pong) - 3;
+
+        logger_log(net->state->logger, LOGLEV_DEBUG, "[%s] >> %.*s",
+                   net->name, len, q->pong);
+
+        q->pong[len++] = '\r';
+        q->pong[len++] = '\n';
+        q->pong_len = len;
+        q->pong_off = 0;
+    }
+
+    /* Unless a line is half way out, then net_flush() sends it after */
+    if ((q->offset == 0) && (net_pong_write(net) < 0))
+    {
+        pthread_mutex_unlock(&(q->lock));
+
+        return -1;
     }
 
+    len = q->pong_off < q->pong_len;
+
+    pthread_mutex_unlock(&(q->lock));
+
+    return len;
+}
+
+int net_pong_write(luna_network *net)
+{
+    net_sendq *q = net->sendq;
+    ssize_t n;
+
+    do
+        n = send(net->fd, q->pong + q->pong_off, q->pong_len - q->pong_off,
+                 MSG_DONTWAIT | MSG_NOSIGNAL);
+    while ((n < 0) && (errno == EINTR));
+
+    if (n < 0)
+        return ((errno == EAGAIN) || (errno == EWOULDBLOCK)) ? 0 : -1;
+
+    q->pong_off += n;
+    q->sent += n;
+
+    return n;
+}
+
+void net_sendq_watch(luna_network *net, int on)
+{
+    event_loop *loop = net->state->loop;
+    int events = EVENT_EDGE; /* Reading is up to the I/O thread */
+
+    if ((net->sendq->writing == on) || (loop == NULL) || (net->fd < 0))
+        return;
+
+    if (on)
+        events |= EVENT_WRITE;
+
+    if (event_modify(loop, net->fd, events) == 0)
+        net->sendq->writing = on;
+
+    return;
+}
+
+int net_recv(luna_network *net)
+{
+    net_recvbuf *buf = net->recvbuf;
+    struct iovec iov[2];
+    struct msghdr msg;
+    size_t tail;
+    int iovcnt = 1;
+    ssize_t n;
+
+    if (buf->fill == RECVBUFLEN)
+        return 0; /* Full, lines have to be consumed first */
+
+    /* Empty buffers are rewound so reads stay contiguous as long as possible */
+    if (buf->fill == 0)
+        buf->head = 0;
+
+    tail = (buf->head + buf->fill) % RECVBUFLEN;
+
+    /*
+     * Free space is either [tail, end) followed by [0, head), or, if the
+     * unconsumed data already wraps around the end, just [tail, head).
+     * Fill as much of it as we can with one call.
+     */
+    iov[0].iov_base = buf->data + tail;
+
+    if (tail >= buf->head)
+    {
+        iov[0].iov_len = RECVBUFLEN - tail;
+        iov[1].iov_base = buf->data;
+        iov[1].iov_len = buf->head;
+
+        if (buf->head > 0)
+            iovcnt = 2;
+    }
+    else
+    {
+        iov[0].iov_len = buf->head - tail;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+
+    /* Never block, the event loop reports readiness edge-triggered and the
+     * caller reads until there is nothing left */
+    if ((n = recvmsg(net->fd, &msg, MSG_DONTWAIT)) > 0)
+    {
+        buf->fill += n;
+
+        return n;
+    }
+
+    if ((n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK) ||
+                    (errno == EINTR)))
+        return 0;
+
+    if (n < 0)
+        logger_log(net->state->logger, LOGLEV_ERROR, "recv(): %s",
+                   strerror(errno));
+    else
+        logger_log(net->state->logger, LOGLEV_WARNING,
+                   "Connection closed by peer");
+
     return -1;
 }
+
+int net_getln(luna_network *net, char *dest, size_t len)
+{
+    net_recvbuf *buf = net->recvbuf;
+    int n;
+
+    if ((n = net_peekln(net, 0, dest, len)) == 0)
+    {
+        /* No complete line yet. A full buffer without one will never
+         * produce one, so throw it away instead of stalling forever */
+        if (buf->fill == RECVBUFLEN)
+        {
+            logger_log(net->state->logger, LOGLEV_WARNING,
+                       "Discarding %d bytes without line terminator",
+                       RECVBUFLEN);
+
+            buf->head = 0;
+            buf->fill = 0;
+        }
+
+        return 0;
+    }
+
+    /* Consume the line including its terminator */
+    buf->head = (buf->head + n) % RECVBUFLEN;
+    buf->fill -= n;
+
+    return n;
+}
+
+int net_peekln(luna_network *net, size_t offset, char *dest, size_t len)
+{
+    net_recvbuf *buf = net->recvbuf;
+    size_t start = (buf->head + offset) % RECVBUFLEN;
+    size_t first = RECVBUFLEN - start;
+    size_t avail;
+    size_t linelen;
+    char *eol;
+
+    if (offset >= buf->fill)
+        return 0;
+
+    if (first > (avail = buf->fill - offset))
+        first = avail;
+
+    /* Look for the line feed in the contiguous part first, then past the
+     * wrap-around */
+    if ((eol = memchr(buf->data + start, '\n', first)) != NULL)
+        linelen = eol - (buf->data + start);
+    else if ((avail > first) &&
+             (eol = memchr(buf->data, '\n', avail - first)) != NULL)
+        linelen = first + (eol - buf->data);
+    else
+        return 0;
+
+    net_recvbuf_copy(buf, start, dest, linelen, len);
+
+    return linelen + 1;
+}
+
+void net_recvbuf_copy(net_recvbuf *buf, size_t start, char *dest, size_t n,
+                      size_t len)
+{
+    size_t first = RECVBUFLEN - start;
+
+    /* Overlong lines are truncated to what the destination can hold */
+    if (n > len - 1)
+        n = len - 1;
+
+    if (first >= n)
+    {
+        memcpy(dest, buf->data + start, n);
+    }
+    else
+    {
+        memcpy(dest, buf->data + start, first);
+        memcpy(dest + first, buf->data, n - first);
+    }
+
+    /* Strip the carriage return of a CR-LF pair */
+    if ((n > 0) && (dest[n - 1] == '\r'))
+        n--;
+
+    dest[n] = 0;
+}
@@ -19,15 +19,132 @@
 #ifndef NET_H
 #define NET_H
 
+#include <stdint.h>
+#include <pthread.h>
+
 #include "state.h"
+#include "resolver.h"
 
 #define LINELEN 512
 
-int net_connect(luna_state *);
-int net_disconnect(luna_state *);
+/* Size of the per-connection receive ring buffer */
+#define RECVBUFLEN 16384
+
+typedef struct net_recvbuf
+{
+    char data[RECVBUFLEN];
+
+    size_t head; /* Offset of the first unconsumed byte */
+    size_t fill; /* Number of unconsumed bytes, may wrap around the end */
+} net_recvbuf;
+
+/* Most queued lines handed to a single writev() */
+#define SENDQ_IOV 64
+
+/* Output priorities. Urgent lines (PONG and other protocol replies) skip the
+ * flood control scheduler, interactive ones go out before bulk output */
+#define NET_PRIO_URGENT      0
+#define NET_PRIO_INTERACTIVE 1
+#define NET_PRIO_BULK        2
+#define NET_PRIO_COUNT       3
+
+/* Flood control, modelled on the ircd penalty clock: every line costs
+ * FLOOD_COST ms (or its entry in the penalty table) plus a second for every
+ * FLOOD_BYTES bytes, and the server lets the clock run at most FLOOD_BURST ms
+ * ahead of real time. We keep that as a token bucket worth FLOOD_BURST ms */
+#define FLOOD_BURST 10000
+#define FLOOD_COST  2000
+#define FLOOD_BYTES 120
+
+/* Connection attempts are started this many ms apart until one succeeds,
+ * alternating address families (happy eyeballs, RFC 8305) */
+#define NET_STAGGER 250
+
+/* Give up on a connection attempt after this many ms */
+#define NET_CONNECT_TIMEOUT 30000
+
+/* Called once connecting succeeded (1) or failed (0) */
+typedef void (*net_connect_fn)(luna_network *, int);
+
+typedef struct net_connector
+{
+    net_connect_fn done;
+
+    resolv_request *lookup;       /* Pending lookup, if any */
+
+    resolv_addr addrs[RESOLV_MAX_ADDRS];
+    int fds[RESOLV_MAX_ADDRS];    /* Attempt in flight per address, or -1 */
+    int count;
+    int next;                     /* Next address to try */
+    int pending;                  /* Attempts in flight */
+    int cached;                   /* Addresses came from the resolver cache */
+
+    struct event_timer *stagger;
+    struct event_timer *timeout;
+} net_connector;
+
+typedef struct net_sendmsg
+{
+    struct net_sendmsg *next;
+
+    int cost;             /* Penalty in ms */
+    size_t len;           /* Line length including the trailing CRLF */
+    char data[LINELEN];
+} net_sendmsg;
+
+/* Lines of one priority class waiting for the scheduler */
+typedef struct net_schedq
+{
+    net_sendmsg *head;
+    net_sendmsg *tail;
+
+    size_t depth;
+} net_schedq;
+
+/* Per-connection outbound queue, flushed whenever the socket is writable */
+typedef struct net_sendq
+{
+    net_sendmsg *head;
+    net_sendmsg *tail;
+    net_sendmsg *urgent;  /* Last urgent line queued, the next goes after */
+
+    size_t offset;        /* Bytes of head already written */
+    size_t depth;         /* Lines waiting to be written */
+    size_t pending;       /* Bytes waiting to be written */
+    unsigned long sent;   /* Bytes written since connecting */
+    int writing;          /* Whether the loop watches for writability */
+
+    /* Flood control */
+    net_schedq classes[NET_PRIO_COUNT];
+
+    long tokens;          /* Penalty in ms we may still spend right now */
+    uint64_t refilled;    /* When tokens were last topped up */
+    struct event_timer *timer; /* Wakes the scheduler once tokens suffice */
+    unsigned long delayed; /* Times output had to wait for tokens */
+
+    /* The I/O thread answers PINGs itself. Its PONG waits here until the
+     * line being written is complete, writing to the socket and offset
+     * are guarded by lock */
+    pthread_mutex_t lock;
+    char pong[LINELEN];
+    size_t pong_len;
+    size_t pong_off;      /* Bytes of pong already written */
+} net_sendq;
+
+
+int net_connect(luna_network *, net_connect_fn);
+void net_connect_abort(luna_network *);
+int net_disconnect(luna_network *);
+
+int net_sendfln(luna_network *, int, const char *, ...);
+int net_vsendfln(luna_network *, int, const char *, va_list);
+int net_flush(luna_network *);
+long net_tokens(luna_network *);
+
+int net_pong(luna_network *, const char *, size_t);
 
-int net_sendfln(luna_state *, const char *, ...);
-int net_vsendfln(luna_state *, const char *, va_list);
-int net_recvln(luna_state *, char *dest, size_t len);
+int net_recv(luna_network *);
+int net_getln(luna_network *, char *dest, size_t len);
+int net_peekln(luna_network *, size_t, char *dest, size_t len);
 
 #endif
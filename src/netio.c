@@ -0,0 +1,592 @@
+/*
+ * This file is part of Luna
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+/*
+ * Reading from the servers.
+ *
+ * A thread of its own reads every connection, splits what arrives into
+ * lines and answers PINGs on the spot, so a busy handler on the main thread
+ * can't get us timed out. All other lines are parsed right there and go to
+ * the main thread through a lock-free queue per connection. Its buffers
+ * come back through a second queue once handled, and when they run out the
+ * thread stops reading that connection until they do, leaving the rest to
+ * TCP flow control.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "netio.h"
+#include "net.h"
+#include "util.h"
+#include "mm.h"
+
+/* Readiness reports taken per epoll_wait() */
+#define NETIO_EVENTS 16
+
+
+void *netio_thread(void *);
+void netio_service(netio *, netio_conn *);
+int netio_forward(netio *, netio_conn *);
+netio_line *netio_take(netio_conn *);
+void netio_parse(netio_line *);
+int netio_ping(netio_conn *, const char *);
+void netio_retry(netio *);
+netio_conn *netio_find(netio *, int);
+void netio_on_notify(event_loop *, int, int, void *);
+int netio_drain(netio *, netio_conn *);
+void netio_copy(netio_line *, const netio_line *);
+void netio_rebase(irc_view *, const char *, char *);
+void netio_free(netio_conn *);
+
+
+int netio_init(netio **io, event_loop *loop, netio_line_fn on_line,
+               netio_closed_fn on_closed)
+{
+    netio *tmp = NULL;
+    struct epoll_event ev;
+
+    if ((tmp = mm_malloc(sizeof(*tmp))) == NULL)
+        return 1;
+
+    memset(tmp, 0, sizeof(*tmp));
+    tmp->loop = loop;
+    tmp->on_line = on_line;
+    tmp->on_closed = on_closed;
+    tmp->wake = -1;
+    tmp->notify = -1;
+
+    if ((tmp->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    {
+        mm_free(tmp);
+
+        return 1;
+    }
+
+    if ((tmp->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+        goto fail;
+
+    if ((tmp->notify = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+        goto fail;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = tmp->wake;
+
+    if (epoll_ctl(tmp->epfd, EPOLL_CTL_ADD, tmp->wake, &ev) < 0)
+        goto fail;
+
+    if (event_add(loop, tmp->notify, EVENT_READ, &netio_on_notify, tmp))
+        goto fail;
+
+    pthread_mutex_init(&(tmp->lock), NULL);
+
+    if (thread_start(&(tmp->thread), &netio_thread, tmp) != 0)
+    {
+        event_remove(loop, tmp->notify);
+        pthread_mutex_destroy(&(tmp->lock));
+
+        goto fail;
+    }
+
+    *io = tmp;
+    return 0;
+
+fail:
+    if (tmp->notify >= 0)
+        close(tmp->notify);
+
+    if (tmp->wake >= 0)
+        close(tmp->wake);
+
+    close(tmp->epfd);
+    mm_free(tmp);
+
+    return 1;
+}
+
+void netio_destroy(netio *io)
+{
+    netio_conn *conn;
+
+    __atomic_store_n(&(io->stop), 1, __ATOMIC_RELEASE);
+    eventfd_poke(io->wake);
+
+    pthread_join(io->thread, NULL);
+
+    while ((conn = io->conns) != NULL)
+    {
+        io->conns = conn->next;
+        conn->net->io = NULL;
+
+        netio_free(conn);
+    }
+
+    event_remove(io->loop, io->notify);
+    close(io->notify);
+    close(io->wake);
+    close(io->epfd);
+
+    pthread_mutex_destroy(&(io->lock));
+    mm_free(io);
+
+    return;
+}
+
+int netio_attach(netio *io, luna_network *net)
+{
+    netio_conn *conn = NULL;
+    struct epoll_event ev;
+    int i;
+
+    if ((conn = mm_malloc(sizeof(*conn))) == NULL)
+        return 1;
+
+    memset(conn, 0, sizeof(*conn));
+    conn->net = net;
+
+    if (spsc_init(&(conn->lines), NETIO_QUEUE) ||
+        spsc_init(&(conn->spare), NETIO_QUEUE) ||
+        ((conn->buffers = mm_malloc(NETIO_QUEUE * sizeof(netio_line))) ==
+         NULL))
+    {
+        netio_free(conn);
+
+        return 1;
+    }
+
+    for (i = 0; i < NETIO_QUEUE; ++i)
+        spsc_push(conn->spare, conn->buffers + i);
+
+    /* Identified by descriptor rather than pointer, so a report still in
+     * flight for a connection detached meanwhile finds nothing */
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = net->fd;
+
+    pthread_mutex_lock(&(io->lock));
+
+    if (epoll_ctl(io->epfd, EPOLL_CTL_ADD, net->fd, &ev) < 0)
+    {
+        pthread_mutex_unlock(&(io->lock));
+        netio_free(conn);
+
+        return 1;
+    }
+
+    conn->next = io->conns;
+    io->conns = conn;
+    io->generation++;
+
+    pthread_mutex_unlock(&(io->lock));
+
+    net->io = conn;
+
+    return 0;
+}
+
+void netio_detach(netio *io, luna_network *net)
+{
+    netio_conn *conn = net->io;
+    netio_conn **p;
+
+    if (conn == NULL)
+        return;
+
+    /* Can't be in the middle of reading it while we hold the lock */
+    pthread_mutex_lock(&(io->lock));
+
+    epoll_ctl(io->epfd, EPOLL_CTL_DEL, net->fd, NULL);
+
+    for (p = &(io->conns); *p != NULL; p = &((*p)->next))
+    {
+        if (*p == conn)
+        {
+            *p = conn->next;
+            break;
+        }
+    }
+
+    io->generation++;
+
+    pthread_mutex_unlock(&(io->lock));
+
+    /* Whatever was still queued goes with it */
+    net->io = NULL;
+    netio_free(conn);
+
+    return;
+}
+
+void *netio_thread(void *data)
+{
+    netio *io = (netio *)data;
+    struct epoll_event events[NETIO_EVENTS];
+    netio_conn *conn;
+    uint64_t count;
+    int i, n;
+
+    while (!__atomic_load_n(&(io->stop), __ATOMIC_ACQUIRE))
+    {
+        if ((n = epoll_wait(io->epfd, events, NETIO_EVENTS, -1)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            break;
+        }
+
+        pthread_mutex_lock(&(io->lock));
+
+        for (i = 0; i < n; ++i)
+        {
+            if (events[i].data.fd == io->wake)
+            {
+                if (read(io->wake, &count, sizeof(count)) < 0)
+                    ; /* Spurious, nothing to retry */
+
+                netio_retry(io);
+            }
+            else if ((conn = netio_find(io, events[i].data.fd)) != NULL)
+            {
+                netio_service(io, conn);
+            }
+        }
+
+        pthread_mutex_unlock(&(io->lock));
+    }
+
+    return NULL;
+}
+
+void netio_service(netio *io, netio_conn *conn)
+{
+    luna_network *net = conn->net;
+    int queued = 0;
+    int n;
+
+    if (conn->eof)
+        return;
+
+    /* Edge-triggered, so read until the socket runs dry or there's no room
+     * left. A closed connection still has its buffered lines delivered */
+    do
+    {
+        if (conn->closed)
+            n = 0;
+        else if ((n = net_recv(net)) < 0)
+            conn->closed = 1;
+        else if (n > 0)
+            __atomic_store_n(&(net->last_sign_of_life), time(NULL),
+                             __ATOMIC_RELAXED);
+
+        queued |= netio_forward(io, conn);
+    }
+    while (n > 0);
+
+    /* Only once every complete line is out, which it is unless a buffer
+     * was missing */
+    if (conn->closed && (conn->held != NULL))
+    {
+        epoll_ctl(io->epfd, EPOLL_CTL_DEL, net->fd, NULL);
+        __atomic_store_n(&(conn->eof), 1, __ATOMIC_RELEASE);
+
+        queued = 1;
+    }
+
+    if (queued)
+        eventfd_poke(io->notify);
+
+    return;
+}
+
+int netio_forward(netio *io, netio_conn *conn)
+{
+    luna_network *net = conn->net;
+    char line[LINELEN];
+    unsigned long depth;
+    int queued = 0;
+    int len;
+
+    for (;;)
+    {
+        if ((conn->held == NULL) && ((conn->held = netio_take(conn)) == NULL))
+            break;
+
+        if ((len = net_getln(net, conn->held->line, LINELEN)) == 0)
+            break;
+
+        /* Lines looked at while we were stalled were answered already */
+        if (conn->scanned >= (size_t)len)
+        {
+            conn->scanned -= len;
+        }
+        else
+        {
+            conn->scanned = 0;
+            queued |= netio_ping(conn, conn->held->line);
+        }
+
+        netio_parse(conn->held);
+
+        /* Can't be full, it has room for every buffer there is */
+        spsc_push(conn->lines, conn->held);
+        conn->held = NULL;
+
+        depth = __atomic_add_fetch(&(conn->depth), 1, __ATOMIC_RELAXED);
+
+        if (depth > conn->peak)
+            __atomic_store_n(&(conn->peak), depth, __ATOMIC_RELAXED);
+
+        __atomic_add_fetch(&(conn->lines_in), 1, __ATOMIC_RELAXED);
+        queued = 1;
+    }
+
+    /* Out of buffers, but PINGs further down still get their answer */
+    if (conn->held == NULL)
+    {
+        while ((len = net_peekln(net, conn->scanned, line, sizeof(line))) > 0)
+        {
+            conn->scanned += len;
+            queued |= netio_ping(conn, line);
+        }
+    }
+
+    return queued;
+}
+
+netio_line *netio_take(netio_conn *conn)
+{
+    netio_line *buf;
+
+    if (((buf = spsc_pop(conn->spare)) != NULL) || conn->stalled)
+        return buf;
+
+    /* Ask to be woken up once the main thread hands some back, and look
+     * again in case it did in between. Pairs with the fence in
+     * netio_drain() */
+    __atomic_store_n(&(conn->stalled), 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if ((buf = spsc_pop(conn->spare)) != NULL)
+        __atomic_store_n(&(conn->stalled), 0, __ATOMIC_RELAXED);
+    else
+        __atomic_add_fetch(&(conn->stalls), 1, __ATOMIC_RELAXED);
+
+    return buf;
+}
+
+void netio_parse(netio_line *buf)
+{
+    /* Tokenizing takes the line apart, the log wants it whole */
+    buf->len = strlen(buf->line);
+    memcpy(buf->text, buf->line, buf->len + 1);
+
+    buf->status = irc_parse_message(buf->text, &(buf->msg));
+
+    return;
+}
+
+int netio_ping(netio_conn *conn, const char *line)
+{
+    const char *p = line;
+    size_t len;
+    int r;
+
+    /* The server may or may not put its name in front */
+    if ((*p == ':') && ((p = strchr(p, ' ')) != NULL))
+        while (*p == ' ')
+            ++p;
+
+    if ((p == NULL) || strncasecmp(p, "PING ", 5))
+        return 0;
+
+    for (p += 5; *p == ' '; ++p)
+        ;
+
+    /* Echo the first parameter, which may be the trailing one */
+    if (*p == ':')
+        len = strlen(++p);
+    else
+        len = strcspn(p, " ");
+
+    if (len == 0)
+        return 0;
+
+    __atomic_add_fetch(&(conn->pongs), 1, __ATOMIC_RELAXED);
+
+    /* Either behind a line the main thread is half way through writing,
+     * or failed, in which case it gets to find out for itself */
+    if ((r = net_pong(conn->net, p, len)) != 0)
+        __atomic_store_n(&(conn->flush), 1, __ATOMIC_RELEASE);
+
+    return r != 0;
+}
+
+void netio_retry(netio *io)
+{
+    netio_conn *conn;
+
+    for (conn = io->conns; conn != NULL; conn = conn->next)
+    {
+        if (!__atomic_load_n(&(conn->stalled), __ATOMIC_RELAXED))
+            continue;
+
+        __atomic_store_n(&(conn->stalled), 0, __ATOMIC_RELAXED);
+
+        netio_service(io, conn);
+    }
+
+    return;
+}
+
+netio_conn *netio_find(netio *io, int fd)
+{
+    netio_conn *conn;
+
+    for (conn = io->conns; conn != NULL; conn = conn->next)
+        if (conn->net->fd == fd)
+            return conn;
+
+    return NULL;
+}
+
+void netio_on_notify(event_loop *loop, int fd, int events, void *data)
+{
+    netio *io = (netio *)data;
+    netio_conn *conn;
+    uint64_t count;
+
+    if (read(fd, &count, sizeof(count)) < 0)
+        return;
+
+    /* Start over whenever a handler added or dropped a connection */
+    for (conn = io->conns; conn != NULL; )
+        conn = netio_drain(io, conn) ? io->conns : conn->next;
+
+    return;
+}
+
+int netio_drain(netio *io, netio_conn *conn)
+{
+    luna_network *net = conn->net;
+    unsigned long generation = io->generation;
+    unsigned long depth;
+    netio_line line;
+    netio_line *buf;
+    int eof;
+
+    /* Every line queued before the connection went away is seen below */
+    eof = __atomic_load_n(&(conn->eof), __ATOMIC_ACQUIRE);
+
+    if (__atomic_exchange_n(&(conn->flush), 0, __ATOMIC_ACQ_REL) &&
+        (net_flush(net) < 0))
+    {
+        io->on_closed(net);
+
+        return 1;
+    }
+
+    while ((buf = spsc_pop(conn->lines)) != NULL)
+    {
+        depth = __atomic_sub_fetch(&(conn->depth), 1, __ATOMIC_RELAXED);
+
+        /* The buffer goes back right away, handlers may take a while */
+        netio_copy(&line, buf);
+        spsc_push(conn->spare, buf);
+
+        /* A stalled reader only resumes once half the buffers are free, so
+         * it isn't woken for every single line */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        if ((depth <= NETIO_QUEUE / 2) &&
+            __atomic_load_n(&(conn->stalled), __ATOMIC_RELAXED))
+            eventfd_poke(io->wake);
+
+        io->on_line(net, line.line, (line.status == SOK) ? &(line.msg) : NULL);
+
+        /* Handlers may have dropped the connection, and conn with it */
+        if (io->generation != generation)
+            return 1;
+    }
+
+    if (eof)
+    {
+        io->on_closed(net);
+
+        return 1;
+    }
+
+    return 0;
+}
+
+void netio_copy(netio_line *dest, const netio_line *src)
+{
+    int i;
+
+    dest->msg = src->msg;
+    dest->status = src->status;
+    dest->len = src->len;
+
+    memcpy(dest->line, src->line, src->len + 1);
+    memcpy(dest->text, src->text, src->len + 1);
+
+    if (src->status != SOK)
+        return;
+
+    /* Same offsets, into our own copy of the text */
+    netio_rebase(&(dest->msg.m_prefix), src->text, dest->text);
+    netio_rebase(&(dest->msg.m_command), src->text, dest->text);
+    netio_rebase(&(dest->msg.m_msg), src->text, dest->text);
+
+    for (i = 0; i < dest->msg.m_paramcount; ++i)
+        netio_rebase(&(dest->msg.m_params[i]), src->text, dest->text);
+
+    return;
+}
+
+void netio_rebase(irc_view *view, const char *from, char *to)
+{
+    if (view->ptr != NULL)
+        view->ptr = to + (view->ptr - from);
+
+    return;
+}
+
+void netio_free(netio_conn *conn)
+{
+    if (conn->lines != NULL)
+        spsc_destroy(conn->lines);
+
+    if (conn->spare != NULL)
+        spsc_destroy(conn->spare);
+
+    if (conn->buffers != NULL)
+        mm_free(conn->buffers);
+
+    mm_free(conn);
+
+    return;
+}
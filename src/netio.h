@@ -0,0 +1,110 @@
+/*
+ * This file is part of Luna
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef NETIO_H
+#define NETIO_H
+
+#include <pthread.h>
+
+#include "event.h"
+#include "spsc.h"
+#include "state.h"
+#include "irc.h"
+
+/* Lines of a connection that can wait for the main thread to handle them */
+#define NETIO_QUEUE 256
+
+/* Reads one of a connection's counters from outside the I/O thread */
+#define netio_metric(counter) __atomic_load_n(counter, __ATOMIC_RELAXED)
+
+typedef struct netio netio;
+typedef struct netio_conn netio_conn;
+
+/* Called on the main thread for every line received, along with what it
+ * was parsed into or NULL if it isn't a valid message. And once the peer is
+ * gone and all lines before that were handled */
+typedef void (*netio_line_fn)(luna_network *, const char *, irc_message *);
+typedef void (*netio_closed_fn)(luna_network *);
+
+/* A line received and parsed by the I/O thread. The views of msg point into
+ * text, a copy of line tokenized in place */
+typedef struct netio_line
+{
+    irc_message msg;
+    irc_parse_status status;
+    size_t len;
+
+    char line[LINELEN]; /* As it came, for the log */
+    char text[LINELEN];
+} netio_line;
+
+struct netio_conn
+{
+    struct netio_conn *next;
+    luna_network *net;
+
+    spsc *lines;   /* Received lines, from the I/O thread to the main one */
+    spsc *spare;   /* Handled ones going back to be filled again */
+
+    netio_line *buffers; /* NETIO_QUEUE of them behind both */
+    netio_line *held;    /* Spare one the I/O thread has taken, not filled */
+
+    /* Bytes past the head of the receive buffer already checked for PINGs
+     * while no buffer was spare. I/O thread only */
+    size_t scanned;
+    int closed;    /* Read the end of it, I/O thread only as well */
+
+    /* Shared, accessed atomically */
+    int stalled;   /* Out of spare buffers, waiting for the main thread */
+    int eof;       /* Connection gone, nothing more is coming */
+    int flush;     /* A PONG is waiting for the main thread to write it */
+    unsigned long depth; /* Lines queued right now */
+
+    /* Metrics, written by the I/O thread only but read atomically */
+    unsigned long peak;
+    unsigned long stalls;
+    unsigned long lines_in;
+    unsigned long pongs;
+};
+
+struct netio
+{
+    event_loop *loop;
+
+    pthread_t thread;
+    pthread_mutex_t lock; /* Guards conns, held while one is serviced */
+    int epfd;             /* The I/O thread's own, for the sockets */
+    int wake;             /* eventfd, poked to stop or after a stall */
+    int notify;           /* eventfd, poked when there is work for main */
+    int stop;
+
+    netio_conn *conns;
+    unsigned long generation; /* Changes with every attach and detach */
+
+    netio_line_fn on_line;
+    netio_closed_fn on_closed;
+};
+
+
+int netio_init(netio **, event_loop *, netio_line_fn, netio_closed_fn);
+void netio_destroy(netio *);
+
+int netio_attach(netio *, luna_network *);
+void netio_detach(netio *, luna_network *);
+
+#endif
@@ -0,0 +1,347 @@
+/*
+ * This file is part of Luna
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+/*
+ * Asynchronous name resolution.
+ *
+ * getaddrinfo() blocks, so lookups are handed to a single worker thread and
+ * their results come back through an eventfd watched by the main loop.
+ * Successful results are cached for RESOLV_TTL seconds.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include <sys/eventfd.h>
+#include <netdb.h>
+
+#include "resolver.h"
+#include "event.h"
+#include "linked_list.h"
+#include "util.h"
+#include "mm.h"
+
+
+void *resolver_thread(void *);
+void resolver_on_notify(event_loop *, int, int, void *);
+int resolver_entry_cmp(const void *, const void *);
+resolv_entry *resolver_cache_find(resolver *, const char *, int);
+void resolver_cache_store(resolver *, resolv_request *);
+
+
+int resolver_init(resolver **res, event_loop *loop)
+{
+    resolver *tmp = NULL;
+
+    if ((tmp = mm_malloc(sizeof(*tmp))) == NULL)
+        return 1;
+
+    memset(tmp, 0, sizeof(*tmp));
+    tmp->loop = loop;
+
+    if ((tmp->notify = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+    {
+        mm_free(tmp);
+
+        return 1;
+    }
+
+    if (list_init(&(tmp->cache)))
+        goto fail;
+
+    if (event_add(loop, tmp->notify, EVENT_READ, &resolver_on_notify, tmp))
+        goto fail;
+
+    pthread_mutex_init(&(tmp->lock), NULL);
+    pthread_cond_init(&(tmp->wake), NULL);
+
+    if (thread_start(&(tmp->thread), &resolver_thread, tmp) != 0)
+    {
+        event_remove(loop, tmp->notify);
+        pthread_mutex_destroy(&(tmp->lock));
+        pthread_cond_destroy(&(tmp->wake));
+
+        goto fail;
+    }
+
+    *res = tmp;
+    return 0;
+
+fail:
+    if (tmp->cache)
+        list_destroy(tmp->cache, &mm_free);
+
+    close(tmp->notify);
+    mm_free(tmp);
+
+    return 1;
+}
+
+void resolver_destroy(resolver *res)
+{
+    resolv_request *req;
+
+    pthread_mutex_lock(&(res->lock));
+    res->stop = 1;
+    pthread_cond_signal(&(res->wake));
+    pthread_mutex_unlock(&(res->lock));
+
+    /* Waits for a lookup in progress to finish */
+    pthread_join(res->thread, NULL);
+
+    while ((req = res->pending) != NULL)
+    {
+        res->pending = req->next;
+        mm_free(req);
+    }
+
+    while ((req = res->done) != NULL)
+    {
+        res->done = req->next;
+        mm_free(req);
+    }
+
+    event_remove(res->loop, res->notify);
+    close(res->notify);
+
+    pthread_mutex_destroy(&(res->lock));
+    pthread_cond_destroy(&(res->wake));
+
+    list_destroy(res->cache, &mm_free);
+    mm_free(res);
+
+    return;
+}
+
+int resolver_lookup(resolver *res, const char *host, int port, resolv_fn f,
+                    void *data, resolv_request **handle)
+{
+    resolv_request *req = NULL;
+    resolv_entry *cached = NULL;
+
+    *handle = NULL;
+
+    /* Served from the cache right away, before we even return */
+    if ((cached = resolver_cache_find(res, host, port)) != NULL)
+    {
+        f(NULL, cached->addrs, cached->count, data);
+
+        return 0;
+    }
+
+    if ((req = mm_malloc(sizeof(*req))) == NULL)
+        return -1;
+
+    memset(req, 0, sizeof(*req));
+
+    strncpy(req->host, host, sizeof(req->host) - 1);
+    req->port = port;
+    req->callback = f;
+    req->data = data;
+
+    pthread_mutex_lock(&(res->lock));
+
+    if (res->pending_tail != NULL)
+        res->pending_tail->next = req;
+    else
+        res->pending = req;
+
+    res->pending_tail = req;
+
+    pthread_cond_signal(&(res->wake));
+    pthread_mutex_unlock(&(res->lock));
+
+    *handle = req;
+
+    return 0;
+}
+
+void resolver_cancel(resolver *res, resolv_request *req)
+{
+    if (req == NULL)
+        return;
+
+    /* The lookup runs to completion regardless and its result still makes
+     * it into the cache, only the callback is skipped. The thread never
+     * looks at this flag */
+    req->cancelled = 1;
+
+    return;
+}
+
+void *resolver_thread(void *data)
+{
+    resolver *res = (resolver *)data;
+
+    pthread_mutex_lock(&(res->lock));
+
+    while (!res->stop)
+    {
+        resolv_request *req;
+        struct addrinfo hints, *result, *p;
+        char port[8];
+
+        if ((req = res->pending) == NULL)
+        {
+            pthread_cond_wait(&(res->wake), &(res->lock));
+
+            continue;
+        }
+
+        if ((res->pending = req->next) == NULL)
+            res->pending_tail = NULL;
+
+        pthread_mutex_unlock(&(res->lock));
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_ADDRCONFIG;
+
+        snprintf(port, sizeof(port), "%d", req->port);
+
+        if ((req->error = getaddrinfo(req->host, port, &hints, &result)) == 0)
+        {
+            for (p = result; (p != NULL) && (req->count < RESOLV_MAX_ADDRS);
+                 p = p->ai_next)
+            {
+                resolv_addr *addr = &(req->addrs[req->count++]);
+
+                addr->family = p->ai_family;
+                addr->len = p->ai_addrlen;
+                memcpy(&(addr->addr), p->ai_addr, p->ai_addrlen);
+            }
+
+            freeaddrinfo(result);
+        }
+
+        pthread_mutex_lock(&(res->lock));
+
+        req->next = res->done;
+        res->done = req;
+
+        eventfd_poke(res->notify);
+    }
+
+    pthread_mutex_unlock(&(res->lock));
+
+    return NULL;
+}
+
+void resolver_on_notify(event_loop *loop, int fd, int events, void *data)
+{
+    resolver *res = (resolver *)data;
+    resolv_request *done, *req;
+    uint64_t count;
+
+    if (read(fd, &count, sizeof(count)) < 0)
+        return;
+
+    pthread_mutex_lock(&(res->lock));
+    done = res->done;
+    res->done = NULL;
+    pthread_mutex_unlock(&(res->lock));
+
+    while ((req = done) != NULL)
+    {
+        done = req->next;
+
+        if (req->count > 0)
+            resolver_cache_store(res, req);
+
+        if (!req->cancelled)
+            req->callback(req, req->addrs, req->count, req->data);
+
+        mm_free(req);
+    }
+
+    return;
+}
+
+int resolver_entry_cmp(const void *data, const void *list_data)
+{
+    const resolv_request *req = (const resolv_request *)data;
+    const resolv_entry *entry = (const resolv_entry *)list_data;
+
+    if (req->port != entry->port)
+        return 1;
+
+    return strcasecmp(req->host, entry->host);
+}
+
+void resolver_forget(resolver *res, const char *host, int port)
+{
+    resolv_entry *entry = NULL;
+
+    /* None of its addresses worked, the next lookup asks again instead of
+     * serving them until they expire */
+    if ((entry = resolver_cache_find(res, host, port)) != NULL)
+        list_delete(res->cache, entry, &mm_free);
+
+    return;
+}
+
+resolv_entry *resolver_cache_find(resolver *res, const char *host, int port)
+{
+    resolv_request key;
+    resolv_entry *entry = NULL;
+
+    strncpy(key.host, host, sizeof(key.host) - 1);
+    key.host[sizeof(key.host) - 1] = '\0';
+    key.port = port;
+
+    if ((entry = list_find(res->cache, &key, &resolver_entry_cmp)) == NULL)
+        return NULL;
+
+    if (entry->expires <= time(NULL))
+    {
+        list_delete(res->cache, entry, &mm_free);
+
+        return NULL;
+    }
+
+    return entry;
+}
+
+void resolver_cache_store(resolver *res, resolv_request *req)
+{
+    resolv_entry *entry = NULL;
+
+    if ((entry = list_find(res->cache, req, &resolver_entry_cmp)) == NULL)
+    {
+        if ((entry = mm_malloc(sizeof(*entry))) == NULL)
+            return;
+
+        memset(entry, 0, sizeof(*entry));
+
+        strcpy(entry->host, req->host);
+        entry->port = req->port;
+
+        list_push_back(res->cache, entry);
+    }
+
+    entry->expires = time(NULL) + RESOLV_TTL;
+    entry->count = req->count;
+    memcpy(entry->addrs, req->addrs, sizeof(entry->addrs));
+
+    return;
+}
@@ -0,0 +1,107 @@
+/*
+ * This file is part of Luna
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include <time.h>
+#include <pthread.h>
+
+#include <sys/socket.h>
+
+#include "event.h"
+#include "linked_list.h"
+
+/* Addresses kept per lookup */
+#define RESOLV_MAX_ADDRS 16
+
+/* Seconds a successful lookup is served from the cache. getaddrinfo() doesn't
+ * tell us the record's TTL, so this is our own */
+#define RESOLV_TTL 300
+
+typedef struct resolver resolver;
+typedef struct resolv_request resolv_request;
+
+typedef struct resolv_addr
+{
+    int family;
+    socklen_t len;
+    struct sockaddr_storage addr;
+} resolv_addr;
+
+/* Called on the main thread, count is 0 if the lookup failed. The request
+ * is NULL when the answer came from the cache */
+typedef void (*resolv_fn)(resolv_request *, resolv_addr *, int, void *);
+
+struct resolv_request
+{
+    struct resolv_request *next;
+
+    char host[256];
+    int port;
+
+    resolv_fn callback;
+    void *data;
+    int cancelled;
+
+    /* Filled in by the resolver thread */
+    int error;
+    int count;
+    resolv_addr addrs[RESOLV_MAX_ADDRS];
+};
+
+typedef struct resolv_entry
+{
+    char host[256];
+    int port;
+    time_t expires;
+
+    int count;
+    resolv_addr addrs[RESOLV_MAX_ADDRS];
+} resolv_entry;
+
+struct resolver
+{
+    event_loop *loop;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int stop;
+
+    int notify; /* eventfd, poked by the thread when requests are done */
+
+    /* Guarded by lock. The thread never touches mm, requests are allocated
+     * and freed on the main thread only */
+    resolv_request *pending;
+    resolv_request *pending_tail;
+    resolv_request *done;
+
+    linked_list *cache; /* Main thread only */
+};
+
+
+int resolver_init(resolver **, event_loop *);
+void resolver_destroy(resolver *);
+
+int resolver_lookup(resolver *, const char *, int, resolv_fn, void *,
+                    resolv_request **);
+void resolver_cancel(resolver *, resolv_request *);
+void resolver_forget(resolver *, const char *, int);
+
+#endif
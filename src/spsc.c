@@ -0,0 +1,91 @@
+/*
+ * This file is part of Luna
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "spsc.h"
+#include "mm.h"
+
+
+int spsc_init(spsc **queue, size_t capacity)
+{
+    spsc *tmp = NULL;
+    size_t size = 2;
+
+    while (size < capacity)
+        size <<= 1;
+
+    if ((tmp = mm_malloc(sizeof(*tmp))) == NULL)
+        return 1;
+
+    memset(tmp, 0, sizeof(*tmp));
+
+    if ((tmp->slots = mm_malloc(size * sizeof(*(tmp->slots)))) == NULL)
+    {
+        mm_free(tmp);
+
+        return 1;
+    }
+
+    tmp->mask = size - 1;
+
+    *queue = tmp;
+    return 0;
+}
+
+void spsc_destroy(spsc *queue)
+{
+    mm_free(queue->slots);
+    mm_free(queue);
+
+    return;
+}
+
+int spsc_push(spsc *queue, void *item)
+{
+    size_t tail = __atomic_load_n(&(queue->tail), __ATOMIC_RELAXED);
+    size_t head = __atomic_load_n(&(queue->head), __ATOMIC_ACQUIRE);
+
+    if (tail - head > queue->mask)
+        return 1;
+
+    queue->slots[tail & queue->mask] = item;
+
+    /* Publishes the slot along with the new tail */
+    __atomic_store_n(&(queue->tail), tail + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+void *spsc_pop(spsc *queue)
+{
+    size_t head = __atomic_load_n(&(queue->head), __ATOMIC_RELAXED);
+    size_t tail = __atomic_load_n(&(queue->tail), __ATOMIC_ACQUIRE);
+    void *item;
+
+    if (head == tail)
+        return NULL;
+
+    item = queue->slots[head & queue->mask];
+
+    /* The slot may be reused once the producer sees this */
+    __atomic_store_n(&(queue->head), head + 1, __ATOMIC_RELEASE);
+
+    return item;
+}
@@ -0,0 +1,53 @@
+/*
+ * This file is part of Luna
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef SPSC_H
+#define SPSC_H
+
+#include <stddef.h>
+
+/* Keeps the two ends of a queue off each other's cache line */
+#define SPSC_CACHELINE 64
+
+/*
+ * Bounded lock-free queue of pointers between exactly one producer thread
+ * and one consumer thread. Neither side ever blocks or allocates, a full
+ * queue refuses the push and an empty one returns NULL. Creating and
+ * destroying it is up to one thread while nobody else uses it.
+ */
+typedef struct spsc
+{
+    void **slots;
+    size_t mask; /* Capacity minus one, the capacity is a power of two */
+
+    /* Next slot to read, only written by the consumer */
+    size_t head;
+    char pad[SPSC_CACHELINE];
+
+    /* Next slot to write, only written by the producer */
+    size_t tail;
+} spsc;
+
+
+int spsc_init(spsc **, size_t);
+void spsc_destroy(spsc *);
+
+int spsc_push(spsc *, void *);
+void *spsc_pop(spsc *);
+
+#endif
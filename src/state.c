@@ -19,9 +19,11 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "luna.h"
 #include "state.h"
 #include "linked_list.h"
 #include "channel.h"
+#include "strmap.h"
 #include "handlers.h"
 #include "mm.h"
 
@@ -32,7 +34,10 @@ int state_init(luna_state *state)
 {
     memset(state, 0, sizeof(*state));
 
-    if (list_init(&(state->scripts)) != 0)
+    if (vector_init(&(state->scripts), 0) != 0)
+        return 1;
+
+    if (list_init(&(state->networks)) != 0)
         return 1;
 
     return 0;
@@ -41,9 +46,67 @@ int state_init(luna_state *state)
 int state_destroy(luna_state *state)
 {
     logger_destroy(state->logger);
-    list_destroy(state->scripts, &script_free);
-
-    mm_free(state->chantypes);
+    vector_destroy(state->scripts, &script_free);
+    list_destroy(state->networks, &network_free);
 
     return 0;
 }
+
+/*
+ * Networks
+ */
+int network_cmp(const void *data, const void *list_data)
+{
+    const char *name = (const char *)data;
+    luna_network *net = (luna_network *)list_data;
+
+    return strcasecmp(name, net->name);
+}
+
+luna_network *network_new(luna_state *state)
+{
+    luna_network *net = NULL;
+
+    if ((net = mm_malloc(sizeof(*net))) == NULL)
+        return NULL;
+
+    memset(net, 0, sizeof(*net));
+
+    ilist_init(&(net->channels));
+    net->casemapping = IRC_CASEMAP_RFC1459;
+
+    if ((strmap_init(&(net->users), net->casemapping) != 0) ||
+        (strmap_init(&(net->chanindex), net->casemapping) != 0))
+    {
+        strmap_destroy(net->users);
+        mm_free(net);
+
+        return NULL;
+    }
+
+    net->fd = -1;
+    net->tries = RECONN_MAX;
+    net->state = state;
+
+    return net;
+}
+
+void network_free(void *data)
+{
+    luna_network *net = (luna_network *)data;
+
+    channel_clear(net);
+    strmap_destroy(net->chanindex);
+    strmap_destroy(net->users);
+
+    mm_free(net->bind);
+    mm_free(net->chantypes);
+    mm_free(net);
+
+    return;
+}
+
+luna_network *network_get(luna_state *state, const char *name)
+{
+    return list_find(state->networks, name, &network_cmp);
+}
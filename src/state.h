@@ -23,6 +23,8 @@
 
 #include "logger.h"
 #include "linked_list.h"
+#include "vector.h"
+#include "ilist.h"
 
 typedef struct luna_userinfo
 {
@@ -52,23 +54,35 @@ typedef struct prefix
     char mode;
 } prefix;
 
-typedef struct luna_state
+typedef struct luna_network
 {
+    char name[32];
+
     luna_userinfo userinfo;
     luna_serverinfo serverinfo;
 
-    luna_log *logger;
+    char *bind;
 
     int fd;
-    int killswitch;
+    struct net_recvbuf *recvbuf;
+    struct net_sendq *sendq;
+    struct net_connector *connector; /* Set while connecting */
+    struct netio_conn *io; /* Its end of the I/O thread, while connected */
+
+    int tries; /* Connection attempts left before giving up */
 
-    time_t started;
     time_t connected;
+    time_t last_sign_of_life;
 
-    linked_list *channels;
-    linked_list *scripts;
+    struct event_timer *liveness;
+    struct event_timer *reconnect;
 
-    char *bind;
+    ilist channels; /* irc_channel, in order of joining */
+    struct strmap *chanindex; /* The same channels by name */
+
+    /* Everyone sharing a channel with us, by nick under casemapping */
+    struct strmap *users;
+    int casemapping;
 
     // Channel modes
     struct channel_modes chanmodes;
@@ -78,10 +92,48 @@ typedef struct luna_state
 
     char *chantypes;
 
+    struct luna_state *state; /* Process state this network belongs to */
+} luna_network;
+
+typedef struct luna_state
+{
+    luna_log *logger;
+
+    struct event_loop *loop;
+    struct resolver *resolver;
+    struct netio *io;
+
+    /* Scratch memory for the event being handled, reset after each one */
+    struct arena *scratch;
+
+    int killswitch;
+
+    time_t started;
+
+    linked_list *networks;
+    vector *scripts; /* luna_script, in order of loading */
+
+    /* Default cap on the memory of each script's Lua state, 0 for none */
+    size_t script_memlimit;
+
+    /* Network whose event is currently being dispatched, if any */
+    luna_network *current;
+
+    /* Timing of script handlers, switched at runtime, read atomically since
+     * workers check it too. Logged every profile_interval seconds if set */
+    int profiling;
+    int profile_interval;
+    struct event_timer *profile_timer;
+
 } luna_state;
 
 
 int state_init(luna_state *);
 int state_destroy(luna_state *);
 
+int network_cmp(const void *, const void *);
+luna_network *network_new(luna_state *);
+void network_free(void *);
+luna_network *network_get(luna_state *, const char *);
+
 #endif
@@ -0,0 +1,228 @@
+/*
+ * This file is part of Luna
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+/*
+ * Linear probing with backward shift deletion, so lookups never have to
+ * step over tombstones. The table doubles once it is three quarters full.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "strmap.h"
+#include "irc.h"
+#include "mm.h"
+
+
+static int strmap_resize(strmap *, size_t);
+
+
+static size_t strmap_find(strmap *map, const char *key, size_t len,
+                          unsigned int hash)
+{
+    size_t mask = map->size - 1;
+    size_t i = hash & mask;
+
+    while (map->slots[i].key != NULL)
+    {
+        strmap_slot *slot = &(map->slots[i]);
+
+        if ((slot->hash == hash) && (slot->len == len) &&
+            !irc_casencmp(map->casemap, slot->key, key, len))
+            return i;
+
+        i = (i + 1) & mask;
+    }
+
+    /* Where it would go */
+    return i;
+}
+
+static int strmap_resize(strmap *map, size_t size)
+{
+    strmap_slot *old = map->slots;
+    size_t oldsize = map->size;
+    size_t i;
+
+    if ((map->slots = mm_malloc(size * sizeof(*old))) == NULL)
+    {
+        map->slots = old;
+        return 1;
+    }
+
+    map->size = size;
+
+    for (i = 0; i < oldsize; ++i)
+    {
+        if (old[i].key != NULL)
+        {
+            /* Hashes depend on the casemapping, which may just have
+             * changed */
+            size_t at;
+
+            old[i].hash = irc_casehash(map->casemap, old[i].key, old[i].len);
+            at = strmap_find(map, old[i].key, old[i].len, old[i].hash);
+
+            if (map->slots[at].key != NULL)
+                map->count--;
+
+            map->slots[at] = old[i];
+        }
+    }
+
+    mm_free(old);
+
+    return 0;
+}
+
+
+int strmap_init(strmap **map, irc_casemapping casemap)
+{
+    strmap *tmp;
+
+    if ((tmp = mm_malloc(sizeof(*tmp))) == NULL)
+        return 1;
+
+    if ((tmp->slots = mm_malloc(STRMAP_MINSIZE * sizeof(strmap_slot))) == NULL)
+    {
+        mm_free(tmp);
+        return 1;
+    }
+
+    tmp->size = STRMAP_MINSIZE;
+    tmp->count = 0;
+    tmp->casemap = casemap;
+
+    *map = tmp;
+
+    return 0;
+}
+
+void strmap_destroy(strmap *map)
+{
+    if (map == NULL)
+        return;
+
+    mm_free(map->slots);
+    mm_free(map);
+
+    return;
+}
+
+void *strmap_get(strmap *map, const char *key, size_t len)
+{
+    unsigned int hash = irc_casehash(map->casemap, key, len);
+
+    return map->slots[strmap_find(map, key, len, hash)].value;
+}
+
+int strmap_put(strmap *map, const char *key, size_t len, void *value)
+{
+    unsigned int hash;
+    strmap_slot *slot;
+
+    if (((map->count + 1) * 4 > map->size * 3) &&
+        (strmap_resize(map, map->size * 2) != 0))
+        return 1;
+
+    hash = irc_casehash(map->casemap, key, len);
+    slot = &(map->slots[strmap_find(map, key, len, hash)]);
+
+    if (slot->key == NULL)
+        map->count++;
+
+    /* Replacing an entry also takes over its new key */
+    slot->key = key;
+    slot->len = len;
+    slot->hash = hash;
+    slot->value = value;
+
+    return 0;
+}
+
+void *strmap_remove(strmap *map, const char *key, size_t len)
+{
+    unsigned int hash = irc_casehash(map->casemap, key, len);
+    size_t mask = map->size - 1;
+    size_t i = strmap_find(map, key, len, hash);
+    size_t j = i;
+    void *value = map->slots[i].value;
+
+    if (map->slots[i].key == NULL)
+        return NULL;
+
+    map->count--;
+
+    /* Pull later members of the probe run back into the hole, unless
+     * that would move them in front of their home slot */
+    for (;;)
+    {
+        size_t home;
+
+        map->slots[i].key = NULL;
+        map->slots[i].value = NULL;
+
+        do
+        {
+            j = (j + 1) & mask;
+
+            if (map->slots[j].key == NULL)
+                return value;
+
+            home = map->slots[j].hash & mask;
+        }
+        while ((i <= j) ? ((i < home) && (home <= j))
+                        : ((i < home) || (home <= j)));
+
+        map->slots[i] = map->slots[j];
+        i = j;
+    }
+}
+
+void strmap_clear(strmap *map)
+{
+    memset(map->slots, 0, map->size * sizeof(strmap_slot));
+    map->count = 0;
+
+    return;
+}
+
+int strmap_set_casemap(strmap *map, irc_casemapping casemap)
+{
+    if (map->casemap == casemap)
+        return 0;
+
+    /* Keys that used to differ may collide now, the later one wins */
+    map->casemap = casemap;
+
+    return strmap_resize(map, map->size);
+}
+
+void *strmap_next(strmap *map, size_t *iter)
+{
+    /* Start with *iter = 0, NULL once every entry has been visited */
+    while (*iter < map->size)
+    {
+        strmap_slot *slot = &(map->slots[(*iter)++]);
+
+        if (slot->key != NULL)
+            return slot->value;
+    }
+
+    return NULL;
+}
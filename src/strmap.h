@@ -0,0 +1,69 @@
+/*
+ * This file is part of Luna
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef STRMAP_H
+#define STRMAP_H
+
+#include <stddef.h>
+
+#include "irc.h"
+
+/* Slots a new map starts out with, always a power of two */
+#define STRMAP_MINSIZE 16
+
+/*
+ * Open addressing hash map from IRC names to pointers, comparing keys under
+ * an IRC casemapping.
+ *
+ * Keys are not copied: they usually point into the value itself (a user's
+ * prefix, a channel's name) and must stay valid and unchanged while they
+ * are in the map. Only the first len bytes of a key count, which lets the
+ * nick part of a nick!user@host prefix serve as key without a copy.
+ */
+typedef struct strmap_slot
+{
+    const char *key; /* NULL for an empty slot */
+    size_t len;
+    unsigned int hash;
+
+    void *value;
+} strmap_slot;
+
+typedef struct strmap
+{
+    strmap_slot *slots;
+    size_t size;
+    size_t count;
+
+    irc_casemapping casemap;
+} strmap;
+
+
+int strmap_init(strmap **, irc_casemapping);
+void strmap_destroy(strmap *);
+
+void *strmap_get(strmap *, const char *, size_t);
+int strmap_put(strmap *, const char *, size_t, void *);
+void *strmap_remove(strmap *, const char *, size_t);
+void strmap_clear(strmap *);
+
+int strmap_set_casemap(strmap *, irc_casemapping);
+
+void *strmap_next(strmap *, size_t *);
+
+#endif
@@ -18,6 +18,9 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <signal.h>
+#include <stdint.h>
+#include <unistd.h>
 
 #include "util.h"
 #include "mm.h"
@@ -51,3 +54,30 @@ char *xstrndup(const char *s, size_t l)
     else
         return NULL;
 }
+
+int thread_start(pthread_t *thread, void *(*fn)(void *), void *arg)
+{
+    sigset_t all, old;
+    int r;
+
+    /* Signals are for the main thread, it's the one the killswitch wakes.
+     * The new thread inherits the mask, ours is put back right after */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+
+    r = pthread_create(thread, NULL, fn, arg);
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    return r != 0;
+}
+
+void eventfd_poke(int fd)
+{
+    uint64_t one = 1;
+
+    if (write(fd, &one, sizeof(one)) < 0)
+        ; /* Counter overflow, whoever waits is woken up anyway */
+
+    return;
+}
@@ -19,8 +19,14 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include <stddef.h>
+#include <pthread.h>
+
 char *itoa(int);
 char *xstrdup(const char *);
 char *xstrndup(const char *, size_t);
 
+int thread_start(pthread_t *, void *(*)(void *), void *);
+void eventfd_poke(int);
+
 #endif
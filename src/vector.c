@@ -0,0 +1,155 @@
+/*
+ * This file is part of Luna
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mm.h"
+#include "vector.h"
+
+
+int vector_init(vector **vec, size_t capacity)
+{
+    vector *tmp;
+
+    if (capacity < VECTOR_MINSIZE)
+        capacity = VECTOR_MINSIZE;
+
+    if ((tmp = mm_malloc(sizeof(*tmp))) == NULL)
+        return 1;
+
+    if ((tmp->items = mm_malloc(capacity * sizeof(void *))) == NULL)
+    {
+        mm_free(tmp);
+        return 1;
+    }
+
+    tmp->length = 0;
+    tmp->capacity = capacity;
+
+    *vec = tmp;
+
+    return 0;
+}
+
+void vector_destroy(vector *vec, void (*free_content)(void *))
+{
+    if (vec == NULL)
+        return;
+
+    vector_clear(vec, free_content);
+
+    mm_free(vec->items);
+    mm_free(vec);
+
+    return;
+}
+
+int vector_push(vector *vec, void *item)
+{
+    if (vec->length == vec->capacity)
+    {
+        void **items = mm_realloc(vec->items,
+                                  vec->capacity * 2 * sizeof(void *));
+
+        if (items == NULL)
+            return 1;
+
+        vec->items = items;
+        vec->capacity *= 2;
+    }
+
+    vec->items[vec->length++] = item;
+
+    return 0;
+}
+
+void *vector_find(vector *vec, const void *data,
+                  int (*cmp)(const void *, const void *))
+{
+    size_t i;
+
+    for (i = 0; i < vec->length; ++i)
+        if (!cmp(data, vec->items[i]))
+            return vec->items[i];
+
+    return NULL;
+}
+
+long vector_index(vector *vec, const void *item)
+{
+    size_t i;
+
+    for (i = 0; i < vec->length; ++i)
+        if (vec->items[i] == item)
+            return (long)i;
+
+    return -1;
+}
+
+void vector_swap_remove(vector *vec, size_t i)
+{
+    if (i >= vec->length)
+        return;
+
+    /* The last element takes the hole, order is not kept */
+    vec->items[i] = vec->items[--(vec->length)];
+
+    return;
+}
+
+void vector_remove(vector *vec, size_t i)
+{
+    if (i >= vec->length)
+        return;
+
+    memmove(&(vec->items[i]), &(vec->items[i + 1]),
+            (vec->length - i - 1) * sizeof(void *));
+    vec->length--;
+
+    return;
+}
+
+int vector_delete(vector *vec, void *item, void (*f)(void *))
+{
+    long i = vector_index(vec, item);
+
+    if (i < 0)
+        return 1;
+
+    /* Ordered removal, callers that don't care use vector_swap_remove() */
+    vector_remove(vec, (size_t)i);
+
+    if (f != NULL)
+        f(item);
+
+    return 0;
+}
+
+void vector_clear(vector *vec, void (*free_content)(void *))
+{
+    size_t i;
+
+    if (free_content != NULL)
+        for (i = 0; i < vec->length; ++i)
+            free_content(vec->items[i]);
+
+    vec->length = 0;
+
+    return;
+}
@@ -0,0 +1,53 @@
+/*
+ * This file is part of Luna
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef VECTOR_H
+#define VECTOR_H
+
+#include <stddef.h>
+
+/* Slots a new vector starts out with */
+#define VECTOR_MINSIZE 8
+
+/*
+ * Growable array of pointers. Iterating is a walk over contiguous memory,
+ * appending is amortized O(1) and removal either keeps the order (and
+ * moves the tail down) or swaps the last element into the hole.
+ */
+typedef struct vector
+{
+    void **items;
+    size_t length;
+    size_t capacity;
+} vector;
+
+
+int vector_init(vector **, size_t);
+void vector_destroy(vector *, void ( *)(void *));
+
+int vector_push(vector *, void *);
+void *vector_find(vector *, const void *,
+                  int ( *)(const void *, const void *));
+long vector_index(vector *, const void *);
+
+void vector_swap_remove(vector *, size_t);
+void vector_remove(vector *, size_t);
+int vector_delete(vector *, void *, void ( *)(void *));
+void vector_clear(vector *, void ( *)(void *));
+
+#endif